@@ -106,14 +106,20 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
  * TLB shootdown bits.
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
+ *
+ * One shootdown carries a whole batch of frames of one address space
+ * (all of its translations if ts_npages is 0). The target V's ts_done
+ * when it is finished, and the sender waits for that before it reuses
+ * the frames.
  */
 
+struct semaphore;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
 	struct addrspace *ts_addrspace;
-	vaddr_t ts_vaddr;
+	const paddr_t *ts_pages;
+	unsigned ts_npages;
+	struct semaphore *ts_done;
 };
 
 #define TLBSHOOTDOWN_MAX 16
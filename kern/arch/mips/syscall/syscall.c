@@ -114,6 +114,11 @@ syscall(struct trapframe *tf)
 		err = sys___time((userptr_t)tf->tf_a0,
 				 (userptr_t)tf->tf_a1);
 		break;
+
+	    case SYS_nanosleep:
+		err = sys_nanosleep((userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
 	    case SYS_open:
 		err = sys__open((char *)tf->tf_a0,tf->tf_a1,tf->tf_a2,&retval);
 		break;
@@ -126,6 +131,26 @@ syscall(struct trapframe *tf)
 	    case SYS_write:
 		err = sys__write(tf->tf_a0,(void *)tf->tf_a1,tf->tf_a2,&retval);
 		break;
+	    case SYS_readv:
+		err = sys__readv(tf->tf_a0,(const struct iovec *)tf->tf_a1,tf->tf_a2,&retval);
+		break;
+	    case SYS_writev:
+		err = sys__writev(tf->tf_a0,(const struct iovec *)tf->tf_a1,tf->tf_a2,&retval);
+		break;
+	    case SYS_pread:
+	    case SYS_pwrite:
+		/* the 64-bit offset is aligned past a3, so it's on the stack */
+		err = copyin((const_userptr_t)(tf->tf_sp+16), &pos, sizeof(pos));
+		if (err) {
+			break;
+		}
+		if (callno == SYS_pread) {
+			err = sys__pread(tf->tf_a0,(void *)tf->tf_a1,tf->tf_a2,pos,&retval);
+		}
+		else {
+			err = sys__pwrite(tf->tf_a0,(void *)tf->tf_a1,tf->tf_a2,pos,&retval);
+		}
+		break;
 	    case SYS_lseek:
 		
                 pos |=  tf->tf_a2;
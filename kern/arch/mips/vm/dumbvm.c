@@ -46,6 +46,10 @@
 #include <vfs.h>
 #include <vnode.h>
 #include <kern/fcntl.h>
+#include <bitmap.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
+#include <clock.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -54,14 +58,13 @@
  * assignment, this file is not included in your kernel!
  */
 
-/* under dumbvm, always have 48k of user stack */
+/*
+ * under dumbvm, start with 48k of user stack; it grows down on demand,
+ * up to this much at a time (see as_grow_stack)
+ */
 #define DUMBVM_STACKPAGES    12
 
 
-#define ONDISK 'd'
-#define INMEMORY 'r'
-
-
 /*
  * Wrap rma_stealmem in a spinlock.
 
@@ -70,18 +73,157 @@
 //declare the coremap. Will be kept static
 
 static struct page * coremap;
-static struct lock * lk_tlb;
 static struct lock * lk_core_map;
 static paddr_t firstaddr, lastaddr, freeaddr;
 static unsigned long no_of_pages;
 static int is_vm_bootstrapped = 0;
 
+/*
+ * Buddy free lists. free_area[k] holds the heads of free blocks of
+ * 2^k contiguous frames, with frame indexes aligned to 2^k. All of
+ * this is protected by lk_core_map.
+ */
+static struct page * free_area[COREMAP_NORDERS];
+static unsigned long free_area_count[COREMAP_NORDERS];
+static unsigned long no_of_free_pages;
+
+#define KVADDR_TO_PADDR(vaddr) ((vaddr) - MIPS_KSEG0)
+#define PADDR_TO_CM_INDEX(paddr) (((paddr) - firstaddr) / PAGE_SIZE)
+#define CM_INDEX_TO_PADDR(index) (firstaddr + (index) * PAGE_SIZE)
+
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
 // declaration for page swapping - Anuj Kaul zindabaad - Iska code zindabaad tha, zindabaad hai aur zindabaad rahega(sunny deol style)
 static struct vnode* swapfile;
 static unsigned long no_of_swap_slots;
-static unsigned int swap_index;
+/* one bit per slot of the swap disk, set while the slot is in use. Protected by lk_core_map. */
+static struct bitmap * swap_map;
+/*
+ * References to each slot in use: one per swapped-out PTE naming it,
+ * plus one for a CLEAN frame whose copy it holds. A frame shared
+ * copy-on-write is swapped out to a single slot that all of its PTEs
+ * then share. Protected by lk_core_map.
+ */
+static unsigned * swap_refs;
+/*
+ * Slots a swap-out is still writing. Their PTEs already name them, so
+ * a fault has to wait (swap_wait) before reading one back. Protected
+ * by lk_core_map; cv_swapio is signalled when writes finish.
+ */
+static struct bitmap * swap_busy;
+static struct cv * cv_swapio;
+/* where the last slot was handed out; the next one is tried right after it */
+static unsigned swap_next;
+
+/*
+ * Pages are moved to and from swap up to SWAP_CLUSTER at a time: the
+ * pageout thread writes runs of consecutive slots with one request and
+ * a swap-in fault reads the following slots along with the one it
+ * needs if they belong to the following pages.
+ */
+#define SWAP_CLUSTER 8
+
+/*
+ * Page replacement. The clock hand sweeps the coremap looking for a
+ * user frame whose reference bit is clear; vm_fault sets the bit every
+ * time it loads a translation into the TLB.
+ *
+ * The pageout thread evicts ahead of demand: it is woken when the free
+ * frame count drops below pageout_lowater and runs until it is back up
+ * to pageout_hiwater, so that faults only have to evict (and wait for
+ * the disk) themselves when it cannot keep up.
+ */
+static unsigned long clock_hand;
+static unsigned long pageout_lowater, pageout_hiwater;
+static struct cv * cv_pageout;
+/* how long the pageout thread waits before rescanning when it found nothing to evict */
+#define PAGEOUT_RETRY_TICKS (HZ / 10)
+
+/* Counters, printed by vm_printstats. Protected by lk_core_map. */
+static unsigned long vmstat_faults;
+static unsigned long vmstat_swapins;
+static unsigned long vmstat_swapouts;
+static unsigned long vmstat_cleandrops;	/* clean pages evicted without a write */
+static unsigned long vmstat_readahead;	/* pages swapped in ahead of a fault */
+static unsigned long vmstat_swapwrites;	/* disk requests for swap-outs */
+static unsigned long vmstat_swapreads;	/* disk requests for swap-ins */
+static unsigned long vmstat_pageouts;	/* swapouts done by the pageout thread */
+
+/*
+ * Software TLB refill cache. Each cpu keeps a small hashed cache of
+ * the translations it has recently loaded, tagged with the address
+ * space generation (as_gen) they were loaded under. A TLB miss that
+ * hits in the cache is refilled without locks or a page table walk.
+ *
+ * Generations come from one global counter, so a number is never
+ * reused - not even by an address space allocated where a destroyed
+ * one used to be - and 0 never matches. Anything that takes away or
+ * write protects a translation calls as_newgen, which invalidates all
+ * of that address space's cache entries on every cpu at once.
+ *
+ * tc_activegen is the generation of the address space whose entries
+ * are in this cpu's TLB; as_activate only flushes the TLB when that
+ * changes, so switching between threads of the same process, or to a
+ * kernel thread and back, keeps the TLB warm.
+ *
+ * tc_activeas is that address space, and tc_cpu the cpu itself; other
+ * cpus read these (without a lock) to decide who needs a shootdown.
+ * Everything else is only ever touched by its own cpu, with
+ * interrupts off.
+ */
+#define TLBCACHE_SIZE	128
+#define TLBCACHE_HASH(va) (((va) >> 12) & (TLBCACHE_SIZE - 1))
+
+struct tlbcache {
+	struct {
+		uint32_t gen;
+		vaddr_t vpn;
+		uint32_t elo;
+	} tc_ent[TLBCACHE_SIZE];
+	uint32_t tc_activegen;
+	struct addrspace *tc_activeas;
+	struct cpu *tc_cpu;
+	unsigned long tc_hits;
+	unsigned long tc_misses;
+	unsigned long tc_flushes;
+};
+
+static struct tlbcache tlbcache[MAXCPUS];
+static uint32_t vm_gen;		/* last generation handed out; lk_core_map */
+
+/*
+ * Per-cpu frame magazines. Single frames are allocated from and freed
+ * to a small stack of free frames owned by the current cpu, touched
+ * only with interrupts off, so the common case takes no lock at all.
+ * An empty magazine is refilled with half a magazine's worth from the
+ * buddy lists under lk_core_map, and a full one drains half back.
+ *
+ * Frames in a magazine are FREE with order -1, so the buddy code never
+ * merges them, and are not counted in no_of_free_pages; the pageout
+ * thread's water marks only look at the shared pool.
+ */
+#define FRAME_MAGSIZE	32
+
+struct frame_magazine {
+	unsigned long fm_frames[FRAME_MAGSIZE];
+	unsigned fm_count;
+	unsigned long fm_hits;
+	unsigned long fm_misses;
+};
+
+static struct frame_magazine frame_mag[MAXCPUS];
+
+/* V'd by the targets of a shootdown; only one is ever in flight (lk_shootdown) */
+static struct semaphore * sem_shootdown;
+/* one shootdown at a time; see vm_shootdown */
+static struct lock * lk_shootdown;
+static unsigned long vmstat_shootdowns;
+
+static void coremap_free_range(unsigned long, unsigned long);
+static void pageout_thread(void *, unsigned long);
+static void as_newgen(struct addrspace *);
+static void frame_free(unsigned long);
+static void vm_shootdown(struct addrspace *, const paddr_t *, unsigned);
 
 
 void
@@ -99,21 +241,56 @@ vm_bootstrap(void)
 	no_of_kern_pages = (freeaddr - firstaddr)/PAGE_SIZE + 1;
 	for(i=0;i<no_of_pages;i++)
 	{
-		
+
 		coremap[i].as = NULL;
 		coremap[i].va = 0;
-		coremap[i].timestamp = 0;
+		coremap[i].referenced = false;
 		coremap[i].num_pages = 0;
-		if(i < no_of_kern_pages) //all coremap entry pages are marked as fixed. So no swapping for these pages. we dont want trouble
+		coremap[i].refcount = 0;
+		coremap[i].swapslot = -1;
+		coremap[i].order = -1;
+		coremap[i].next = NULL;
+		coremap[i].prev = NULL;
+		//all coremap entry pages are marked as fixed. So no swapping for these pages. we dont want trouble
 		coremap[i].cur_state = FIXED;
-		else
-		coremap[i].cur_state = FREE;
 	}
+	for(i=0;i<COREMAP_NORDERS;i++)
+	{
+		free_area[i] = NULL;
+		free_area_count[i] = 0;
+	}
+	no_of_free_pages = 0;
+	// everything past the coremap goes onto the buddy free lists
+	coremap_free_range(no_of_kern_pages, no_of_pages - no_of_kern_pages);
+
 	lk_core_map = lock_create("coremap_lock");
-	lk_tlb = lock_create("tlb_lock");
+	cv_pageout = cv_create("pageout");
+	cv_swapio = cv_create("swapio");
+	sem_shootdown = sem_create("shootdown", 0);
+	lk_shootdown = lock_create("shootdown");
+	if(lk_core_map == NULL || cv_pageout == NULL || cv_swapio == NULL ||
+	   sem_shootdown == NULL || lk_shootdown == NULL)
+	{
+		panic("vm_bootstrap: out of memory\n");
+	}
 	pageswap();	
+	pt_bootstrap();
+
+	// keep about 1/32 of memory free, but never less than a handful of frames
+	pageout_lowater = no_of_free_pages / 32;
+	if(pageout_lowater < 8)
+	{
+		pageout_lowater = 8;
+	}
+	pageout_hiwater = pageout_lowater * 2;
+	clock_hand = 0;
+
 	is_vm_bootstrapped = 1;
-	/* Do nothing. */
+
+	if(thread_fork("pageout", pageout_thread, NULL, 0, NULL))
+	{
+		panic("vm_bootstrap: could not start the pageout thread\n");
+	}
 }
 
 /*Kaul saab ki jai*/
@@ -131,58 +308,493 @@ void pageswap(){
 		
 		VOP_STAT(swapfile,&tpage);
 		no_of_swap_slots = tpage.st_size/PAGE_SIZE;
+		swap_map = bitmap_create(no_of_swap_slots);
+		swap_refs = kmalloc(no_of_swap_slots * sizeof(unsigned));
+		swap_busy = bitmap_create(no_of_swap_slots);
+		if(swap_map == NULL || swap_refs == NULL || swap_busy == NULL){
+			panic("Virtual Memory Error: no memory for the swap map\n");
+		}
+		bzero(swap_refs, no_of_swap_slots * sizeof(unsigned));
+}
+
+/*
+ * Swap slot allocation. The caller holds lk_core_map. Slots are handed
+ * out one after another while they last so that pages evicted together
+ * land next to each other and can be written with a single request.
+ * Returns ENOMEM if the swap disk is full.
+ */
+static
+int
+swap_alloc(unsigned *ret)
+{
+	unsigned slot;
+
+	KASSERT(lock_do_i_hold(lk_core_map));
+	if(swap_next < no_of_swap_slots && !bitmap_isset(swap_map, swap_next))
+	{
+		slot = swap_next;
+		bitmap_mark(swap_map, slot);
+	}
+	else if(bitmap_alloc(swap_map, &slot))
+	{
+		return ENOMEM;
+	}
+	swap_next = slot + 1;
+	swap_refs[slot] = 1;
+	*ret = slot;
+	return 0;
 }
 
+/* Add a reference to a slot in use. The caller holds lk_core_map. */
+static
+void
+swap_ref(unsigned slot)
+{
+	KASSERT(lock_do_i_hold(lk_core_map));
+	KASSERT(swap_refs[slot] > 0);
+	swap_refs[slot]++;
+}
+
+/* Drop a reference to a slot; it is free again with the last one. */
+static
+void
+swap_free(unsigned slot)
+{
+	KASSERT(lock_do_i_hold(lk_core_map));
+	KASSERT(bitmap_isset(swap_map, slot));
+	KASSERT(swap_refs[slot] > 0);
+	swap_refs[slot]--;
+	if(swap_refs[slot] == 0)
+	{
+		bitmap_unmark(swap_map, slot);
+	}
+}
+
+/*
+ * Wait until SLOT is not being written, so that reading it gets what
+ * was swapped out. The caller holds lk_core_map and a reference to the
+ * slot; slots only get written when freshly allocated, so once this
+ * returns the slot stays readable.
+ */
+static
+void
+swap_wait(unsigned slot)
+{
+	KASSERT(lock_do_i_hold(lk_core_map));
+	while(bitmap_isset(swap_busy, slot))
+	{
+		cv_wait(cv_swapio, lk_core_map);
+	}
+}
+
+/*
+ * The PTE through which AS maps frame PA at VA, or NULL if it doesn't.
+ * The caller holds lk_core_map.
+ */
+static
+pte_t *
+frame_pte(struct addrspace *as, vaddr_t va, paddr_t pa)
+{
+	pte_t *pte;
+
+	pte = pt_lookup(as->table, va, false);
+	if(pte == NULL || (*pte & PTE_VALID) == 0 || (*pte & PTE_FRAME) != pa)
+	{
+		return NULL;
+	}
+	return pte;
+}
+
+/*
+ * Pick a user frame to evict with the clock (second chance) algorithm.
+ * A frame that has been referenced since the hand last passed gets its
+ * bit cleared and its TLB entry dropped, so the next use faults and
+ * sets the bit again. Dirty frames are passed over while swap is full;
+ * clean ones can still go. Two full turns without finding a victim
+ * means nothing is evictable; return 0 and let the caller decide.
+ *
+ * Every PTE mapping the frame is pointed at its swap slot - the one it
+ * already has if it is CLEAN, a fresh one otherwise. A frame shared
+ * copy-on-write is mapped at the same address by each sharer, so they
+ * are found by looking that address up in each address space on the
+ * owner's share ring; the owner is left for the caller, which finishes
+ * the job with swapout_pages. The frame keeps its owner until then so
+ * the TLB shootdowns can be batched per address space. The other
+ * sharers' TLBs are shot down here.
+ */
 paddr_t seek_victim(int seltype){
 
-	//... page was not available request for swap, using the algorithm
-	int index;
-	struct pagetable *pgtable;
+	unsigned long index, scanned;
+	struct addrspace *owner, *as;
+	pte_t *pte;
+	paddr_t pa;
+	vaddr_t va;
+	unsigned slot;
+	int n;
 	(void)seltype;
-	
-	while(1)
+
+	KASSERT(lock_do_i_hold(lk_core_map));
+	for(scanned = 0; scanned < 2 * no_of_pages; scanned++)
 	{
+		index = clock_hand;
+		clock_hand = (clock_hand + 1) % no_of_pages;
 
-			index = random()%no_of_pages;
-			if(coremap[index].cur_state == DIRTY)
+		if((coremap[index].cur_state != DIRTY && coremap[index].cur_state != CLEAN) ||
+		   coremap[index].as == NULL)
+		{
+			continue;
+		}
+		// the owner's PTE comes straight out of its page table
+		pa = CM_INDEX_TO_PADDR(index);
+		owner = coremap[index].as;
+		va = coremap[index].va;
+		pte = frame_pte(owner, va, pa);
+		if(pte == NULL)
+		{
+			// not mapped yet - whoever allocated it is still filling it in
+			continue;
+		}
+		if(coremap[index].refcount > 1)
+		{
+			// every mapping has to be accounted for before the frame can go
+			n = 1;
+			for(as = owner->as_sharenext; as != owner; as = as->as_sharenext)
 			{
-
-				pgtable = coremap[index].as->table;
-				
-				while(pgtable != NULL)
+				if(frame_pte(as, va, pa) != NULL)
 				{
-					if((pgtable->pa == firstaddr + index * PAGE_SIZE))
-					{
-						pgtable->swap_status = ONDISK;
-						pgtable->indx_swapfile = swap_index;
-						pgtable->pa = 0;
-						coremap[index].as = curthread->t_addrspace;
-						return(firstaddr + (index * PAGE_SIZE));
-						
-					}
-					pgtable = pgtable->next;
-
+					n++;
+				}
+			}
+			if(n != coremap[index].refcount)
+			{
+				continue;
+			}
+		}
+		if(coremap[index].referenced)
+		{
+			coremap[index].referenced = false;
+			tlb_invalidate(pa);
+			continue;
+		}
+		if(coremap[index].cur_state == DIRTY)
+		{
+			if(swap_alloc(&slot))
+			{
+				// nowhere to put it
+				continue;
+			}
+			coremap[index].swapslot = slot;
+			// in transit until swapout_pages has written it
+			bitmap_mark(swap_busy, slot);
+		}
+		// the frame's reference to the slot passes to the owner's PTE; each sharer gets one more
+		*pte = PTE_MKSWAP(coremap[index].swapslot);
+		as_newgen(owner);
+		if(coremap[index].refcount > 1)
+		{
+			for(as = owner->as_sharenext; as != owner; as = as->as_sharenext)
+			{
+				pte = frame_pte(as, va, pa);
+				if(pte == NULL)
+				{
+					continue;
 				}
+				swap_ref(coremap[index].swapslot);
+				*pte = PTE_MKSWAP(coremap[index].swapslot);
+				as_newgen(as);
+				vm_shootdown(as, &pa, 1);
 			}
+		}
+		return pa;
 	}
-	panic("lag gaaye");
 	return 0;
 	
 }
 
-void write_page(unsigned int swpindx, paddr_t swap_page){
+/*
+ * Second half of evicting frames picked by seek_victim: write each one
+ * to its swap slot, unless it is clean and the copy there is still
+ * good. Dirty frames with consecutive slots go out in one request.
+ * Either way the slots now belong to the PTEs, not the frames. The
+ * slots of dirty frames stay marked busy until their write is done.
+ *
+ * Called with lk_core_map held, and returns with it held, but drops
+ * it for the TLB shootdowns and the disk writes so that faults and
+ * allocations elsewhere don't wait for the disk. The victims are
+ * detached from their owners first; nothing maps them any more, so
+ * nobody else touches them meanwhile. Each slot being written gets an
+ * extra reference, so it can't be freed and handed out again (say by
+ * the owner exiting) before the write lands.
+ */
+static
+void
+swapout_pages(paddr_t *pas, unsigned npages)
+{
+	struct addrspace *owners[SWAP_CLUSTER];
+	paddr_t run[SWAP_CLUSTER];
+	unsigned i, j, nrun = 0, nwrites = 0;
+	int first = -1;
+	unsigned long index;
+
+	KASSERT(lock_do_i_hold(lk_core_map));
+	KASSERT(npages <= SWAP_CLUSTER);
+
+	for(i=0;i<npages;i++)
+	{
+		index = PADDR_TO_CM_INDEX(pas[i]);
+		owners[i] = coremap[index].as;
+		coremap[index].as = NULL;
+		coremap[index].va = 0;
+		if(coremap[index].cur_state == DIRTY)
+		{
+			swap_ref(coremap[index].swapslot);
+		}
+	}
+	lock_release(lk_core_map);
+
+	// get the victims out of every TLB first, one shootdown per address space
+	for(i=0;i<npages;i++)
+	{
+		if(owners[i] == NULL)
+		{
+			continue;
+		}
+		run[nrun++] = pas[i];
+		for(j=i+1;j<npages;j++)
+		{
+			if(owners[j] == owners[i])
+			{
+				run[nrun++] = pas[j];
+				owners[j] = NULL;
+			}
+		}
+		vm_shootdown(owners[i], run, nrun);
+		nrun = 0;
+	}
+
+	for(i=0;i<npages;i++)
+	{
+		index = PADDR_TO_CM_INDEX(pas[i]);
+		if(coremap[index].cur_state == DIRTY)
+		{
+			if(nrun > 0 && coremap[index].swapslot != first + (int)nrun)
+			{
+				write_pages(first, run, nrun);
+				nwrites++;
+				nrun = 0;
+			}
+			if(nrun == 0)
+			{
+				first = coremap[index].swapslot;
+			}
+			run[nrun++] = pas[i];
+		}
+	}
+	if(nrun > 0)
+	{
+		write_pages(first, run, nrun);
+		nwrites++;
+	}
+
+	lock_acquire(lk_core_map);
+	for(i=0;i<npages;i++)
+	{
+		index = PADDR_TO_CM_INDEX(pas[i]);
+		if(coremap[index].cur_state == DIRTY)
+		{
+			bitmap_unmark(swap_busy, coremap[index].swapslot);
+			swap_free(coremap[index].swapslot);
+			vmstat_swapouts++;
+		}
+		else
+		{
+			vmstat_cleandrops++;
+		}
+		coremap[index].cur_state = DIRTY;
+		coremap[index].swapslot = -1;
+	}
+	vmstat_swapwrites += nwrites;
+	cv_broadcast(cv_swapio, lk_core_map);
+}
+
+/*
+ * Evict one frame for a caller that found the free lists empty. Only
+ * happens when the pageout thread has fallen behind. Returns 0 if
+ * nothing can be evicted, i.e. memory and swap are both full.
+ */
+static
+paddr_t
+evict_page(void)
+{
+	paddr_t pa;
+
+	KASSERT(lock_do_i_hold(lk_core_map));
+	pa = seek_victim(0);
+	if(pa == 0)
+	{
+		return 0;
+	}
+	swapout_pages(&pa, 1);
+	bzero((void*)(PADDR_TO_KVADDR(pa)),PAGE_SIZE);
+	return pa;
+}
+
+/*
+ * Called with lk_core_map held after taking frames off the free lists.
+ */
+static
+void
+pageout_check(void)
+{
+	KASSERT(lock_do_i_hold(lk_core_map));
+	if(no_of_free_pages < pageout_lowater)
+	{
+		cv_signal(cv_pageout, lk_core_map);
+	}
+}
+
+/*
+ * The pageout thread. Sleeps until the free frame count falls below
+ * the low-water mark, then swaps out clock victims, up to SWAP_CLUSTER
+ * at a time, until it reaches the high-water mark. The coremap lock is
+ * dropped while each cluster is written (see swapout_pages) and between
+ * clusters, so faulting threads don't wait for the disk and can get at
+ * the frames already freed.
+ */
+static
+void
+pageout_thread(void *unused1, unsigned long unused2)
+{
+	paddr_t pas[SWAP_CLUSTER];
+	unsigned i, n;
+
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(lk_core_map);
+	while(1)
+	{
+		while(no_of_free_pages >= pageout_lowater)
+		{
+			cv_wait(cv_pageout, lk_core_map);
+		}
+		while(no_of_free_pages < pageout_hiwater)
+		{
+			n = 0;
+			while(n < SWAP_CLUSTER && no_of_free_pages + n < pageout_hiwater)
+			{
+				pas[n] = seek_victim(0);
+				if(pas[n] == 0)
+				{
+					break;
+				}
+				n++;
+			}
+			if(n == 0)
+			{
+				// everything left is busy, or dirty with swap full; try again shortly, or sooner if asked
+				cv_timedwait(cv_pageout, lk_core_map, PAGEOUT_RETRY_TICKS);
+				break;
+			}
+			swapout_pages(pas, n);
+			for(i=0;i<n;i++)
+			{
+				coremap_free_range(PADDR_TO_CM_INDEX(pas[i]), 1);
+			}
+			vmstat_pageouts += n;
+
+			lock_release(lk_core_map);
+			lock_acquire(lk_core_map);
+		}
+	}
+}
+
+unsigned long
+vm_npages(void)
+{
+	return no_of_pages;
+}
+
+void
+vm_printstats(void)
+{
+	unsigned long hits = 0, misses = 0, flushes = 0;
+	unsigned long maghits = 0, magmisses = 0, magframes = 0;
+	unsigned i;
+
+	lock_acquire(lk_core_map);
+	kprintf("vm: %lu free of %lu frames (low water %lu, high water %lu)\n",
+		no_of_free_pages, no_of_pages, pageout_lowater, pageout_hiwater);
+	kprintf("vm: %lu faults, %lu swap-ins, %lu swap-outs (%lu by pageout)\n",
+		vmstat_faults, vmstat_swapins, vmstat_swapouts + vmstat_cleandrops,
+		vmstat_pageouts);
+	kprintf("vm: %lu pages written to swap, %lu clean pages dropped\n",
+		vmstat_swapouts, vmstat_cleandrops);
+	kprintf("vm: %lu swap writes, %lu swap reads, %lu pages read ahead\n",
+		vmstat_swapwrites, vmstat_swapreads, vmstat_readahead);
+	lock_printstats(lk_core_map);
+	lock_release(lk_core_map);
+
+	for(i=0;i<MAXCPUS;i++)
+	{
+		hits += tlbcache[i].tc_hits;
+		misses += tlbcache[i].tc_misses;
+		flushes += tlbcache[i].tc_flushes;
+	}
+	kprintf("vm: TLB refill cache %lu hits, %lu misses; %lu TLB flushes\n",
+		hits, misses, flushes);
+	kprintf("vm: %lu TLB shootdowns sent\n", vmstat_shootdowns);
+
+	for(i=0;i<MAXCPUS;i++)
+	{
+		maghits += frame_mag[i].fm_hits;
+		magmisses += frame_mag[i].fm_misses;
+		magframes += frame_mag[i].fm_count;
+	}
+	kprintf("vm: frame magazines %lu hits, %lu misses, %lu frames cached\n",
+		maghits, magmisses, magframes);
+}
+
+/*
+ * Move NPAGES frames to or from the consecutive swap slots starting at
+ * SLOT. The frames need not be contiguous; each gets its own iovec and
+ * the whole lot goes to the disk as one request.
+ */
+static
+int
+swap_io(unsigned slot, paddr_t *pas, unsigned npages, enum uio_rw rw)
+{
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio u;
+	unsigned i;
 
-	struct iovec io_swap;
-	struct uio uio_swap;
-	tlb_invalidate(swap_page);	
-	uio_kinit(&io_swap, &uio_swap,(void*)PADDR_TO_KVADDR(swap_page), PAGE_SIZE, swpindx * PAGE_SIZE , UIO_WRITE);
+	KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
+	for(i=0;i<npages;i++)
+	{
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(pas[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	u.uio_iov = iov;
+	u.uio_iovcnt = npages;
+	u.uio_offset = (off_t)slot * PAGE_SIZE;
+	u.uio_resid = npages * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = rw;
+	u.uio_space = NULL;
+
+	if(rw == UIO_WRITE)
+	{
+		return VOP_WRITE(swapfile, &u);
+	}
+	return VOP_READ(swapfile, &u);
+}
 
+void write_pages(unsigned int swpindx, paddr_t *swap_pages, unsigned npages){
 
-	int reserror = VOP_WRITE(swapfile,&uio_swap);
+	int reserror = swap_io(swpindx, swap_pages, npages, UIO_WRITE);
 	if(reserror){
 		panic("VM ERROR : Swapping out Failed");
 	}
-	swap_index++;
 	
 }
 
@@ -207,39 +819,9 @@ void tlb_invalidate_all()
 		}
 	}
 }
-void handle_pagefault(vaddr_t virt_addr, struct addrspace * as) {
-	
-	paddr_t ppage_tbw = alloc_upages(1);
-	struct pagetable *head;
-	struct pagetable *current;
-
-	head = as->table;
-	current = head;
-
-	while(current != NULL){
-		if(current->va == virt_addr){
-			//if(current->swap_status == ONDISK){
-			current->pa = ppage_tbw;			
-			read_page(current->indx_swapfile,ppage_tbw);
-			current->swap_status=INMEMORY;
-			
-			tlb_invalidate(ppage_tbw);
-			//}
-			break;
-		}
-		current = current->next;
-	};
-
-
-}
-
+void read_pages(unsigned int frmflindx, paddr_t *swap_to_mem, unsigned npages){
 
-void read_page(unsigned int frmflindx, paddr_t swap_to_mem){
-
-	struct iovec io_swap;
-	struct uio uio_swap;
-	uio_kinit(&io_swap, &uio_swap, (void*)PADDR_TO_KVADDR(swap_to_mem), PAGE_SIZE, frmflindx * PAGE_SIZE , UIO_READ);
-	int result=VOP_READ(swapfile, &uio_swap);
+	int result=swap_io(frmflindx, swap_to_mem, npages, UIO_READ);
 	
 
 	if(result) {
@@ -248,21 +830,93 @@ void read_page(unsigned int frmflindx, paddr_t swap_to_mem){
 
 }
 
-/****************************************************************************************************/
-/* Addrspace functions*/
-/*******************************************************************************************************************/
-struct addrspace *
-as_create(void)
+/*
+ * Drop one mapping of a user frame. The frame is freed with the last
+ * mapping. If the address space giving it up was the one recorded as
+ * owner, ownership passes to another address space on its share ring
+ * that still maps the frame, so the pager can always find a PTE.
+ */
+static
+void
+page_unref(unsigned long index, struct addrspace *as)
+{
+	struct addrspace *next;
+
+	KASSERT(lock_do_i_hold(lk_core_map));
+	KASSERT(coremap[index].refcount > 0);
+
+	coremap[index].refcount--;
+	if(coremap[index].refcount == 0)
+	{
+		if(coremap[index].cur_state == CLEAN)
+		{
+			swap_free(coremap[index].swapslot);
+		}
+		frame_free(index);
+	}
+	else if(coremap[index].as == as)
+	{
+		coremap[index].as = NULL;
+		for(next = as->as_sharenext; next != as; next = next->as_sharenext)
+		{
+			if(frame_pte(next, coremap[index].va, CM_INDEX_TO_PADDR(index)) != NULL)
+			{
+				coremap[index].as = next;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Give AS a new generation number. See the comment on struct tlbcache.
+ */
+static
+void
+as_newgen(struct addrspace *as)
+{
+	KASSERT(lock_do_i_hold(lk_core_map));
+	vm_gen++;
+	if(vm_gen == 0)
+	{
+		vm_gen = 1;
+	}
+	as->as_gen = vm_gen;
+}
+
+/****************************************************************************************************/
+/* Addrspace functions*/
+/*******************************************************************************************************************/
+struct addrspace *
+as_create(void)
 {
 	struct addrspace *as = kmalloc(sizeof(struct addrspace));
 	if (as==NULL) {
 		return NULL;
 	}
 
+	as->table = pt_create();
+	if (as->table == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_lock = lock_create("as_lock");
+	if (as->as_lock == NULL) {
+		pt_destroy(as->table);
+		kfree(as);
+		return NULL;
+	}
+	lock_acquire(lk_core_map);
+	as_newgen(as);
+	as->as_sharenext = as;
+	as->as_shareprev = as;
+	lock_release(lk_core_map);
 	as->regions = NULL;
-	as->table = NULL;	
 	as->as_stackvbase = 0;
 	as->as_stackvtop = 0;
+	as->heap_start = 0;
+	as->heap_end = 0;
+	as->heap_pages = 0;
 
 	return as;
 }
@@ -271,46 +925,89 @@ void
 as_destroy(struct addrspace *as)
 {
 	struct region * cur_region;
-	
-	struct pagetable * cur_page;
+	pte_t * l2;
+	int i, j;
 
 	while (as->regions != NULL)
 	{
 		cur_region = as->regions;
 		as->regions = as->regions->next;
+		if(cur_region->vn != NULL)
+		{
+			VOP_DECREF(cur_region->vn);
+		}
 		kfree(cur_region);
 	}
 
-	while(as->table != NULL)
+	/*
+	 * Give back every resident frame. The PTEs are checked under the
+	 * coremap lock because the pager may be swapping them out under us.
+	 */
+	for(i=0;i<PT_L1_SIZE;i++)
 	{
-		cur_page = as->table;
-		//if(cur_page->pa == 0)
-		//{
-		//	KASSERT(cur_page->pa != 0);
-		//}
-		if(cur_page->swap_status == INMEMORY)
+		l2 = as->table->pt_dir[i];
+		if(l2 == NULL)
 		{
-			free_upages(cur_page->pa);
+			continue;
+		}
+		lock_acquire(lk_core_map);
+		for(j=0;j<PT_L2_SIZE;j++)
+		{
+			if(l2[j] & PTE_VALID)
+			{
+				page_unref(PADDR_TO_CM_INDEX(l2[j] & PTE_FRAME), as);
+			}
+			else if(l2[j] & PTE_SWAPPED)
+			{
+				swap_free(PTE_SWAPSLOT(l2[j]));
+			}
+			l2[j] = 0;
 		}
-		as->table = as->table->next;		
-		kfree(cur_page);
+		lock_release(lk_core_map);
 	}
-	
+
+	/* Nothing maps our frames any more; the pager can stop looking here. */
+	lock_acquire(lk_core_map);
+	as->as_shareprev->as_sharenext = as->as_sharenext;
+	as->as_sharenext->as_shareprev = as->as_shareprev;
+	lock_release(lk_core_map);
+
+	pt_destroy(as->table);
+	lock_destroy(as->as_lock);
+
 	kfree(as);
 }
 
 void
 as_activate(struct addrspace * as)
 {
+	struct tlbcache *tc;
 	int i, spl;
 
-	(void)as;
+	if(as == NULL)
+	{
+		/* kernel-only thread; the user entries can stay where they are */
+		return;
+	}
 
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	/*
+	 * Same address space, nothing taken away since it was loaded:
+	 * keep the TLB. tc_activeas must be set before the generation is
+	 * checked; see vm_shootdown.
+	 */
+	tc = &tlbcache[curcpu->c_number];
+	tc->tc_cpu = curcpu->c_self;
+	tc->tc_activeas = as;
+	if(tc->tc_activegen != as->as_gen)
+	{
+		for (i=0; i<NUM_TLB; i++) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+		tc->tc_activegen = as->as_gen;
+		tc->tc_flushes++;
 	}
 
 	splx(spl);
@@ -339,8 +1036,16 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	
 	
 	insert_region = (struct region *)kmalloc(sizeof(struct region));
+	if(insert_region == NULL)
+	{
+		return ENOMEM;
+	}
 	insert_region->va = vaddr;	
 	insert_region->no_of_pages = npages;
+	insert_region->vn = NULL;
+	insert_region->offset = 0;
+	insert_region->seg_va = vaddr;
+	insert_region->filesize = 0;
 	insert_region->next = NULL;
 	if(as->regions == NULL)
 	{
@@ -361,70 +1066,43 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	return 0;
 }
 
-/*static
-void
-as_zero_region(paddr_t paddr, unsigned npages)
+/*
+	Remember which file the region at vaddr is loaded from. The region holds a reference to the vnode until the address space goes away.
+*/
+int
+as_define_segment(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+		  off_t offset, size_t filesize)
 {
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
-}*/
+	struct region * r;
+
+	for(r = as->regions; r != NULL; r = r->next)
+	{
+		if(vaddr >= r->va && vaddr < r->va + r->no_of_pages * PAGE_SIZE)
+		{
+			break;
+		}
+	}
+	if(r == NULL || vaddr + filesize > r->va + r->no_of_pages * PAGE_SIZE)
+	{
+		return EINVAL;
+	}
+	KASSERT(r->vn == NULL);
+
+	VOP_INCREF(v);
+	r->vn = v;
+	r->offset = offset;
+	r->seg_va = vaddr;
+	r->filesize = filesize;
+	return 0;
+}
 
 /*
-	this is where i gets a little tricky. we create the address space for the process. We allocate user pages for all the defined
-	regions in as_define region. as user alloc accepts only one page at a time , we allocate one page at a time
+	Nothing to do here - pages are allocated by vm_fault the first time they are touched, and filled from the executable if they are part of a segment's file image.
 */
 int
 as_prepare_load(struct addrspace *as)
 {
 	(void)as;
-	/*struct region * tmp_region;
-	struct pagetable * page_entry;
-	struct pagetable * tmp_page;
-	tmp_region = as->regions;
-	
-	size_t count = 0;
-	size_t i;
-
-	while(tmp_region != NULL)
-	{	
-		// get the region
-		vaddr_t region_base;
-		region_base = tmp_region->va;
-		count = tmp_region->no_of_pages;	
-		tmp_page = as->table;
-		if(tmp_page != NULL)
-		{
-			while(tmp_page->next != NULL)
-			{
-				tmp_page = tmp_page->next;
-			}
-		}
-		// find the number of pages in the region and start allocationg it. alloc will bzero for us :)
-		for(i=0;i<count;i++)
-		{
-
-		 	page_entry = (struct pagetable *)kmalloc(sizeof(struct pagetable));
-			if(page_entry == NULL)
-			{
-				panic("could not allocate kernel memory\n");
-			}
-			//virtual address being computed according to the base address for the region.
-			page_entry->va = region_base + i * PAGE_SIZE;			
-			page_entry->pa = alloc_upages(1);
-			page_entry->next = NULL;
-			if(tmp_page == NULL)
-			{
-				as->table = page_entry;
-				tmp_page = as->table;
-			}
-			else
-			{
-				tmp_page->next = page_entry;
-				tmp_page = tmp_page->next;			
-			}
-		}
-		tmp_region = tmp_region->next;
-	}*/
-	
 	return 0;
 }
 
@@ -439,7 +1117,8 @@ int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
 
-	as->as_stackvbase = USERSTACK;
+	// the stack is filled in on demand; reserve the initial part now so sbrk cannot take it
+	as->as_stackvbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
 	as->as_stackvtop = USERSTACK;
 	*stackptr = USERSTACK;
 	return 0;
@@ -452,71 +1131,118 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
-	//int spl;
-	
 	struct addrspace *new;
-	struct region * temp_region;
 	struct region * old_region;
 	struct region * new_region;
-	struct pagetable * temp_table;
-	struct pagetable * old_table;
-	struct pagetable * new_table;
+	struct region ** tail;
+	pte_t * old_l2;
+	pte_t * new_pte;
+	paddr_t new_pa;
+	vaddr_t va;
+	unsigned int slot;
+	int i, j;
 
 	new = as_create();
 	if (new==NULL) {
 		return ENOMEM;
 	}
-	old_region = old->regions;
-	// copy all the regions. badly written code. 	
-	while(old_region != NULL)
+
+	// the child is going to share frames with us; join our share ring before it does
+	lock_acquire(lk_core_map);
+	new->as_sharenext = old->as_sharenext;
+	new->as_shareprev = old;
+	old->as_sharenext->as_shareprev = new;
+	old->as_sharenext = new;
+	lock_release(lk_core_map);
+
+	// copy all the regions, keeping them in order
+	tail = &new->regions;
+	for(old_region = old->regions; old_region != NULL; old_region = old_region->next)
 	{
 		new_region = (struct region *)kmalloc(sizeof(struct region));
+		if(new_region == NULL)
+		{
+			as_destroy(new);
+			return ENOMEM;
+		}
 		new_region->va = old_region->va;
 		new_region->no_of_pages = old_region->no_of_pages;
-		new_region->next = NULL;
-		if(new->regions == NULL)
-		{	
-			new->regions = new_region;
-		}
-		else
+		new_region->vn = old_region->vn;
+		if(new_region->vn != NULL)
 		{
-			temp_region = new->regions;
-			while(temp_region->next != NULL)
-			{
-				temp_region = temp_region->next;
-			}
-			temp_region->next = new_region;
+			VOP_INCREF(new_region->vn);
 		}
-		old_region = old_region->next;
-		
+		new_region->offset = old_region->offset;
+		new_region->seg_va = old_region->seg_va;
+		new_region->filesize = old_region->filesize;
+		new_region->next = NULL;
+		*tail = new_region;
+		tail = &new_region->next;
 	}
-	// copy the page table. equally bad code as above.
-	old_table = old->table;
-	while(old_table != NULL)
+
+	// copy the page table one second level table at a time
+	for(i=0;i<PT_L1_SIZE;i++)
 	{
-		new_table = (struct pagetable *)kmalloc(sizeof(struct pagetable));
-		new_table->va = old_table->va;
-		new_table->pa = alloc_upages(1);
-		new_table->next = NULL;
-		memmove((void *)PADDR_TO_KVADDR(new_table->pa),(const void *)PADDR_TO_KVADDR(old_table->pa),PAGE_SIZE);
-		if(new->table == NULL)
-		{	
-			new->table = new_table;
+		old_l2 = old->table->pt_dir[i];
+		if(old_l2 == NULL)
+		{
+			continue;
 		}
-		else
+		for(j=0;j<PT_L2_SIZE;j++)
 		{
-			temp_table = new->table;
-			while(temp_table->next != NULL)
+			if(old_l2[j] == 0)
+			{
+				continue;
+			}
+			va = PT_VADDR(i, j);
+			new_pte = pt_lookup(new->table, va, true);
+			if(new_pte == NULL)
+			{
+				as_destroy(new);
+				return ENOMEM;
+			}
+
+			/*
+			 * Resident pages are shared read-only with the child;
+			 * whichever side writes first gets its own copy in
+			 * vm_fault. Clearing PTE_DIRTY is what write-protects
+			 * them.
+			 */
+			lock_acquire(lk_core_map);
+			if(old_l2[j] & PTE_VALID)
+			{
+				coremap[PADDR_TO_CM_INDEX(old_l2[j] & PTE_FRAME)].refcount++;
+				old_l2[j] &= ~PTE_DIRTY;
+				*new_pte = old_l2[j];
+				lock_release(lk_core_map);
+				continue;
+			}
+			KASSERT(old_l2[j] & PTE_SWAPPED);
+			slot = PTE_SWAPSLOT(old_l2[j]);
+			swap_wait(slot);
+			lock_release(lk_core_map);
+
+			// swapped out pages are read back into a frame of the child's own
+			new_pa = alloc_upage(new, va);
+			if(new_pa == 0)
 			{
-				temp_table = temp_table->next;
+				as_destroy(new);
+				return ENOMEM;
 			}
-			temp_table->next = new_table;
+			read_pages(slot, &new_pa, 1);
+			*new_pte = new_pa | PTE_VALID | PTE_DIRTY;
 		}
-		old_table = old_table->next;
+	}
+
+	/* The parent's TLB entries may still allow writes to pages that are now shared. */
+	lock_acquire(lk_core_map);
+	as_newgen(old);
+	vm_shootdown(old, NULL, 0);
+	lock_release(lk_core_map);
 
- 	}
 	new->heap_start = old->heap_start;
 	new->heap_end = old->heap_end;
+	new->heap_pages = old->heap_pages;
 	new->as_stackvbase = old->as_stackvbase;
 	new->as_stackvtop = old->as_stackvtop;	
 	*ret = new;
@@ -540,444 +1266,1017 @@ getppages(unsigned long npages)
 	return addr;
 }
 
+/********************************** BUDDY ALLOCATOR ************************************************/
 
-//Here we allocate user level pages. We only allocate one page at a time. The logic will get easy later on. 
-paddr_t alloc_upages(int npages)
+/*
+ * Free list primitives. The caller holds lk_core_map (or is
+ * vm_bootstrap, before anybody else can get at the coremap).
+ */
+static
+void
+freelist_push(unsigned long index, int order)
 {
-	unsigned long i;
-	int isPageAvailable = 1;
-	lock_acquire(lk_core_map);
-	paddr_t returnPhyPage;
-	if(npages == 1)
+	struct page *pg = &coremap[index];
+
+	pg->order = order;
+	pg->prev = NULL;
+	pg->next = free_area[order];
+	if(free_area[order] != NULL)
 	{
-		// Just scan through the entire list of coremap entries. Find a free page and allocate it. easy enough. Lets see if it works
-		// Pt to be noted. We return the physical address. So that we can store in the page table :)
-		for(i=0;i<no_of_pages;i++)
-		{
-			if(coremap[i].cur_state == FREE)
-			{
-				// mark as dirty.
-				coremap[i].cur_state = DIRTY;
-				coremap[i].va = PADDR_TO_KVADDR(firstaddr + i * PAGE_SIZE);
-				coremap[i].as = curthread->t_addrspace;
-				// bzero all allocated pages
-				bzero((void*)(PADDR_TO_KVADDR(firstaddr + i * PAGE_SIZE)),PAGE_SIZE);			
-				//offset to the real physical page
-					lock_release(lk_core_map);
-				return firstaddr + i * PAGE_SIZE;
-			}
-			else{
-				isPageAvailable = 0;
-			}
-			
-		}
-		if(isPageAvailable == 0){ // i.e. no free physical memory blocks time to free them has come
-			returnPhyPage = seek_victim(0);
-			//kprintf("this is the physical addr allocated:%d\n",returnPhyPage);
-			write_page(swap_index,returnPhyPage);				
-			//swap_index++;
-			bzero((void*)(PADDR_TO_KVADDR(returnPhyPage)),PAGE_SIZE);			
-			lock_release(lk_core_map);
-			return returnPhyPage;
-		}
+		free_area[order]->prev = pg;
 	}
-	lock_release(lk_core_map);
-	panic("could not allocate a page.....!\n");
-	return 0;
+	free_area[order] = pg;
+	free_area_count[order]++;
 }
 
-// As we allocated only one user level page at a time. We only free one page in this case too. Another hope this works
-void free_upages(paddr_t pa)
+static
+void
+freelist_remove(unsigned long index, int order)
 {
-	
-	unsigned long i;
-	
-	for(i=0;i<no_of_pages;i++)
+	struct page *pg = &coremap[index];
+
+	KASSERT(pg->order == order);
+	if(pg->prev != NULL)
 	{
-		if(firstaddr + i * PAGE_SIZE == pa)
-		{
-			// set the state to free so others can use it.
-			coremap[i].cur_state = FREE;
-			coremap[i].va = 0;
-			coremap[i].as = NULL;
-			//not necessary but should do it
-			//bzero((void*)(PADDR_TO_KVADDR(firstaddr + i * PAGE_SIZE)),PAGE_SIZE);		
-			break;
-		}
+		pg->prev->next = pg->next;
+	}
+	else
+	{
+		free_area[order] = pg->next;
 	}
-	if(i>=no_of_pages)
+	if(pg->next != NULL)
 	{
-		panic("could not free a page\n");
+		pg->next->prev = pg->prev;
 	}
+	pg->next = NULL;
+	pg->prev = NULL;
+	pg->order = -1;
+	free_area_count[order]--;
 }
 
-/* Allocate/free some  kernel-space virtual pages */
-// this is badly written. But it works(i guess). Just find n contineous free spaces and allocate the space. This is why we store the num_pages in the page array. Will later help to free all the allocated memory
-vaddr_t 
-alloc_kpages(int npages)
+/*
+ * Put a free, 2^order aligned block back on the free lists, merging
+ * it with its buddy for as long as the buddy is free as well.
+ */
+static
+void
+buddy_free(unsigned long index, int order)
 {
-	unsigned long i;
-	unsigned long j;
-	struct pagetable * pgtable;
-	int count = 0;
-	paddr_t pa;
-	if(is_vm_bootstrapped == 0)
-	{
-		pa = getppages(npages);
-		if (pa==0) {
-			return 0;
-		}
-		return PADDR_TO_KVADDR(pa);
-	}
-	else
+	unsigned long buddy;
+
+	while(order < COREMAP_NORDERS - 1)
 	{
-		lock_acquire(lk_core_map);
-		for(i=0;i<no_of_pages;i++)
+		buddy = index ^ (1UL << order);
+		if(buddy + (1UL << order) > no_of_pages)
 		{
-			if(coremap[i].cur_state == FREE)
-			{
-				count++;
-				if(count == npages)
-				{
-					for(j=i;j> i-npages; j--)
-					{
-						coremap[j].cur_state = FIXED;
-						bzero((void*)(PADDR_TO_KVADDR(firstaddr + j * PAGE_SIZE)),PAGE_SIZE);		
-					}
-					coremap[(i - npages) + 1].num_pages = count;
-					lock_release(lk_core_map);
-					return PADDR_TO_KVADDR(firstaddr + (((i - npages) + 1) * PAGE_SIZE));
-					
-				}
-			}
-			else
-			{
-				// start re-counting is case no contineous free space found
-				count = 0;
-			}
+			break;
 		}
-		
-		if(npages == 1)
+		if(coremap[buddy].cur_state != FREE || coremap[buddy].order != order)
 		{
-			while(1)
-			{
-				int index = random()%no_of_pages;
-				if(coremap[index].cur_state == DIRTY)
-				{
-					
-					//bzero((void*)(PADDR_TO_KVADDR(firstaddr + j * PAGE_SIZE)),PAGE_SIZE);
-					pgtable = coremap[index].as->table;
-					do{
-						if(pgtable->pa == firstaddr + index * PAGE_SIZE)
-						{
-							pgtable->swap_status = ONDISK;
-							pgtable->indx_swapfile = swap_index;
-							write_page(swap_index,pgtable->pa);				
-						
-							coremap[index].as = NULL;
-							coremap[index].num_pages = 1;
-							coremap[index].cur_state = FIXED;
-							bzero((void*)(PADDR_TO_KVADDR(firstaddr + index * PAGE_SIZE)),PAGE_SIZE);	
-							lock_release(lk_core_map);
-							return PADDR_TO_KVADDR(firstaddr + index * PAGE_SIZE);
-				
-						}
-						pgtable = pgtable->next;
-					}while(pgtable->next != NULL);
-						
-						
-				}
-				else
-				{
-					continue;
-				}
-				
-									
-			}
+			break;
 		}
+		freelist_remove(buddy, order);
+		index &= ~(1UL << order);
+		order++;
 	}
-	lock_release(lk_core_map);
-	
-	panic("could not allocate a kernel page.....!\n");
-	return 0;
+	freelist_push(index, order);
 }
 
-void 
-free_kpages(vaddr_t addr)
+/*
+ * Take a block of 2^order frames off the free lists, splitting a
+ * larger block if there is nothing of the right size. Returns the
+ * index of the first frame, or -1 if no block is big enough.
+ */
+static
+long
+buddy_alloc(int order)
 {
-	/* nothing - leak the memory. */
-	// we will now free the momory. n contineous allocations should be freed
-	unsigned long i;
-	int j;
-	for(i=0;i<no_of_pages;i++)
+	int k;
+	unsigned long index;
+
+	for(k=order;k<COREMAP_NORDERS;k++)
 	{
-		if(PADDR_TO_KVADDR(firstaddr + i * PAGE_SIZE) == addr)
+		if(free_area[k] != NULL)
 		{
-			for(j=0;j<coremap[i].num_pages;j++)	
-			{
-				//bzero((void *)PADDR_TO_KVADDR(firstaddr + (i +j) * PAGE_SIZE), PAGE_SIZE);
-				coremap[i+j].num_pages = 0;
-				coremap[i+j].cur_state = FREE;
-			}
 			break;
-		}	
+		}
+	}
+	if(k >= COREMAP_NORDERS)
+	{
+		return -1;
 	}
 
+	index = free_area[k] - coremap;
+	freelist_remove(index, k);
+	// give back the upper halves until the block is the size we want
+	while(k > order)
+	{
+		k--;
+		freelist_push(index + (1UL << k), k);
+	}
+	return index;
 }
 
+/*
+ * Mark npages frames starting at index free and hand them to the
+ * buddy lists as the largest aligned blocks that fit.
+ */
+static
 void
-vm_tlbshootdown_all(void)
+coremap_free_range(unsigned long index, unsigned long npages)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
-}
+	unsigned long i;
+	int order;
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
-{
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	for(i=index;i<index+npages;i++)
+	{
+		coremap[i].cur_state = FREE;
+		coremap[i].as = NULL;
+		coremap[i].va = 0;
+		coremap[i].num_pages = 0;
+		coremap[i].refcount = 0;
+		coremap[i].swapslot = -1;
+		coremap[i].referenced = false;
+		coremap[i].order = -1;
+	}
+	no_of_free_pages += npages;
+
+	while(npages > 0)
+	{
+		order = 0;
+		while(order < COREMAP_NORDERS - 1 &&
+		      (index & ((1UL << (order + 1)) - 1)) == 0 &&
+		      (1UL << (order + 1)) <= npages)
+		{
+			order++;
+		}
+		buddy_free(index, order);
+		index += 1UL << order;
+		npages -= 1UL << order;
+	}
 }
 
+static
 int
-vm_fault(int faulttype, vaddr_t faultaddress)
+pages_to_order(unsigned long npages)
 {
+	int order = 0;
 
-	//vaddr_t vbase;
-	//, stackbase, stacktop;
-	struct pagetable * tmp_page;
-	struct addrspace * as;
-	struct pagetable * page_entry;
-	struct region * tmp_region;
-	paddr_t paddr;
-	int pg_count;
-	int i;
-	uint32_t ehi, elo, old_ehi, old_elo;
-
-	faultaddress &= PAGE_FRAME;
-	
-	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
-	
-	switch (faulttype) {
-	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		panic("dumbvm: got VM_FAULT_READONLY\n");
-	    case VM_FAULT_READ:
-	    case VM_FAULT_WRITE:
-		break;
-	    default:
-		return EINVAL;
+	while((1UL << order) < npages)
+	{
+		order++;
 	}
+	return order;
+}
 
-	as = curthread->t_addrspace;
-	if(as == NULL)
+/*
+ * Allocate npages contiguous frames. The block is rounded up to a
+ * power of two by the buddy lists and the unused tail is returned
+ * straight away. Returns the index of the first frame or -1.
+ */
+static
+long
+coremap_alloc_range(unsigned long npages, enum page_state state)
+{
+	long index;
+	unsigned long i;
+	int order;
+
+	order = pages_to_order(npages);
+	if(order >= COREMAP_NORDERS || npages > no_of_free_pages)
 	{
-		
-		return EFAULT;
+		return -1;
+	}
+	index = buddy_alloc(order);
+	if(index < 0)
+	{
+		return -1;
+	}
+	no_of_free_pages -= 1UL << order;
+	if((1UL << order) > npages)
+	{
+		coremap_free_range(index + npages, (1UL << order) - npages);
+	}
+	pageout_check();
+
+	for(i=index;i<index+npages;i++)
+	{
+		coremap[i].cur_state = state;
+		coremap[i].num_pages = 0;
+		// bzero all allocated pages
+		bzero((void*)(PADDR_TO_KVADDR(CM_INDEX_TO_PADDR(i))),PAGE_SIZE);
+	}
+	coremap[index].num_pages = npages;
+	return index;
+}
+
+/*
+ * Take a frame from this cpu's magazine, refilling it from the buddy
+ * lists if it is empty. Returns the frame index, or -1 if the buddy
+ * lists are empty too. The frame is still marked FREE.
+ */
+static
+long
+frame_alloc(void)
+{
+	struct frame_magazine *fm;
+	unsigned long batch[FRAME_MAGSIZE / 2];
+	unsigned n = 0;
+	long index;
+	int spl;
+
+	spl = splhigh();
+	fm = &frame_mag[curcpu->c_number];
+	if(fm->fm_count > 0)
+	{
+		index = fm->fm_frames[--fm->fm_count];
+		fm->fm_hits++;
+		splx(spl);
+		return index;
 	}
-	lock_acquire(lk_tlb);	
-	tmp_page = as->table;
-	while(tmp_page != NULL)
+	fm->fm_misses++;
+	splx(spl);
+
+	lock_acquire(lk_core_map);
+	while(n < FRAME_MAGSIZE / 2)
 	{
-		if((tmp_page->va <= faultaddress) && ((tmp_page->va + PAGE_SIZE) > faultaddress))
+		index = buddy_alloc(0);
+		if(index < 0)
 		{
-			if(tmp_page->swap_status == ONDISK)
-			{
-				//tmp_page->pa = alloc_upages(1);
-				handle_pagefault(tmp_page->va, curthread->t_addrspace);
-			}
-			paddr = faultaddress + tmp_page->pa - tmp_page->va;		
-			tmp_page->indx_swapfile = 0;
-			tmp_page->swap_status = INMEMORY;
-			//tlb_invalidate_all();
-			ehi = faultaddress;
-			elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-			DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-			for (i=0; i<NUM_TLB; i++) 
-			{
-					tlb_read(&old_ehi, &old_elo, i);
-					if ((old_elo & PAGE_FRAME) == (elo &  PAGE_FRAME))	
-					{
-				//		kprintf("i just invalidated a entry in stack code\n");
-						tlb_write(ehi, elo, i);
-						lock_release(lk_tlb);
-						return 0;
-					}
-			}
-			tlb_random(ehi, elo);
-			lock_release(lk_tlb);
-			return 0;
+			break;
+		}
+		no_of_free_pages--;
+		batch[n++] = index;
+	}
+	pageout_check();
+	lock_release(lk_core_map);
+	if(n == 0)
+	{
+		return -1;
+	}
+	index = batch[--n];
+
+	/* We may be on another cpu by now; that's fine, it's just a cache. */
+	spl = splhigh();
+	fm = &frame_mag[curcpu->c_number];
+	while(n > 0 && fm->fm_count < FRAME_MAGSIZE)
+	{
+		fm->fm_frames[fm->fm_count++] = batch[--n];
+	}
+	splx(spl);
 
+	if(n > 0)
+	{
+		lock_acquire(lk_core_map);
+		while(n > 0)
+		{
+			coremap_free_range(batch[--n], 1);
 		}
-		tmp_page = tmp_page->next;
+		lock_release(lk_core_map);
+	}
+	return index;
+}
+
+/*
+ * Give a single frame back through this cpu's magazine. May be called
+ * with or without lk_core_map held.
+ */
+static
+void
+frame_free(unsigned long index)
+{
+	struct frame_magazine *fm;
+	unsigned long batch[FRAME_MAGSIZE / 2];
+	unsigned n = 0;
+	bool held;
+	int spl;
+
+	coremap[index].as = NULL;
+	coremap[index].va = 0;
+	coremap[index].num_pages = 0;
+	coremap[index].refcount = 0;
+	coremap[index].swapslot = -1;
+	coremap[index].referenced = false;
+	coremap[index].order = -1;
+	coremap[index].cur_state = FREE;
+
+	spl = splhigh();
+	fm = &frame_mag[curcpu->c_number];
+	if(fm->fm_count == FRAME_MAGSIZE)
+	{
+		while(n < FRAME_MAGSIZE / 2)
+		{
+			batch[n++] = fm->fm_frames[--fm->fm_count];
+		}
+	}
+	fm->fm_frames[fm->fm_count++] = index;
+	splx(spl);
+
+	if(n > 0)
+	{
+		held = lock_do_i_hold(lk_core_map);
+		if(!held)
+		{
+			lock_acquire(lk_core_map);
+		}
+		while(n > 0)
+		{
+			coremap_free_range(batch[--n], 1);
+		}
+		if(!held)
+		{
+			lock_release(lk_core_map);
+		}
+	}
+}
+
+/****************************************************************************************************/
+
+//Here we allocate user level pages, one at a time. The owner and virtual address are recorded so the pager can find the PTE later on. Returns 0 when memory and swap are both full.
+paddr_t alloc_upage(struct addrspace *as, vaddr_t va)
+{
+	long index;
+	paddr_t returnPhyPage;
+
+	index = frame_alloc();
+	if(index >= 0)
+	{
+		returnPhyPage = CM_INDEX_TO_PADDR(index);
+		bzero((void*)(PADDR_TO_KVADDR(returnPhyPage)),PAGE_SIZE);
+		coremap[index].as = as;
+		coremap[index].va = va;
+		coremap[index].refcount = 1;
+		coremap[index].referenced = true;
+		// last, so the pager never sees a DIRTY frame without an owner
+		coremap[index].cur_state = DIRTY;
+		return returnPhyPage;
+	}
+
+	// i.e. no free physical memory blocks time to free them has come
+	lock_acquire(lk_core_map);
+	returnPhyPage = evict_page();
+	if(returnPhyPage == 0)
+	{
+		lock_release(lk_core_map);
+		return 0;
+	}
+	index = PADDR_TO_CM_INDEX(returnPhyPage);
+	coremap[index].as = as;
+	coremap[index].va = va;
+	coremap[index].refcount = 1;
+	coremap[index].referenced = true;
+	lock_release(lk_core_map);
+	return returnPhyPage;
+}
+
+void free_upage(paddr_t pa)
+{
+	unsigned long index;
+
+	if(pa < firstaddr || pa >= lastaddr)
+	{
+		panic("could not free a page\n");
+	}
+	index = PADDR_TO_CM_INDEX(pa);
+
+	lock_acquire(lk_core_map);
+	KASSERT(coremap[index].cur_state != FREE);
+	// drop the reference; the frame is free once nobody maps it.
+	page_unref(index, coremap[index].as);
+	lock_release(lk_core_map);
+}
 
+/* Allocate/free some  kernel-space virtual pages */
+// Contiguous runs come off the buddy lists; num_pages on the first frame records the length so free_kpages can give it all back
+vaddr_t 
+alloc_kpages(int npages)
+{
+	long index;
+	paddr_t pa;
+	if(is_vm_bootstrapped == 0)
+	{
+		pa = getppages(npages);
+		if (pa==0) {
+			return 0;
+		}
+		return PADDR_TO_KVADDR(pa);
 	}
-	tmp_region = as->regions;
-	while(tmp_region !=NULL)
+	else
 	{
-		if(faultaddress >= tmp_region->va && faultaddress < tmp_region->va + PAGE_SIZE * tmp_region->no_of_pages)
+		if(npages == 1)
 		{
-			i = (faultaddress - tmp_region->va) / PAGE_SIZE;
-			page_entry = (struct pagetable *)kmalloc(sizeof(struct pagetable));
-			if(page_entry == NULL)
+			index = frame_alloc();
+			if(index >= 0)
 			{
-				panic("could not allocate kernel memory\n");
+				coremap[index].num_pages = 1;
+				coremap[index].cur_state = FIXED;
+				pa = CM_INDEX_TO_PADDR(index);
+				bzero((void*)(PADDR_TO_KVADDR(pa)),PAGE_SIZE);
+				return PADDR_TO_KVADDR(pa);
 			}
-			page_entry->va = tmp_region->va + i * PAGE_SIZE;
-			page_entry->pa = alloc_upages(1);
-			page_entry->swap_status = INMEMORY;
-			page_entry->next = NULL;
-			tmp_page = as->table;
-			if(tmp_page == NULL)
+		}
+
+		lock_acquire(lk_core_map);
+		index = coremap_alloc_range(npages, FIXED);
+		if(index >= 0)
+		{
+			lock_release(lk_core_map);
+			return PADDR_TO_KVADDR(CM_INDEX_TO_PADDR(index));
+		}
+		
+		if(npages == 1)
+		{
+			// steal a user page and keep it for the kernel
+			pa = evict_page();
+			if(pa == 0)
 			{
-				as->table = page_entry;
+				lock_release(lk_core_map);
+				return 0;
 			}
-			else
+			index = PADDR_TO_CM_INDEX(pa);
+			coremap[index].num_pages = 1;
+			coremap[index].cur_state = FIXED;
+			lock_release(lk_core_map);
+			return PADDR_TO_KVADDR(pa);
+		}
+	}
+	lock_release(lk_core_map);
+	
+	panic("could not allocate a kernel page.....!\n");
+	return 0;
+}
+
+void 
+free_kpages(vaddr_t addr)
+{
+	// n contineous allocations should be freed. The index comes straight from the address.
+	paddr_t pa;
+	unsigned long index;
+
+	pa = KVADDR_TO_PADDR(addr);
+	if(is_vm_bootstrapped == 0 || pa < firstaddr)
+	{
+		/* stolen before the coremap existed - leak the memory. */
+		return;
+	}
+	KASSERT(pa < lastaddr);
+	index = PADDR_TO_CM_INDEX(pa);
+
+	KASSERT(coremap[index].cur_state == FIXED);
+	KASSERT(coremap[index].num_pages > 0);
+	if(coremap[index].num_pages == 1)
+	{
+		frame_free(index);
+		return;
+	}
+	lock_acquire(lk_core_map);
+	coremap_free_range(index, coremap[index].num_pages);
+	lock_release(lk_core_map);
+}
+
+/*
+ * TLB shootdown. Every downgrade of a translation starts under
+ * lk_core_map: the PTE is changed and as_newgen is called. Then
+ * vm_shootdown - still under lk_core_map, or after dropping it in the
+ * case of swapout_pages - clears the old translation out of this
+ * cpu's TLB and sends one batched shootdown to each other cpu whose
+ * TLB holds the address space, and waits for them all.
+ *
+ * A cpu activating the address space concurrently either is seen
+ * here with it as tc_activeas, or sees the new generation in
+ * as_activate and flushes by itself; as_activate sets tc_activeas
+ * before looking at the generation to make sure of that.
+ *
+ * Because shootdowns are sent one at a time under lk_shootdown, no
+ * target ever has more than one queued, so ipi_tlbshootdown never
+ * falls back to TLBSHOOTDOWN_ALL and drops one of ours. lk_shootdown
+ * comes after lk_core_map.
+ */
+static
+void
+vm_shootdown(struct addrspace *as, const paddr_t *pas, unsigned npages)
+{
+	struct tlbshootdown ts;
+	struct tlbcache *tc;
+	unsigned i, j, me, sent = 0;
+	int spl;
+
+	lock_acquire(lk_shootdown);
+
+	ts.ts_addrspace = as;
+	ts.ts_pages = pas;
+	ts.ts_npages = npages;
+	ts.ts_done = sem_shootdown;
+
+	/* No migrating while working out who is local and who isn't. */
+	spl = splhigh();
+	me = curcpu->c_number;
+	for(i=0;i<MAXCPUS;i++)
+	{
+		tc = &tlbcache[i];
+		if(i == me)
+		{
+			// dropping by frame is cheaper than checking whose entries they are
+			for(j=0;j<npages;j++)
 			{
-				while(tmp_page->next != NULL)
-				{
-					tmp_page = tmp_page->next;
-				}			
-				tmp_page->next = page_entry;
+				tlb_invalidate(pas[j]);
 			}
-			paddr = faultaddress + page_entry->pa - page_entry->va;		
-
-			ehi = faultaddress;
-			elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-			DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-			for (i=0; i<NUM_TLB; i++) 
-			{	
-				tlb_read(&old_ehi, &old_elo, i);
-				if ((old_elo & PAGE_FRAME) == (elo &  PAGE_FRAME))	
-				{
-			//		kprintf("i just invalidated a entry in stack code\n");
-					tlb_write(ehi, elo, i);
-					lock_release(lk_tlb);
-					return 0;
-				}
+			if(npages == 0 && tc->tc_activeas == as)
+			{
+				tlb_invalidate_all();
 			}
-			tlb_random(ehi, elo);
-			lock_release(lk_tlb);
-			return 0;
+			continue;
+		}
+		if(tc->tc_cpu == NULL || tc->tc_activeas != as)
+		{
+			continue;
 		}
-		tmp_region = tmp_region->next;
+		ipi_tlbshootdown(tc->tc_cpu, &ts);
+		sent++;
 	}
-	
+	splx(spl);
 
-	/* on demand paging for the stack. We only allocate stack pages if the fault address is within 1 page size.
-	Just allocate a physical page and store the fault address in the tlb. Simple it seems. Sould work
-	This code segment will only be called when the entry is not present in the page table*/
-	if((faultaddress < as->as_stackvbase) && (faultaddress >= (as->as_stackvbase - PAGE_SIZE))) 
+	vmstat_shootdowns += sent;
+	while(sent > 0)
 	{
-		//curthread->t_addrspace->as_stackvbase = curthread->t_addrspace->as_stackvbase - PAGE_SIZE; 		
-				
-		tmp_page = as->table;
-		
-		while(tmp_page->next != NULL)
+		P(sem_shootdown);
+		sent--;
+	}
+
+	lock_release(lk_shootdown);
+}
+
+/*
+ * Shootdown handlers, called from interprocessor_interrupt.
+ */
+void
+vm_tlbshootdown_all(void)
+{
+	/* Only reached if ipi_tlbshootdown overflowed; see vm_shootdown. */
+	tlb_invalidate_all();
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	struct tlbcache *tc = &tlbcache[curcpu->c_number];
+	unsigned i;
+
+	if(ts->ts_addrspace == tc->tc_activeas)
+	{
+		if(ts->ts_npages == 0)
 		{
-			tmp_page = tmp_page->next;
+			tlb_invalidate_all();
 		}
-		
-		page_entry = (struct pagetable *)kmalloc(sizeof(struct pagetable));		
-		
-		if(page_entry == NULL)
+		for(i=0;i<ts->ts_npages;i++)
 		{
-			lock_release(lk_tlb);
-			panic("could not allocate kernel memory\n");
+			tlb_invalidate(ts->ts_pages[i]);
 		}
-		page_entry->va = as->as_stackvbase - PAGE_SIZE;
-		page_entry->pa = alloc_upages(1);
-		page_entry->swap_status = INMEMORY;
-		page_entry->next = NULL;
-		tmp_page->next = page_entry;
+	}
+	V(ts->ts_done);
+}
 
-		as->as_stackvbase = as->as_stackvbase - PAGE_SIZE;
+/*
+ * Load a translation into the TLB, replacing any entry already there
+ * for the same virtual page.
+ */
+static
+void
+tlb_load(uint32_t ehi, uint32_t elo)
+{
+	int index, spl;
 
-		paddr = faultaddress + page_entry->pa - page_entry->va;		
+	spl = splhigh();
+	index = tlb_probe(ehi, 0);
+	if(index >= 0)
+	{
+		tlb_write(ehi, elo, index);
+	}
+	else
+	{
+		tlb_random(ehi, elo);
+	}
+	splx(spl);
+}
 
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		
-		for (i=0; i<NUM_TLB; i++) 
+/*
+ * TLB miss fast path: refill from this cpu's software cache if it has
+ * a current translation for VA. Write misses only count if the cached
+ * entry is writable; anything else goes the slow way.
+ */
+static
+bool
+tlbcache_refill(struct addrspace *as, vaddr_t va, int faulttype)
+{
+	struct tlbcache *tc;
+	unsigned h = TLBCACHE_HASH(va);
+	uint32_t elo;
+	int spl;
+
+	spl = splhigh();
+	tc = &tlbcache[curcpu->c_number];
+	if(tc->tc_ent[h].gen != as->as_gen || tc->tc_ent[h].vpn != va ||
+	   (faulttype == VM_FAULT_WRITE && (tc->tc_ent[h].elo & TLBLO_DIRTY) == 0))
+	{
+		tc->tc_misses++;
+		splx(spl);
+		return false;
+	}
+	elo = tc->tc_ent[h].elo;
+	// still counts as a use for the clock
+	coremap[PADDR_TO_CM_INDEX(elo & TLBLO_PPAGE)].referenced = true;
+	tlb_load(va, elo);
+	tc->tc_hits++;
+	splx(spl);
+	return true;
+}
+
+static
+void
+tlbcache_insert(struct addrspace *as, vaddr_t va, uint32_t elo)
+{
+	struct tlbcache *tc;
+	unsigned h = TLBCACHE_HASH(va);
+	int spl;
+
+	spl = splhigh();
+	tc = &tlbcache[curcpu->c_number];
+	tc->tc_ent[h].gen = as->as_gen;
+	tc->tc_ent[h].vpn = va;
+	tc->tc_ent[h].elo = elo;
+	splx(spl);
+}
+
+/*
+ * Is VA somewhere the process may touch? That is inside one of the
+ * regions from the executable, below the current break, or inside the
+ * stack reservation.
+ */
+static
+bool
+as_valid_addr(struct addrspace *as, vaddr_t va)
+{
+	struct region * r;
+
+	for(r = as->regions; r != NULL; r = r->next)
+	{
+		if(va >= r->va && va < r->va + r->no_of_pages * PAGE_SIZE)
 		{
-				tlb_read(&old_ehi, &old_elo, i);
-				if ((old_elo & PAGE_FRAME) == (elo &  PAGE_FRAME))	
-				{
-			//		kprintf("i just invalidated a entry in stack code\n");
-					tlb_write(ehi, elo, i);
-					lock_release(lk_tlb);
-					return 0;
-				}
+			return true;
 		}
-		tlb_random(ehi, elo);
-		lock_release(lk_tlb);
- 
-		return 0;
+	}
+	if(va >= as->heap_start && va < ROUNDUP(as->heap_end, PAGE_SIZE))
+	{
+		return true;
+	}
+	if(va >= as->as_stackvbase && va < as->as_stackvtop)
+	{
+		return true;
+	}
+	return false;
+}
 
+/*
+ * A first touch below the stack grows the stack down to VA, like the
+ * old one-page-at-a-time growth but allowing for a frame that skips a
+ * few pages: VA must be within DUMBVM_STACKPAGES of the current bottom,
+ * and a page must be left between the stack and the heap. Call with
+ * as_lock held.
+ */
+static
+bool
+as_grow_stack(struct addrspace *as, vaddr_t va)
+{
+	if(va >= as->as_stackvbase ||
+	   as->as_stackvbase - va > DUMBVM_STACKPAGES * PAGE_SIZE ||
+	   va < ROUNDUP(as->heap_end, PAGE_SIZE) + PAGE_SIZE)
+	{
+		return false;
 	}
-	/*
-	Now we will handle extending the heap. If the current address is in the pages, the code above will handle it itself. But if its not,
-	it will coe own to this segment where we will allocate a page according to the requirement
-	*/
-	if(faultaddress >= as->heap_start && faultaddress <= as->heap_end)
+	as->as_stackvbase = va;
+	return true;
+}
+
+/*
+ * Copy whatever the executable has for the page at VA into the fresh,
+ * zeroed frame PA. Parts of the page outside every segment's file
+ * image - BSS, heap, stack - are left zero.
+ */
+static
+int
+region_fill_page(struct addrspace *as, vaddr_t va, paddr_t pa)
+{
+	struct region * r;
+	struct iovec iov;
+	struct uio u;
+	vaddr_t start, end;
+	int result;
+
+	for(r = as->regions; r != NULL; r = r->next)
 	{
-		pg_count = (faultaddress - as->heap_start + as->heap_pages * PAGE_SIZE)/PAGE_SIZE + 1;	
-		
-		tmp_page = as->table;
-		
-		while(tmp_page->next != NULL)
+		if(r->vn == NULL)
+		{
+			continue;
+		}
+		start = va > r->seg_va ? va : r->seg_va;
+		end = va + PAGE_SIZE < r->seg_va + r->filesize ?
+			va + PAGE_SIZE : r->seg_va + r->filesize;
+		if(start >= end)
+		{
+			continue;
+		}
+		uio_kinit(&iov, &u, (void *)(PADDR_TO_KVADDR(pa) + (start - va)),
+			  end - start, r->offset + (start - r->seg_va), UIO_READ);
+		result = VOP_READ(r->vn, &u);
+		if(result)
 		{
-			tmp_page = tmp_page->next;
+			return result;
 		}
+		if(u.uio_resid != 0)
+		{
+			kprintf("ELF: short read on segment - file truncated?\n");
+			return ENOEXEC;
+		}
+	}
+	return 0;
+}
+
+/*
+ * A write hit a resident page without PTE_DIRTY, i.e. a frame shared
+ * copy-on-write with another address space. Make a private copy, or
+ * if every other sharer has gone its own way already, just take the
+ * frame over and make it writable. Fails with ENOMEM if a copy is
+ * needed and there is no memory for it.
+ */
+static
+int
+vm_fault_cow(struct addrspace *as, vaddr_t va, pte_t *pte)
+{
+	unsigned long index;
+	paddr_t new_pa = 0;
+	paddr_t old_pa;
 
-		for(i = 0;i<pg_count;i++)
+	lock_acquire(lk_core_map);
+	index = PADDR_TO_CM_INDEX(*pte & PTE_FRAME);
+	if(coremap[index].refcount > 1)
+	{
+		lock_release(lk_core_map);
+		new_pa = alloc_upage(as, va);
+		if(new_pa == 0)
 		{
-			page_entry = (struct pagetable *)kmalloc(sizeof(struct pagetable));		
-		
-			if(page_entry == NULL)
-			{
-				lock_release(lk_tlb);
-				panic("could not allocate kernel memory\n");
-			}
-			page_entry->va = as->heap_start + (as->heap_pages + i) * PAGE_SIZE;
-			page_entry->pa = alloc_upages(1);
-			page_entry->next = NULL;
-			page_entry->swap_status = INMEMORY;
-			tmp_page->next = page_entry;
-			tmp_page = tmp_page->next;
-
-			//as->as_stackvbase = as->as_stackvbase - PAGE_SIZE;
-			if((page_entry->va <= faultaddress) && ((page_entry->va + PAGE_SIZE) > faultaddress))
-			{
-				paddr = faultaddress + page_entry->pa - page_entry->va;		
+			return ENOMEM;
+		}
+		lock_acquire(lk_core_map);
+		/* We may have slept; look again. */
+		if((*pte & PTE_VALID) == 0)
+		{
+			coremap_free_range(PADDR_TO_CM_INDEX(new_pa), 1);
+			lock_release(lk_core_map);
+			return 0;
+		}
+		index = PADDR_TO_CM_INDEX(*pte & PTE_FRAME);
+	}
 
-				ehi = faultaddress;
-				elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-				DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-				
-			}
+	if(coremap[index].refcount > 1)
+	{
+		memmove((void *)PADDR_TO_KVADDR(new_pa),
+			(const void *)PADDR_TO_KVADDR(*pte & PTE_FRAME), PAGE_SIZE);
+		*pte = new_pa | PTE_VALID | PTE_DIRTY;
+		// other cpus' TLBs and caches still point at the shared frame
+		as_newgen(as);
+		old_pa = CM_INDEX_TO_PADDR(index);
+		vm_shootdown(as, &old_pa, 1);
+		page_unref(index, as);
+	}
+	else
+	{
+		if(new_pa != 0)
+		{
+			coremap_free_range(PADDR_TO_CM_INDEX(new_pa), 1);
 		}
-		as->heap_pages += pg_count;
-		for (i=0; i<NUM_TLB; i++) 
+		if(coremap[index].cur_state == CLEAN)
 		{
-				tlb_read(&old_ehi, &old_elo, i);
-				if ((old_elo & PAGE_FRAME) == (elo &  PAGE_FRAME))	
-				{
-			//		kprintf("i just invalidated a entry in stack code\n");
-					tlb_write(ehi, elo, i);
-					lock_release(lk_tlb);
-					return 0;
-				}
+			// the swap copy goes stale with this write
+			swap_free(coremap[index].swapslot);
+			coremap[index].cur_state = DIRTY;
+			coremap[index].swapslot = -1;
 		}
-		tlb_random(ehi, elo);
-		lock_release(lk_tlb);
-		return 0;
-	
-		
+		coremap[index].as = as;
+		coremap[index].va = va;
+		*pte |= PTE_DIRTY;
 	}
-	lock_release(lk_tlb);
-	return EFAULT;
+	/* vm_fault's tlb_load replaces the stale read-only entry. */
+	lock_release(lk_core_map);
+	return 0;
 }
 
+/*
+ * Bring the page at VA back in from swap. The pages after it whose
+ * slots follow on from its slot come in with it, as part of the same
+ * disk request, as long as there is free memory to spare for them.
+ * Those are mapped CLEAN and left unreferenced so the clock takes them
+ * back cheaply if they turn out not to be wanted. Fails with ENOMEM if
+ * there is no frame for the page itself.
+ */
+static
+int
+vm_fault_swapin(struct addrspace *as, vaddr_t va, pte_t *pte, int faulttype)
+{
+	pte_t * ptes[SWAP_CLUSTER];
+	paddr_t pas[SWAP_CLUSTER];
+	pte_t * next;
+	unsigned slot, i, n;
+	unsigned long index;
+
+	slot = PTE_SWAPSLOT(*pte);
+	ptes[0] = pte;
+	pas[0] = alloc_upage(as, va);
+	if(pas[0] == 0)
+	{
+		return ENOMEM;
+	}
+	for(n=1;n<SWAP_CLUSTER;n++)
+	{
+		// unlocked peek; read-ahead is only worth it if nobody has to be evicted for it
+		if(no_of_free_pages <= pageout_lowater ||
+		   va + n * PAGE_SIZE >= USERSPACETOP)
+		{
+			break;
+		}
+		next = pt_lookup(as->table, va + n * PAGE_SIZE, false);
+		if(next == NULL || (*next & PTE_SWAPPED) == 0 ||
+		   PTE_SWAPSLOT(*next) != slot + n)
+		{
+			break;
+		}
+		pas[n] = alloc_upage(as, va + n * PAGE_SIZE);
+		if(pas[n] == 0)
+		{
+			break;
+		}
+		ptes[n] = next;
+	}
+
+	// the pager may still be writing some of these slots
+	lock_acquire(lk_core_map);
+	for(i=0;i<n;i++)
+	{
+		swap_wait(slot + i);
+	}
+	lock_release(lk_core_map);
+
+	read_pages(slot, pas, n);
+
+	lock_acquire(lk_core_map);
+	for(i=0;i<n;i++)
+	{
+		index = PADDR_TO_CM_INDEX(pas[i]);
+		if(i == 0 && faulttype != VM_FAULT_READ)
+		{
+			swap_free(slot);
+			*ptes[i] = pas[i] | PTE_VALID | PTE_DIRTY;
+			continue;
+		}
+		/*
+		 * Keep the swap copy and map the page without PTE_DIRTY.
+		 * If it is evicted again before anybody writes to it, it
+		 * can just be dropped.
+		 */
+		coremap[index].cur_state = CLEAN;
+		coremap[index].swapslot = slot + i;
+		if(i > 0)
+		{
+			coremap[index].referenced = false;
+		}
+		*ptes[i] = pas[i] | PTE_VALID;
+	}
+	vmstat_swapins += n;
+	vmstat_readahead += n - 1;
+	vmstat_swapreads++;
+	lock_release(lk_core_map);
+	return 0;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace * as;
+	pte_t * pte;
+	paddr_t paddr;
+	unsigned long index;
+	uint32_t ehi, elo;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+	
+	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+	
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	as = curthread->t_addrspace;
+	if(as == NULL || faultaddress >= USERSPACETOP)
+	{
+		return EFAULT;
+	}
 
+	if(faulttype != VM_FAULT_READONLY && tlbcache_refill(as, faultaddress, faulttype))
+	{
+		return 0;
+	}
 
+	lock_acquire(as->as_lock);
+	pte = pt_lookup(as->table, faultaddress, false);
+	if(pte == NULL || *pte == 0)
+	{
+		// first touch - hand out a zeroed page if the address is legal
+		if(!as_valid_addr(as, faultaddress) &&
+		   !as_grow_stack(as, faultaddress))
+		{
+			lock_release(as->as_lock);
+			return EFAULT;
+		}
+		pte = pt_lookup(as->table, faultaddress, true);
+		if(pte == NULL)
+		{
+			lock_release(as->as_lock);
+			return ENOMEM;
+		}
+		paddr = alloc_upage(as, faultaddress);
+		if(paddr == 0)
+		{
+			lock_release(as->as_lock);
+			return ENOMEM;
+		}
+		/*
+		 * The read from the executable can sleep in the file
+		 * system, which may itself be waiting on a fault; don't
+		 * hold as_lock over it. The frame is not mapped yet, so
+		 * the pager leaves it alone meanwhile.
+		 */
+		lock_release(as->as_lock);
+		result = region_fill_page(as, faultaddress, paddr);
+		lock_acquire(as->as_lock);
+		if(result || *pte != 0)
+		{
+			free_upage(paddr);
+			if(result)
+			{
+				lock_release(as->as_lock);
+				return result;
+			}
+		}
+		else
+		{
+			*pte = paddr | PTE_VALID | PTE_DIRTY;
+		}
+	}
+	else if(*pte & PTE_SWAPPED)
+	{
+		result = vm_fault_swapin(as, faultaddress, pte, faulttype);
+		if(result)
+		{
+			lock_release(as->as_lock);
+			return result;
+		}
+	}
+	else if(faulttype != VM_FAULT_READ && (*pte & PTE_DIRTY) == 0)
+	{
+		result = vm_fault_cow(as, faultaddress, pte);
+		if(result)
+		{
+			lock_release(as->as_lock);
+			return result;
+		}
+	}
+
+	/*
+	 * Load the TLB under the coremap lock so the pager cannot take
+	 * the frame between reading the PTE and writing the entry. If it
+	 * already has, just return; the access will fault again.
+	 */
+	lock_acquire(lk_core_map);
+	vmstat_faults++;
+	if(*pte & PTE_VALID)
+	{
+		paddr = *pte & PTE_FRAME;
+		index = PADDR_TO_CM_INDEX(paddr);
+		// a TLB miss is a reference as far as the clock is concerned
+		coremap[index].referenced = true;
+		ehi = faultaddress;
+		// shared pages go in without TLBLO_DIRTY so writes trap
+		elo = *pte & (PTE_FRAME | PTE_DIRTY | PTE_VALID);
+		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+		tlb_load(ehi, elo);
+		tlbcache_insert(as, faultaddress, elo);
+	}
+	lock_release(lk_core_map);
+	lock_release(as->as_lock);
+	return 0;
+}
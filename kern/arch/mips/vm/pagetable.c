@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Two-level page tables for user address spaces. See addrspace.h for
+ * the layout of the table and of the entries in it.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <addrspace.h>
+#include <vm.h>
+
+/*
+ * Page tables live in their own object cache. Their constructed state
+ * is "empty", so pt_create doesn't have to clear the top level and
+ * pt_destroy leaves it clear again as it frees the second level.
+ */
+static struct kmem_cache *pt_cache;
+
+static
+void
+pt_ctor(void *obj)
+{
+	struct pagetable *pt = obj;
+	int i;
+
+	for (i=0; i<PT_L1_SIZE; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+}
+
+void
+pt_bootstrap(void)
+{
+	pt_cache = kmem_cache_create("pagetable", sizeof(struct pagetable),
+				     pt_ctor);
+	if (pt_cache == NULL) {
+		panic("pt_bootstrap: out of memory\n");
+	}
+}
+
+struct pagetable *
+pt_create(void)
+{
+	return kmem_cache_alloc(pt_cache);
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	int i;
+
+	KASSERT(pt != NULL);
+	for (i=0; i<PT_L1_SIZE; i++) {
+		if (pt->pt_dir[i] != NULL) {
+			kfree(pt->pt_dir[i]);
+			pt->pt_dir[i] = NULL;
+		}
+	}
+	kmem_cache_free(pt_cache, pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t va, bool create)
+{
+	pte_t *l2;
+	unsigned l1index;
+
+	KASSERT(pt != NULL);
+	KASSERT(va < USERSPACETOP);
+
+	l1index = PT_L1_INDEX(va);
+	l2 = pt->pt_dir[l1index];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		l2 = kmalloc(PT_L2_SIZE * sizeof(pte_t));
+		if (l2 == NULL) {
+			return NULL;
+		}
+		bzero(l2, PT_L2_SIZE * sizeof(pte_t));
+		/*
+		 * kmalloc may have slept evicting a page; make sure
+		 * nobody else put a table here in the meantime.
+		 */
+		if (pt->pt_dir[l1index] != NULL) {
+			kfree(l2);
+			l2 = pt->pt_dir[l1index];
+		}
+		else {
+			pt->pt_dir[l1index] = l2;
+		}
+	}
+	return &l2[PT_L2_INDEX(va)];
+}
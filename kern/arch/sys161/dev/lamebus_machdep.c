@@ -73,6 +73,37 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Reset the cycle counter, so a new compare value counts from now.
+ */
+static
+void
+mips_timer_reset(void)
+{
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"
+		".set mips32;"
+		"mtc0 $0, $9;"
+		".set pop");
+}
+
+/*
+ * Start or stop the on-chip timer on the current cpu. This is the
+ * only per-cpu timer System/161 has; the LAMEbus timer card's
+ * interrupt line is shared by all cpus, so it can't be used for this.
+ *
+ * The timer can't actually be turned off, so to stop it we push the
+ * next interrupt as far away as it will go, about three minutes;
+ * hardclock() ignores it and stops the timer again.
+ */
+void
+mainbus_settimer(bool on)
+{
+	mips_timer_reset();
+	mips_timer_set(on ? CPU_FREQUENCY / HZ : 0xffffffff);
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -479,11 +479,21 @@ emufs_reclaim(struct vnode *v)
 	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
+	/*
+	 * Make sure nobody picked the vnode up (emufs_loadvnode runs
+	 * under the same locks) since VOP_DECREF decided to reclaim it.
+	 * If so, consume the reference VOP_DECREF gave us.
+	 */
+	spinlock_acquire(&ev->ev_v.vn_countlock);
 	if (ev->ev_v.vn_refcount != 1) {
+		KASSERT(ev->ev_v.vn_refcount > 1);
+		ev->ev_v.vn_refcount--;
+		spinlock_release(&ev->ev_v.vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	spinlock_release(&ev->ev_v.vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
@@ -1177,6 +1187,7 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	ev = kmalloc(sizeof(struct emufs_vnode));
 	if (ev==NULL) {
 		lock_release(ef->ef_emu->e_lock);
+		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -1295,6 +1306,7 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 	ef->ef_fs.fs_getvolname = emufs_getvolname;
 	ef->ef_fs.fs_getroot = emufs_getroot;
 	ef->ef_fs.fs_unmount = emufs_unmount;
+	ef->ef_fs.fs_dcache = false;	/* the host can change names */
 	ef->ef_fs.fs_data = ef;
 
 	ef->ef_emu = sc;
@@ -59,6 +59,9 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Sectors staged at a time for transfers to and from user space */
+#define LHD_BOUNCESECT  8
+
 /*
  * Shortcut for reading a register.
  */
@@ -193,8 +196,73 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+static int lhd_io(struct device *d, struct uio *uio);
+
+/*
+ * Transfer between the disk and user memory. The copy to or from user
+ * space can fault, and the fault may need swap I/O on this very disk
+ * (e.g. reading lhd0raw: with swap on lhd0); doing the copy with
+ * lh_clear held would then deadlock. So stage the data through a
+ * kernel buffer and claim the device only for the disk side of each
+ * piece. The request has already been checked by lhd_io.
+ */
+static
+int
+lhd_userio(struct device *d, struct uio *uio)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	size_t len;
+	int result = 0;
+
+	buf = kmalloc(LHD_BOUNCESECT * LHD_SECTSIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	while (uio->uio_resid > 0) {
+		len = LHD_BOUNCESECT * LHD_SECTSIZE;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+		uio_kinit(&iov, &ku, buf, len, uio->uio_offset, uio->uio_rw);
+
+		if (uio->uio_rw == UIO_WRITE) {
+			result = uiomove(buf, len, uio);
+			if (result) {
+				break;
+			}
+			result = lhd_io(d, &ku);
+			if (result) {
+				break;
+			}
+		}
+		else {
+			result = lhd_io(d, &ku);
+			if (result) {
+				break;
+			}
+			result = uiomove(buf, len, uio);
+			if (result) {
+				break;
+			}
+		}
+	}
+
+	kfree(buf);
+	return result;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * The hardware only moves one sector at a time, but the device is
+ * claimed once for the whole request: a multi-sector transfer (such
+ * as a cluster of pages going to swap) runs from start to finish
+ * without other requests seeking the disk away in between, and
+ * without going back through the lh_clear queue for every sector.
+ * Transfers to and from user space go through lhd_userio instead.
  */
 static
 int
@@ -220,17 +288,22 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
+	/* Never touch user memory while holding the device. */
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return lhd_userio(d, uio);
+	}
+
 	/* Set up the value to write into the status register. */
 	if (uio->uio_rw==UIO_WRITE) {
 		statval |= LHD_ISWRITE;
 	}
 
+	/* Wait until nobody else is using the device. */
+	P(lh->lh_clear);
+
 	/* Loop over all the sectors we were asked to do. */
 	for (i=0; i<len; i++) {
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
 		/*
 		 * Are we writing? If so, transfer the data to the
 		 * on-card buffer.
@@ -263,15 +336,16 @@ lhd_io(struct device *d, struct uio *uio)
 			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
 		/* If we failed, return the error. */
 		if (result) {
+			V(lh->lh_clear);
 			return result;
 		}
 	}
 
+	/* Tell another thread it's cleared to go ahead. */
+	V(lh->lh_clear);
+
 	return 0;
 }
 
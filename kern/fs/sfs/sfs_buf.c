@@ -0,0 +1,732 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Buffer cache.
+ *
+ * All block I/O on a mounted volume, metadata and file data alike,
+ * goes through one cache of SFS_BLOCKSIZE buffers shared by every
+ * mounted volume. Buffers are found by (volume, block) in a hash
+ * table and sit on an LRU list while nobody is using them.
+ *
+ * A buffer handed out by sfs_buf_read or sfs_buf_get is pinned: it
+ * belongs to the caller until sfs_buf_release, it cannot be evicted,
+ * and anyone else asking for the same block waits. Pins are
+ * exclusive, so holding one is what makes it safe to look at or
+ * change the contents. A thread may hold several pins at once (e.g.
+ * an indirect block and the data block being allocated for it) but
+ * must not ask for a block it already has pinned.
+ *
+ * Writes are delayed. sfs_buf_markdirty only flags the buffer; dirty
+ * buffers go to disk when they are evicted, when the volume is synced,
+ * or when the syncer thread makes its periodic pass. The syncer is
+ * kicked early once a quarter of the cache is dirty, so that eviction
+ * seldom has to stop and write.
+ *
+ * The cache is sized from physical memory when the first volume is
+ * mounted. If every buffer is pinned when a new one is needed, an
+ * extra one is allocated instead of waiting (waiting could deadlock
+ * two threads that each pin more than one block) and it is freed
+ * again on release.
+ *
+ * buf_lock covers the hash table, the LRU list, the counters and the
+ * buffer headers. It comes after all the other SFS locks (see sfs.h).
+ * Device I/O is done with the buffer pinned and buf_lock released.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <vm.h>
+#include <vfs.h>
+#include <sfs.h>
+
+/* Fraction of physical memory given to the cache, and the floor. */
+#define SFS_BUF_RAMFRACTION	16
+#define SFS_BUF_MIN		64
+
+/* How often the syncer writes back dirty buffers. */
+#define SFS_SYNCER_TICKS	(2*HZ)
+
+struct sfs_buf {
+	struct sfs_fs *b_fs;		/* volume, or NULL if unassigned */
+	uint32_t b_block;		/* block number on that volume */
+	bool b_valid;			/* b_data holds the block contents */
+	bool b_dirty;			/* b_data is newer than the disk */
+	bool b_pinned;			/* in use by some thread */
+	struct sfs_buf *b_hashnext;	/* hash chain */
+	struct sfs_buf *b_lrunext;	/* LRU list; only while unpinned */
+	struct sfs_buf *b_lruprev;
+	void *b_data;			/* SFS_BLOCKSIZE bytes */
+};
+
+static struct lock *buf_lock;
+static struct cv *buf_cv;		/* a pinned buffer was released */
+static struct cv *buf_syncer_cv;	/* kicks the syncer */
+
+static struct sfs_buf **buf_hash;
+static unsigned buf_hashmask;
+
+/* Least recently used at the head; eviction takes from there. */
+static struct sfs_buf *buf_lruhead;
+static struct sfs_buf *buf_lrutail;
+
+static unsigned buf_count;		/* buffers allocated */
+static unsigned buf_max;		/* target size of the cache */
+static unsigned buf_ndirty;
+
+static unsigned long bufstat_hits;
+static unsigned long bufstat_misses;
+static unsigned long bufstat_reads;
+static unsigned long bufstat_writes;
+static unsigned long bufstat_evictions;
+static unsigned long bufstat_overflows;
+
+////////////////////////////////////////////////////////////
+//
+// Lists
+
+static
+unsigned
+buf_hashfn(struct sfs_fs *sfs, uint32_t block)
+{
+	return (block ^ ((uintptr_t)sfs >> 4)) & buf_hashmask;
+}
+
+static
+struct sfs_buf *
+buf_lookup(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *b;
+
+	for (b = buf_hash[buf_hashfn(sfs, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_fs == sfs && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buf_hashinsert(struct sfs_buf *b)
+{
+	unsigned h = buf_hashfn(b->b_fs, b->b_block);
+
+	b->b_hashnext = buf_hash[h];
+	buf_hash[h] = b;
+}
+
+/* Take B out of the hash table and detach it from its volume. */
+static
+void
+buf_hashremove(struct sfs_buf *b)
+{
+	struct sfs_buf **bp;
+
+	if (b->b_fs == NULL) {
+		return;
+	}
+	for (bp = &buf_hash[buf_hashfn(b->b_fs, b->b_block)]; *bp != b;
+	     bp = &(*bp)->b_hashnext) {
+		KASSERT(*bp != NULL);
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+	b->b_fs = NULL;
+	b->b_valid = false;
+	KASSERT(!b->b_dirty);
+}
+
+static
+void
+buf_lruremove(struct sfs_buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buf_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buf_lrutail = b->b_lruprev;
+	}
+	b->b_lrunext = b->b_lruprev = NULL;
+}
+
+/* Put B at the most recently used end. */
+static
+void
+buf_lruappend(struct sfs_buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buf_lrutail;
+	if (buf_lrutail != NULL) {
+		buf_lrutail->b_lrunext = b;
+	}
+	else {
+		buf_lruhead = b;
+	}
+	buf_lrutail = b;
+}
+
+/* Put B at the least recently used end, to be reused first. */
+static
+void
+buf_lruprepend(struct sfs_buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = buf_lruhead;
+	if (buf_lruhead != NULL) {
+		buf_lruhead->b_lruprev = b;
+	}
+	else {
+		buf_lrutail = b;
+	}
+	buf_lruhead = b;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Buffers
+
+static
+struct sfs_buf *
+buf_alloc(void)
+{
+	struct sfs_buf *b;
+
+	b = kmalloc(sizeof(struct sfs_buf));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(SFS_BLOCKSIZE);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_fs = NULL;
+	b->b_block = 0;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_pinned = false;
+	b->b_hashnext = NULL;
+	b->b_lrunext = b->b_lruprev = NULL;
+
+	buf_count++;
+	return b;
+}
+
+static
+void
+buf_free(struct sfs_buf *b)
+{
+	KASSERT(b->b_fs == NULL);
+	KASSERT(!b->b_pinned);
+
+	kfree(b->b_data);
+	kfree(b);
+	buf_count--;
+}
+
+static
+void
+buf_setclean(struct sfs_buf *b)
+{
+	if (b->b_dirty) {
+		b->b_dirty = false;
+		KASSERT(buf_ndirty > 0 && b->b_fs->sfs_ndirtybufs > 0);
+		buf_ndirty--;
+		b->b_fs->sfs_ndirtybufs--;
+	}
+}
+
+/*
+ * Write back a dirty buffer. B must be pinned by us; buf_lock is
+ * dropped across the I/O.
+ */
+static
+int
+buf_write(struct sfs_buf *b)
+{
+	int result;
+
+	KASSERT(b->b_pinned);
+	KASSERT(b->b_dirty && b->b_valid);
+
+	lock_release(buf_lock);
+	result = sfs_wblock(b->b_fs, b->b_data, b->b_block);
+	lock_acquire(buf_lock);
+
+	bufstat_writes++;
+	if (result == 0) {
+		buf_setclean(b);
+	}
+	return result;
+}
+
+/*
+ * Unpin a buffer. Valid buffers go to the recently used end of the
+ * LRU list; invalid ones are detached and reused first, or freed if
+ * the cache has grown past its target.
+ */
+static
+void
+buf_unpin(struct sfs_buf *b)
+{
+	KASSERT(b->b_pinned);
+	b->b_pinned = false;
+
+	if (!b->b_valid) {
+		buf_hashremove(b);
+		if (buf_count > buf_max) {
+			buf_free(b);
+		}
+		else {
+			buf_lruprepend(b);
+		}
+	}
+	else if (buf_count > buf_max && !b->b_dirty) {
+		buf_hashremove(b);
+		buf_free(b);
+	}
+	else {
+		buf_lruappend(b);
+	}
+
+	cv_broadcast(buf_cv, buf_lock);
+}
+
+/*
+ * Find or make the buffer for BLOCK on SFS and pin it. A new buffer
+ * comes back invalid and zero-filled. Call with buf_lock held; it may
+ * be dropped and retaken. If no buffer can be written back to make
+ * room, an overflow buffer is allocated instead, so that one block's
+ * write error doesn't fail I/O on another.
+ */
+static
+int
+buf_getbuf(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	unsigned failed = 0;
+	int result;
+
+ again:
+	b = buf_lookup(sfs, block);
+	if (b != NULL) {
+		if (b->b_pinned) {
+			cv_wait(buf_cv, buf_lock);
+			goto again;
+		}
+		buf_lruremove(b);
+		b->b_pinned = true;
+		bufstat_hits++;
+		*ret = b;
+		return 0;
+	}
+
+	if (buf_count < buf_max || buf_lruhead == NULL || failed >= buf_count) {
+		b = buf_alloc();
+		if (b == NULL) {
+			return ENOMEM;
+		}
+		if (buf_count > buf_max) {
+			bufstat_overflows++;
+		}
+	}
+	else {
+		b = buf_lruhead;
+		buf_lruremove(b);
+		b->b_pinned = true;
+		if (b->b_dirty) {
+			/*
+			 * Write it back, then start over: while the lock
+			 * was dropped someone may have brought our block
+			 * in. If the write worked the buffer is clean, so
+			 * it goes back at the head of the list to be taken
+			 * next time. If not, it is still dirty; move it to
+			 * the tail so the next candidate gets a turn.
+			 */
+			result = buf_write(b);
+			b->b_pinned = false;
+			if (result) {
+				failed++;
+				buf_lruappend(b);
+			}
+			else {
+				buf_lruprepend(b);
+			}
+			cv_broadcast(buf_cv, buf_lock);
+			goto again;
+		}
+		if (b->b_fs != NULL) {
+			bufstat_evictions++;
+		}
+		buf_hashremove(b);
+	}
+
+	b->b_fs = sfs;
+	b->b_block = block;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_pinned = true;
+	bzero(b->b_data, SFS_BLOCKSIZE);
+	buf_hashinsert(b);
+
+	bufstat_misses++;
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Write back the dirty buffers of SFS, or of every volume if SFS is
+ * NULL. With a specific volume we wait for pinned buffers so that
+ * everything dirtied before the call gets written; the syncer just
+ * skips them. Stops at the first error. Call with buf_lock held.
+ */
+static
+int
+buf_flush(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b;
+	unsigned i;
+	int result;
+
+	for (i=0; i<=buf_hashmask; i++) {
+		if (sfs != NULL ? sfs->sfs_ndirtybufs == 0 : buf_ndirty == 0) {
+			break;
+		}
+	 restart:
+		for (b = buf_hash[i]; b != NULL; b = b->b_hashnext) {
+			if (!b->b_dirty || (sfs != NULL && b->b_fs != sfs)) {
+				continue;
+			}
+			if (b->b_pinned) {
+				if (sfs == NULL) {
+					continue;
+				}
+				cv_wait(buf_cv, buf_lock);
+				goto restart;
+			}
+			buf_lruremove(b);
+			b->b_pinned = true;
+			result = buf_write(b);
+			buf_unpin(b);
+			if (result) {
+				return result;
+			}
+			/* The chain may have changed while unlocked. */
+			goto restart;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write-behind thread. Runs a flush every SFS_SYNCER_TICKS, or sooner
+ * when sfs_buf_markdirty finds too much of the cache dirty.
+ */
+static
+void
+sfs_buf_syncer(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		lock_acquire(buf_lock);
+		(void)cv_timedwait(buf_syncer_cv, buf_lock, SFS_SYNCER_TICKS);
+		lock_release(buf_lock);
+
+		lock_acquire(buf_lock);
+		/* Errors were reported by sfs_rwblock; try again later. */
+		(void)buf_flush(NULL);
+		lock_release(buf_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+/*
+ * Set up the cache. Called on every mount (which vfs_mount
+ * serializes); only the first call does anything.
+ */
+int
+sfs_buf_bootstrap(void)
+{
+	unsigned hashsize;
+	int result;
+
+	if (buf_lock != NULL) {
+		return 0;
+	}
+
+	buf_max = vm_npages() * PAGE_SIZE / SFS_BUF_RAMFRACTION / SFS_BLOCKSIZE;
+	if (buf_max < SFS_BUF_MIN) {
+		buf_max = SFS_BUF_MIN;
+	}
+	hashsize = 1;
+	while (hashsize < buf_max) {
+		hashsize *= 2;
+	}
+
+	buf_hash = kmalloc(hashsize * sizeof(struct sfs_buf *));
+	if (buf_hash == NULL) {
+		return ENOMEM;
+	}
+	bzero(buf_hash, hashsize * sizeof(struct sfs_buf *));
+	buf_hashmask = hashsize - 1;
+
+	buf_cv = cv_create("sfs_buf");
+	buf_syncer_cv = cv_create("sfs_syncer");
+	buf_lock = lock_create("sfs_buf");
+	if (buf_cv == NULL || buf_syncer_cv == NULL || buf_lock == NULL) {
+		goto fail;
+	}
+
+	result = thread_fork("sfs_syncer", sfs_buf_syncer, NULL, 0, NULL);
+	if (result) {
+		goto fail;
+	}
+
+	kprintf("sfs: buffer cache of %u blocks\n", buf_max);
+	return 0;
+
+ fail:
+	if (buf_lock != NULL) {
+		lock_destroy(buf_lock);
+		buf_lock = NULL;
+	}
+	if (buf_syncer_cv != NULL) {
+		cv_destroy(buf_syncer_cv);
+	}
+	if (buf_cv != NULL) {
+		cv_destroy(buf_cv);
+	}
+	kfree(buf_hash);
+	return ENOMEM;
+}
+
+/*
+ * Get BLOCK of SFS, reading it from disk unless it is cached, and
+ * hand it back pinned.
+ */
+int
+sfs_buf_read(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	lock_acquire(buf_lock);
+	result = buf_getbuf(sfs, block, &b);
+	if (result) {
+		lock_release(buf_lock);
+		return result;
+	}
+	if (!b->b_valid) {
+		lock_release(buf_lock);
+		result = sfs_rblock(sfs, b->b_data, block);
+		lock_acquire(buf_lock);
+		bufstat_reads++;
+		if (result) {
+			buf_unpin(b);
+			lock_release(buf_lock);
+			return result;
+		}
+		b->b_valid = true;
+	}
+	lock_release(buf_lock);
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Get the buffer for BLOCK of SFS, pinned, without reading it. For
+ * callers that are about to overwrite the whole block. If the block
+ * was not cached the buffer is zero-filled, and it only becomes the
+ * block's contents once sfs_buf_markdirty is called; released without
+ * that, it is thrown away.
+ */
+int
+sfs_buf_get(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret)
+{
+	int result;
+
+	lock_acquire(buf_lock);
+	result = buf_getbuf(sfs, block, ret);
+	lock_release(buf_lock);
+	return result;
+}
+
+void *
+sfs_buf_data(struct sfs_buf *b)
+{
+	KASSERT(b->b_pinned);
+	return b->b_data;
+}
+
+/*
+ * Whether a pinned buffer holds the block's contents, as opposed to
+ * the zeros sfs_buf_get hands back for a block that wasn't cached.
+ */
+bool
+sfs_buf_valid(struct sfs_buf *b)
+{
+	KASSERT(b->b_pinned);
+	return b->b_valid;
+}
+
+/*
+ * Note that a pinned buffer has been changed and needs writing back.
+ */
+void
+sfs_buf_markdirty(struct sfs_buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_pinned);
+	b->b_valid = true;
+	if (!b->b_dirty) {
+		b->b_dirty = true;
+		buf_ndirty++;
+		b->b_fs->sfs_ndirtybufs++;
+		if (buf_ndirty == buf_max / 4) {
+			cv_signal(buf_syncer_cv, buf_lock);
+		}
+	}
+	lock_release(buf_lock);
+}
+
+void
+sfs_buf_release(struct sfs_buf *b)
+{
+	lock_acquire(buf_lock);
+	buf_unpin(b);
+	lock_release(buf_lock);
+}
+
+/*
+ * Forget any cached copy of BLOCK of SFS, dirty or not. Called when
+ * the block is freed, so a stale copy is never written over whatever
+ * the block is used for next. The caller must not have it pinned.
+ */
+void
+sfs_buf_drop(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *b;
+
+	lock_acquire(buf_lock);
+ again:
+	b = buf_lookup(sfs, block);
+	if (b != NULL) {
+		if (b->b_pinned) {
+			cv_wait(buf_cv, buf_lock);
+			goto again;
+		}
+		buf_setclean(b);
+		buf_lruremove(b);
+		buf_hashremove(b);
+		buf_lruprepend(b);
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * Write back every dirty buffer of SFS.
+ */
+int
+sfs_buf_flush(struct sfs_fs *sfs)
+{
+	int result;
+
+	lock_acquire(buf_lock);
+	result = buf_flush(sfs);
+	lock_release(buf_lock);
+	return result;
+}
+
+/*
+ * Throw away every buffer of SFS, which is being unmounted. It must
+ * have been flushed and have no files open.
+ */
+void
+sfs_buf_purge(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b, *next;
+	unsigned i;
+
+	lock_acquire(buf_lock);
+	KASSERT(sfs->sfs_ndirtybufs == 0);
+	for (i=0; i<=buf_hashmask; i++) {
+		for (b = buf_hash[i]; b != NULL; b = next) {
+			next = b->b_hashnext;
+			if (b->b_fs == sfs) {
+				KASSERT(!b->b_pinned);
+				buf_lruremove(b);
+				buf_hashremove(b);
+				buf_lruprepend(b);
+			}
+		}
+	}
+	lock_release(buf_lock);
+}
+
+/*
+ * Print the cache counters (the "bc" menu command).
+ */
+void
+sfs_buf_printstats(void)
+{
+	if (buf_lock == NULL) {
+		kprintf("sfs: buffer cache not set up (nothing mounted yet)\n");
+		return;
+	}
+
+	lock_acquire(buf_lock);
+	kprintf("sfs: buffer cache %u buffers (target %u), %u dirty\n",
+		buf_count, buf_max, buf_ndirty);
+	kprintf("sfs: %lu hits, %lu misses, %lu evictions, %lu overflows\n",
+		bufstat_hits, bufstat_misses, bufstat_evictions,
+		bufstat_overflows);
+	kprintf("sfs: %lu blocks read, %lu blocks written\n",
+		bufstat_reads, bufstat_writes);
+	lock_release(buf_lock);
+}
@@ -39,6 +39,7 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -111,11 +112,8 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,18 +146,30 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+	/* Go over the loaded vnodes, putting their inodes in the cache. */
+	result = sfs_sync_vnodes(sfs);
+	if (result) {
+		return result;
 	}
 
+	/* Write back everything dirty in the buffer cache. */
+	result = sfs_buf_flush(sfs);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * The free map and superblock are written under their lock, so
+	 * that what goes to disk is a consistent copy. Allocation
+	 * waits meanwhile; sync doesn't happen often.
+	 */
+	lock_acquire(sfs->sfs_freemaplock);
+
 	/* If the free block map needs to be written, write it. */
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_mapio(sfs, UIO_WRITE);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
@@ -169,13 +179,13 @@ sfs_sync(struct fs *fs)
 	if (sfs->sfs_superdirty) {
 		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -189,13 +199,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* Set at mount time and never changed, so no lock is needed. */
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -208,22 +214,30 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
-	
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
-		return EBUSY;
+	/*
+	 * Do we have any files open? If so, can't unmount. Otherwise
+	 * this throws away the vnodes kept around on the inactive list.
+	 * vfs_unmount keeps anyone from getting at our root while it
+	 * runs, so once the table is empty it stays that way.
+	 */
+	result = sfs_vntable_drain(sfs);
+	if (result) {
+		return result;
 	}
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_ndirtybufs == 0);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_buf_purge(sfs);
+	sfs_vntable_cleanup(sfs);
 	bitmap_destroy(sfs->sfs_freemap);
+	lock_destroy(sfs->sfs_vnlock);
+	lock_destroy(sfs->sfs_freemaplock);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -232,7 +246,6 @@ sfs_unmount(struct fs *fs)
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -257,8 +270,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -278,22 +289,43 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		return ENXIO;
 	}
 
+	/*
+	 * Set up the buffer cache if this is the first mount. (Mounts
+	 * are serialized by vfs_mount.)
+	 */
+	result = sfs_buf_bootstrap();
+	if (result) {
+		return result;
+	}
+
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* Set up the table of loaded vnodes */
+	result = sfs_vntable_init(sfs);
+	if (result) {
+		kfree(sfs);
+		return result;
+	}
+
+	/* Create locks */
+	sfs->sfs_vnlock = lock_create("sfs_vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		sfs_vntable_cleanup(sfs);
+		kfree(sfs);
+		return ENOMEM;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs_freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vntable_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -303,9 +335,10 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vntable_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -316,12 +349,23 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vntable_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 	
+	if (sfs->sfs_super.sp_features & ~SFS_FEATURES_KNOWN) {
+		kprintf("sfs: Unsupported features 0x%x\n",
+			sfs->sfs_super.sp_features & ~SFS_FEATURES_KNOWN);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vntable_cleanup(sfs);
+		kfree(sfs);
+		return EINVAL;
+	}
+
 	if (sfs->sfs_super.sp_nblocks > dev->d_blocks) {
 		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
 			sfs->sfs_super.sp_nblocks, dev->d_blocks);
@@ -333,17 +377,19 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vntable_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		sfs_vntable_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -352,16 +398,17 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	sfs->sfs_absfs.fs_getvolname = sfs_getvolname;
 	sfs->sfs_absfs.fs_getroot = sfs_getroot;
 	sfs->sfs_absfs.fs_unmount = sfs_unmount;
+	sfs->sfs_absfs.fs_dcache = true;
 	sfs->sfs_absfs.fs_data = sfs;
 
 	/* the other fields */
 	sfs->sfs_superdirty = false;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_ndirtybufs = 0;
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
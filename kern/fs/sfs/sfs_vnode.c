@@ -53,32 +53,307 @@ static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 //
 // Simple stuff
 
-/* Zero out a disk block. */
+/* Zero out a disk block (in the buffer cache; it gets written later). */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct sfs_buf *buf;
+	int result;
+
+	result = sfs_buf_get(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(sfs_buf_data(buf), SFS_BLOCKSIZE);
+	sfs_buf_markdirty(buf);
+	sfs_buf_release(buf);
+	return 0;
 }
 
-/* Write an on-disk inode structure back out to disk. */
+/*
+ * Copy an on-disk inode structure back into its block. This only
+ * updates the buffer cache; sfs_fsync or the syncer writes it out.
+ */
 static
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	struct sfs_buf *buf;
+	int result;
+
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
+		result = sfs_buf_get(sfs, sv->sv_ino, &buf);
 		if (result) {
 			return result;
 		}
+		memcpy(sfs_buf_data(buf), &sv->sv_i, sizeof(sv->sv_i));
+		sfs_buf_markdirty(buf);
+		sfs_buf_release(buf);
 		sv->sv_dirty = false;
 	}
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Vnode table
+
+/*
+ * The vnodes loaded into memory are kept in a hash table on inode
+ * number, which doubles in size as it fills.
+ *
+ * When the last reference to a vnode goes away and the file still
+ * exists, sfs_reclaim doesn't free the vnode. It parks it on the
+ * inactive list instead, still in the table, so that a file closed
+ * recently can be picked up again without rebuilding the vnode. The
+ * list is in LRU order, least recently used at the head, and is kept
+ * to SFS_MAXINACTIVE vnodes per volume by freeing from there.
+ *
+ * An inactive vnode is clean and holds exactly one reference, which
+ * belongs to the list; sfs_loadvnode hands that reference to whoever
+ * picks the vnode up. The only way to reach an inactive vnode is
+ * through the table, so sfs_vnlock covers all of this and nobody can
+ * be holding its sv_lock.
+ */
+
+#define SFS_VNHASH_INIT		64	/* initial buckets; a power of 2 */
+#define SFS_MAXINACTIVE		128	/* inactive vnodes kept per volume */
+
+/* Size of the kernel buffer user I/O is staged through (sfs_userio) */
+#define SFS_BOUNCESIZE		(8 * SFS_BLOCKSIZE)
+
+static
+unsigned
+sfs_vnhashfn(struct sfs_fs *sfs, uint32_t ino)
+{
+	return ino & sfs->sfs_vnhashmask;
+}
+
+/*
+ * Set up an empty table. Called at mount time.
+ */
+int
+sfs_vntable_init(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASH_INIT *
+				  sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_VNHASH_INIT; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_vnhashmask = SFS_VNHASH_INIT - 1;
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_inactivehead = sfs->sfs_inactivetail = NULL;
+	sfs->sfs_ninactive = 0;
+	return 0;
+}
+
+/*
+ * Destroy the table, which must be empty.
+ */
+void
+sfs_vntable_cleanup(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_nvnodes == 0);
+	KASSERT(sfs->sfs_ninactive == 0);
+	kfree(sfs->sfs_vnhash);
+	sfs->sfs_vnhash = NULL;
+}
+
+/* Find the vnode for inode INO, or NULL if it isn't loaded. */
+static
+struct sfs_vnode *
+sfs_vntable_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	for (sv = sfs->sfs_vnhash[sfs_vnhashfn(sfs, ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Double the number of buckets. If there's no memory for that, carry
+ * on with longer chains; it'll be tried again on the next insert.
+ */
+static
+void
+sfs_vntable_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **oldhash, **newhash, *sv;
+	unsigned oldsize, newsize, i, h;
+
+	oldhash = sfs->sfs_vnhash;
+	oldsize = sfs->sfs_vnhashmask + 1;
+	newsize = oldsize * 2;
+
+	newhash = kmalloc(newsize * sizeof(struct sfs_vnode *));
+	if (newhash == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newhash[i] = NULL;
+	}
+
+	sfs->sfs_vnhash = newhash;
+	sfs->sfs_vnhashmask = newsize - 1;
+	for (i=0; i<oldsize; i++) {
+		while ((sv = oldhash[i]) != NULL) {
+			oldhash[i] = sv->sv_hashnext;
+			h = sfs_vnhashfn(sfs, sv->sv_ino);
+			sv->sv_hashnext = newhash[h];
+			newhash[h] = sv;
+		}
+	}
+	kfree(oldhash);
+}
+
+static
+void
+sfs_vntable_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h;
+
+	if (sfs->sfs_nvnodes >= 2 * (sfs->sfs_vnhashmask + 1)) {
+		sfs_vntable_grow(sfs);
+	}
+	h = sfs_vnhashfn(sfs, sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vntable_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+
+	for (svp = &sfs->sfs_vnhash[sfs_vnhashfn(sfs, sv->sv_ino)];
+	     *svp != sv; svp = &(*svp)->sv_hashnext) {
+		if (*svp == NULL) {
+			panic("sfs: vnode %u not in vnode table\n",
+			      sv->sv_ino);
+		}
+	}
+	*svp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+}
+
+/* Put SV on the tail (most recently used end) of the inactive list. */
+static
+void
+sfs_inactive_append(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(!sv->sv_inactive);
+	sv->sv_inactive = true;
+	sv->sv_lrunext = NULL;
+	sv->sv_lruprev = sfs->sfs_inactivetail;
+	if (sfs->sfs_inactivetail != NULL) {
+		sfs->sfs_inactivetail->sv_lrunext = sv;
+	}
+	else {
+		sfs->sfs_inactivehead = sv;
+	}
+	sfs->sfs_inactivetail = sv;
+	sfs->sfs_ninactive++;
+}
+
+static
+void
+sfs_inactive_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(sv->sv_inactive);
+	if (sv->sv_lruprev != NULL) {
+		sv->sv_lruprev->sv_lrunext = sv->sv_lrunext;
+	}
+	else {
+		sfs->sfs_inactivehead = sv->sv_lrunext;
+	}
+	if (sv->sv_lrunext != NULL) {
+		sv->sv_lrunext->sv_lruprev = sv->sv_lruprev;
+	}
+	else {
+		sfs->sfs_inactivetail = sv->sv_lruprev;
+	}
+	sv->sv_lrunext = sv->sv_lruprev = NULL;
+	sv->sv_inactive = false;
+	KASSERT(sfs->sfs_ninactive > 0);
+	sfs->sfs_ninactive--;
+}
+
+/*
+ * Take vnodes off the head of the inactive list, and out of the
+ * table, until no more than MAX are left. Returns them chained
+ * through sv_lrunext, for sfs_vnfree to dispose of once sfs_vnlock
+ * has been released.
+ */
+static
+struct sfs_vnode *
+sfs_inactive_trim(struct sfs_fs *sfs, unsigned max)
+{
+	struct sfs_vnode *sv, *list = NULL;
+
+	while (sfs->sfs_ninactive > max) {
+		sv = sfs->sfs_inactivehead;
+		sfs_inactive_remove(sfs, sv);
+		sfs_vntable_remove(sfs, sv);
+		sv->sv_lrunext = list;
+		list = sv;
+	}
+	return list;
+}
+
+/* Free a list of vnodes returned by sfs_inactive_trim. */
+static
+void
+sfs_vnfree(struct sfs_vnode *list)
+{
+	struct sfs_vnode *sv;
+
+	while ((sv = list) != NULL) {
+		list = sv->sv_lrunext;
+		KASSERT(!sv->sv_dirty);
+		VOP_CLEANUP(&sv->sv_v);
+		rwlock_destroy(sv->sv_lock);
+		kfree(sv);
+	}
+}
+
+/*
+ * Free all the inactive vnodes, for unmount. Fails with EBUSY, and
+ * frees nothing, if any vnode is still in use.
+ */
+int
+sfs_vntable_drain(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *list;
+
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > sfs->sfs_ninactive) {
+		lock_release(sfs->sfs_vnlock);
+		return EBUSY;
+	}
+	list = sfs_inactive_trim(sfs, 0);
+	KASSERT(sfs->sfs_nvnodes == 0);
+	lock_release(sfs->sfs_vnlock);
+
+	sfs_vnfree(list);
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Space allocation
@@ -92,11 +367,14 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
@@ -113,8 +391,17 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	/*
+	 * Don't let a stale cached copy get written over the block's
+	 * next use. This has to happen while the block is still
+	 * marked in use, or it could already have been handed out.
+	 */
+	sfs_buf_drop(sfs, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -124,11 +411,18 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
@@ -146,23 +440,14 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbp;
+	uint32_t *idbuf;
 	uint32_t block;
 	uint32_t idblock;
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
 	/*
 	 * If the block we want is one of the direct blocks...
 	 */
@@ -246,19 +531,17 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+
+	/*
+	 * Load the indirect block. (If we just allocated it, sfs_balloc
+	 * left it zeroed in the buffer cache.)
+	 */
+	result = sfs_buf_read(sfs, idblock, &idbp);
+	if (result) {
+		return result;
 	}
+	idbuf = sfs_buf_data(idbp);
 
 	/* Get the block out of the indirect block buffer */
 	block = idbuf[idoff];
@@ -267,18 +550,17 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	if (block==0 && doalloc) {
 		result = sfs_balloc(sfs, &block);
 		if (result) {
+			sfs_buf_release(idbp);
 			return result;
 		}
 
 		/* Remember the block we allocated */
 		idbuf[idoff] = block;
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+		/* The indirect block is now dirty */
+		sfs_buf_markdirty(idbp);
 	}
+	sfs_buf_release(idbp);
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
@@ -289,6 +571,99 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	return 0;
 }
 
+/*
+ * Truncate (or extend) a file to LEN bytes, freeing any blocks past
+ * the new end. Used by sfs_truncate and sfs_reclaim; the caller holds
+ * sv_lock exclusively.
+ */
+static
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbp;
+	uint32_t *idbuf;
+
+	/* Length in blocks (divide rounding up) */
+	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+
+	uint32_t i, j, block;
+	uint32_t idblock, baseblock, highblock;
+	int result;
+	int hasnonzero, iddirty;
+
+	/*
+	 * Go through the direct blocks. Discard any that are
+	 * past the limit we're truncating to.
+	 */
+	for (i=0; i<SFS_NDIRECT; i++) {
+		block = sv->sv_i.sfi_direct[i];
+		if (i >= blocklen && block != 0) {
+			sfs_bfree(sfs, block);
+			sv->sv_i.sfi_direct[i] = 0;
+			sv->sv_dirty = true;
+		}
+	}
+
+	/* Indirect block number */
+	idblock = sv->sv_i.sfi_indirect;
+
+	/* The lowest block in the indirect block */
+	baseblock = SFS_NDIRECT;
+
+	/* The highest block in the indirect block */
+	highblock = baseblock + SFS_DBPERIDB - 1;
+
+	if (blocklen < highblock && idblock != 0) {
+		/* We're past the proposed EOF; may need to free stuff */
+
+		/* Read the indirect block */
+		result = sfs_buf_read(sfs, idblock, &idbp);
+		if (result) {
+			return result;
+		}
+		idbuf = sfs_buf_data(idbp);
+		
+		hasnonzero = 0;
+		iddirty = 0;
+		for (j=0; j<SFS_DBPERIDB; j++) {
+			/* Discard any blocks that are past the new EOF */
+			if (blocklen < baseblock+j && idbuf[j] != 0) {
+				sfs_bfree(sfs, idbuf[j]);
+				idbuf[j] = 0;
+				iddirty = 1;
+			}
+			/* Remember if we see any nonzero blocks in here */
+			if (idbuf[j]!=0) {
+				hasnonzero=1;
+			}
+		}
+
+		if (!hasnonzero) {
+			/* The whole indirect block is empty now; free it */
+			sfs_buf_release(idbp);
+			sfs_bfree(sfs, idblock);
+			sv->sv_i.sfi_indirect = 0;
+			sv->sv_dirty = true;
+		}
+		else {
+			/* If the indirect block is dirty, mark it so */
+			if (iddirty) {
+				sfs_buf_markdirty(idbp);
+			}
+			sfs_buf_release(idbp);
+		}
+	}
+
+	/* Set the file size */
+	sv->sv_i.sfi_size = len;
+
+	/* Mark the inode dirty */
+	sv->sv_dirty = true;
+
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
@@ -308,16 +683,9 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *iobuf;
+	char *ioptr;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -339,40 +707,36 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Hand back zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_buf_read(sfs, diskblock, &iobuf);
 	if (result) {
 		return result;
 	}
+	ioptr = sfs_buf_data(iobuf);
+
+	/*
+	 * Now perform the requested operation into/out of the buffer.
+	 */
+	result = uiomove(ioptr+skipstart, len, uio);
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * If it was a write, the block is dirty; even if uiomove
+	 * failed, part of it may have been changed.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		sfs_buf_markdirty(iobuf);
 	}
+	sfs_buf_release(iobuf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -383,14 +747,11 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
 	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -413,29 +774,35 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
+	 * Go through the buffer cache. A whole-block write overwrites
+	 * the block, so there is no need to read it first.
 	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_READ) {
+		result = sfs_buf_read(sfs, diskblock, &iobuf);
+	}
+	else {
+		result = sfs_buf_get(sfs, diskblock, &iobuf);
+	}
+	if (result) {
+		return result;
+	}
+
+	result = uiomove(sfs_buf_data(iobuf), SFS_BLOCKSIZE, uio);
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
+	 * As in sfs_partialio, a failed write may still have changed
+	 * part of a cached block, so that one is dirty either way. But
+	 * a buffer that wasn't cached starts out zero-filled; if the
+	 * copy stopped partway, marking it dirty would write those
+	 * zeros over the rest of the block on disk. Throw it away
+	 * instead.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	if (uio->uio_rw == UIO_WRITE &&
+	    (result == 0 || sfs_buf_valid(iobuf))) {
+		sfs_buf_markdirty(iobuf);
+	}
+	sfs_buf_release(iobuf);
 
 	return result;
 }
@@ -605,35 +972,431 @@ sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 		return result;
 	}
 
-	/* Should not end up with a partial entry! */
-	if (ku.uio_resid > 0) {
-		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
+	/* Should not end up with a partial entry! */
+	if (ku.uio_resid > 0) {
+		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
+	}
+
+	/* Done */
+	return 0;
+}
+
+/*
+ * Compute the number of entries in a directory.
+ * This actually computes the number of existing slots, and does not
+ * account for empty slots.
+ */
+static
+int
+sfs_dir_nentries(struct sfs_vnode *sv)
+{
+	off_t size;
+
+	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+
+	size = sv->sv_i.sfi_size;
+	if (size % sizeof(struct sfs_dir) != 0) {
+		panic("sfs: directory %u: Invalid size %llu\n",
+		      sv->sv_ino, size);
+	}
+
+	return size / sizeof(struct sfs_dir);
+}
+
+/*
+ * Hashed directories. See kern/sfs.h for the layout. The slot numbers
+ * used by sfs_readdir and friends still count from the start of the
+ * file, so the header block is slots 0 to SFS_DIRPERBLOCK-1 and bucket
+ * B is the SFS_DIRPERBLOCK slots starting at (B+1)*SFS_DIRPERBLOCK.
+ * The caller holds the directory's sv_lock for writing for anything
+ * that changes the directory, including the rehash done by link.
+ */
+
+static
+bool
+sfs_dir_hashed(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	return (sfs->sfs_super.sp_features & SFS_FEATURE_DIRHASH) != 0;
+}
+
+static
+uint32_t
+sfs_dirhash_name(const char *name)
+{
+	uint32_t h = SFS_DIRHASH_INIT;
+
+	for (; *name; name++) {
+		h = SFS_DIRHASH_STEP(h, *name);
+	}
+	return h;
+}
+
+/* Read or write the header at the front of a hashed directory. */
+static
+int
+sfs_dirhdr_io(struct sfs_vnode *sv, struct sfs_dirhdr *hdr, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, hdr, sizeof(*hdr), 0, rw);
+	result = sfs_io(sv, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid > 0) {
+		panic("sfs: directory %u: Short hash header\n", sv->sv_ino);
+	}
+
+	if (rw == UIO_READ &&
+	    (hdr->sdh_magic != SFS_DIRHASH_MAGIC ||
+	     hdr->sdh_nbuckets == 0 ||
+	     hdr->sdh_nbuckets > SFS_DIRHASH_MAXBUCKETS ||
+	     (hdr->sdh_nbuckets & (hdr->sdh_nbuckets - 1)) != 0 ||
+	     sv->sv_i.sfi_size !=
+	     (hdr->sdh_nbuckets + 1) * SFS_BLOCKSIZE)) {
+		panic("sfs: directory %u: Bad hash header\n", sv->sv_ino);
+	}
+	return 0;
+}
+
+/* First slot of bucket B. */
+static
+int
+sfs_dirhash_slot(unsigned b)
+{
+	return (b + 1) * SFS_DIRPERBLOCK;
+}
+
+/*
+ * Find a free slot in bucket B, or hand back -1 if it's full.
+ */
+static
+int
+sfs_dirhash_freeslot(struct sfs_vnode *sv, unsigned b, int *slot)
+{
+	struct sfs_dir tsd;
+	int i, result;
+
+	for (i=sfs_dirhash_slot(b); i<sfs_dirhash_slot(b+1); i++) {
+		result = sfs_readdir(sv, &tsd, i);
+		if (result) {
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			*slot = i;
+			return 0;
+		}
+	}
+	*slot = -1;
+	return 0;
+}
+
+/*
+ * Look NAME up in a hashed directory: the home bucket, and the ones
+ * after it while overflow bits say there may be more.
+ */
+static
+int
+sfs_dirhash_find(struct sfs_vnode *sv, const char *name,
+		 uint32_t *ino, int *slot)
+{
+	struct sfs_dirhdr hdr;
+	struct sfs_dir tsd;
+	unsigned b, probes;
+	int i, result;
+
+	if (sv->sv_i.sfi_size == 0) {
+		return ENOENT;
+	}
+	result = sfs_dirhdr_io(sv, &hdr, UIO_READ);
+	if (result) {
+		return result;
+	}
+
+	b = sfs_dirhash_name(name) & (hdr.sdh_nbuckets - 1);
+	for (probes = 0; probes < hdr.sdh_nbuckets; probes++) {
+		for (i=sfs_dirhash_slot(b); i<sfs_dirhash_slot(b+1); i++) {
+			result = sfs_readdir(sv, &tsd, i);
+			if (result) {
+				return result;
+			}
+			if (tsd.sfd_ino == SFS_NOINO) {
+				continue;
+			}
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			if (!strcmp(tsd.sfd_name, name)) {
+				if (slot != NULL) {
+					*slot = i;
+				}
+				if (ino != NULL) {
+					*ino = tsd.sfd_ino;
+				}
+				return 0;
+			}
+		}
+		if ((hdr.sdh_overflow[b/8] & (1 << (b%8))) == 0) {
+			break;
+		}
+		b = (b + 1) & (hdr.sdh_nbuckets - 1);
+	}
+	return ENOENT;
+}
+
+/*
+ * Put entry SD in its bucket, or the first one after it with room,
+ * and update HDR to match (the caller writes it back). Fails with
+ * ENOSPC if every bucket is full.
+ */
+static
+int
+sfs_dirhash_place(struct sfs_vnode *sv, struct sfs_dirhdr *hdr,
+		  struct sfs_dir *sd, int *slot)
+{
+	unsigned b, probes;
+	int freeslot, result;
+
+	b = sfs_dirhash_name(sd->sfd_name) & (hdr->sdh_nbuckets - 1);
+	for (probes = 0; probes < hdr->sdh_nbuckets; probes++) {
+		result = sfs_dirhash_freeslot(sv, b, &freeslot);
+		if (result) {
+			return result;
+		}
+		if (freeslot >= 0) {
+			result = sfs_writedir(sv, sd, freeslot);
+			if (result) {
+				return result;
+			}
+			hdr->sdh_nentries++;
+			if (slot != NULL) {
+				*slot = freeslot;
+			}
+			return 0;
+		}
+		hdr->sdh_overflow[b/8] |= 1 << (b%8);
+		b = (b + 1) & (hdr->sdh_nbuckets - 1);
+	}
+	return ENOSPC;
+}
+
+/*
+ * Write empty entries into slots FIRST to LAST-1, so that no bucket is
+ * left sparse.
+ */
+static
+int
+sfs_dirhash_clear(struct sfs_vnode *sv, int first, int last)
+{
+	struct sfs_dir sd;
+	int i, result;
+
+	bzero(&sd, sizeof(sd));
+	sd.sfd_ino = SFS_NOINO;
+	for (i=first; i<last; i++) {
+		result = sfs_writedir(sv, &sd, i);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Lay out an empty hashed directory with NBUCKETS buckets and set up
+ * HDR. If that fails, the directory is cut back to nothing, so it
+ * isn't left with a size that no header describes.
+ */
+static
+int
+sfs_dirhash_format(struct sfs_vnode *sv, struct sfs_dirhdr *hdr,
+		   unsigned nbuckets)
+{
+	int result;
+
+	KASSERT(sv->sv_i.sfi_size == 0);
+
+	result = sfs_dirhash_clear(sv, 0, sfs_dirhash_slot(nbuckets));
+	if (result) {
+		(void)sfs_itrunc(sv, 0);
+		return result;
+	}
+
+	bzero(hdr, sizeof(*hdr));
+	hdr->sdh_magic = SFS_DIRHASH_MAGIC;
+	hdr->sdh_nbuckets = nbuckets;
+	hdr->sdh_nentries = 0;
+	return 0;
+}
+
+/*
+ * Double the number of buckets: pull all the entries out, lay the
+ * directory out again at the new size, and put them back. This is
+ * O(entries), but happens each time the size doubles, so it averages
+ * out to a constant per entry added.
+ *
+ * The new buckets are added before anything is moved, so running out
+ * of disk space leaves the directory as it was. If something fails
+ * after that, the entries go back into the slots they came from; the
+ * header on disk is only changed once everything has been placed.
+ */
+static
+int
+sfs_dirhash_grow(struct sfs_vnode *sv, struct sfs_dirhdr *hdr)
+{
+	struct sfs_dirhdr newhdr;
+	struct sfs_dir *ents;
+	int *slots;
+	unsigned oldnb, nents, n;
+	int i, result;
+
+	oldnb = hdr->sdh_nbuckets;
+	KASSERT(oldnb < SFS_DIRHASH_MAXBUCKETS);
+
+	ents = kmalloc((hdr->sdh_nentries + 1) * sizeof(struct sfs_dir));
+	if (ents == NULL) {
+		return ENOMEM;
+	}
+	slots = kmalloc((hdr->sdh_nentries + 1) * sizeof(int));
+	if (slots == NULL) {
+		kfree(ents);
+		return ENOMEM;
+	}
+
+	nents = 0;
+	for (i=sfs_dirhash_slot(0); i<sfs_dirhash_slot(oldnb); i++) {
+		result = sfs_readdir(sv, &ents[nents], i);
+		if (result) {
+			goto out;
+		}
+		if (ents[nents].sfd_ino != SFS_NOINO) {
+			if (nents == hdr->sdh_nentries) {
+				panic("sfs: directory %u: More entries than "
+				      "the hash header says\n", sv->sv_ino);
+			}
+			slots[nents++] = i;
+		}
+	}
+
+	/* Add the new buckets. */
+	result = sfs_dirhash_clear(sv, sfs_dirhash_slot(oldnb),
+				   sfs_dirhash_slot(oldnb * 2));
+	if (result) {
+		goto shrink;
+	}
+
+	/* Empty the old ones and place everything again. */
+	newhdr = *hdr;
+	newhdr.sdh_nbuckets = oldnb * 2;
+	newhdr.sdh_nentries = 0;
+	bzero(newhdr.sdh_overflow, sizeof(newhdr.sdh_overflow));
+
+	result = sfs_dirhash_clear(sv, sfs_dirhash_slot(0),
+				   sfs_dirhash_slot(oldnb));
+	if (result) {
+		goto restore;
+	}
+	for (n=0; n<nents; n++) {
+		result = sfs_dirhash_place(sv, &newhdr, &ents[n], NULL);
+		if (result) {
+			goto restore;
+		}
+	}
+	result = sfs_dirhdr_io(sv, &newhdr, UIO_WRITE);
+	if (result) {
+		goto restore;
+	}
+
+	*hdr = newhdr;
+	goto out;
+
+ restore:
+	/*
+	 * Best effort: if the disk is failing there is nothing better
+	 * to do, and the first error is the one to report.
+	 */
+	(void)sfs_dirhash_clear(sv, sfs_dirhash_slot(0),
+				sfs_dirhash_slot(oldnb));
+	for (n=0; n<nents; n++) {
+		(void)sfs_writedir(sv, &ents[n], slots[n]);
+	}
+ shrink:
+	(void)sfs_itrunc(sv, (oldnb + 1) * SFS_BLOCKSIZE);
+ out:
+	kfree(slots);
+	kfree(ents);
+	return result;
+}
+
+/*
+ * Add NAME -> INO to a hashed directory. The caller has checked that
+ * the name isn't there already. The directory is rehashed to twice
+ * the size once it's three-quarters full, or if the name's home
+ * bucket is full and the directory is at least half full.
+ */
+static
+int
+sfs_dirhash_link(struct sfs_vnode *sv, struct sfs_dir *sd, int *slot)
+{
+	struct sfs_dirhdr hdr;
+	unsigned capacity;
+	int freeslot, result;
+
+	if (sv->sv_i.sfi_size == 0) {
+		result = sfs_dirhash_format(sv, &hdr, 1);
+	}
+	else {
+		result = sfs_dirhdr_io(sv, &hdr, UIO_READ);
+	}
+	if (result) {
+		return result;
+	}
+
+	while (hdr.sdh_nbuckets < SFS_DIRHASH_MAXBUCKETS) {
+		capacity = hdr.sdh_nbuckets * SFS_DIRPERBLOCK;
+		if (4 * (hdr.sdh_nentries + 1) <= 3 * capacity) {
+			result = sfs_dirhash_freeslot(sv,
+				sfs_dirhash_name(sd->sfd_name) &
+				(hdr.sdh_nbuckets - 1), &freeslot);
+			if (result) {
+				return result;
+			}
+			if (freeslot >= 0 || 2 * hdr.sdh_nentries < capacity) {
+				break;
+			}
+		}
+		result = sfs_dirhash_grow(sv, &hdr);
+		if (result) {
+			return result;
+		}
 	}
 
-	/* Done */
-	return 0;
+	result = sfs_dirhash_place(sv, &hdr, sd, slot);
+	if (result) {
+		return result;
+	}
+	return sfs_dirhdr_io(sv, &hdr, UIO_WRITE);
 }
 
 /*
- * Compute the number of entries in a directory.
- * This actually computes the number of existing slots, and does not
- * account for empty slots.
+ * Note the removal of an entry in the header of a hashed directory.
  */
 static
 int
-sfs_dir_nentries(struct sfs_vnode *sv)
+sfs_dirhash_unlink(struct sfs_vnode *sv)
 {
-	off_t size;
-
-	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+	struct sfs_dirhdr hdr;
+	int result;
 
-	size = sv->sv_i.sfi_size;
-	if (size % sizeof(struct sfs_dir) != 0) {
-		panic("sfs: directory %u: Invalid size %llu\n",
-		      sv->sv_ino, size);
+	result = sfs_dirhdr_io(sv, &hdr, UIO_READ);
+	if (result) {
+		return result;
 	}
-
-	return size / sizeof(struct sfs_dir);
+	KASSERT(hdr.sdh_nentries > 0);
+	hdr.sdh_nentries--;
+	return sfs_dirhdr_io(sv, &hdr, UIO_WRITE);
 }
 
 /*
@@ -649,8 +1412,15 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 {
 	struct sfs_dir tsd;
 	int found = 0;
-	int nentries = sfs_dir_nentries(sv);
-	int i, result;
+	int nentries, i, result;
+
+	if (sfs_dir_hashed(sv)) {
+		/* Free slots are sfs_dirhash_link's business */
+		KASSERT(emptyslot == NULL);
+		return sfs_dirhash_find(sv, name, ino, slot);
+	}
+
+	nentries = sfs_dir_nentries(sv);
 
 	/* For each slot... */
 	for (i=0; i<nentries; i++) {
@@ -699,9 +1469,11 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	int emptyslot = -1;
 	int result;
 	struct sfs_dir sd;
+	bool hashed = sfs_dir_hashed(sv);
 
 	/* Look up the name. We want to make sure it *doesn't* exist. */
-	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
+	result = sfs_dir_findname(sv, name, NULL, NULL,
+				  hashed ? NULL : &emptyslot);
 	if (result!=0 && result!=ENOENT) {
 		return result;
 	}
@@ -713,6 +1485,13 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
+	if (hashed) {
+		bzero(&sd, sizeof(sd));
+		sd.sfd_ino = ino;
+		strcpy(sd.sfd_name, name);
+		return sfs_dirhash_link(sv, &sd, slot);
+	}
+
 	/* If we didn't get an empty slot, add the entry at the end. */
 	if (emptyslot < 0) {
 		emptyslot = sfs_dir_nentries(sv);
@@ -741,13 +1520,23 @@ int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_dir sd;
+	int result;
 
 	/* Initialize a suitable directory entry... */ 
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, &sd, slot);
+	result = sfs_writedir(sv, &sd, slot);
+	if (result) {
+		return result;
+	}
+
+	/* A hashed directory also keeps count */
+	if (sfs_dir_hashed(sv)) {
+		return sfs_dirhash_unlink(sv);
+	}
+	return 0;
 }
 
 /*
@@ -875,8 +1664,18 @@ static
 int
 sfs_close(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	/*
+	 * Put the inode back in the buffer cache, but leave writing
+	 * it and the file's blocks to the syncer. fsync() forces it.
+	 */
+	rwlock_acquire_write(sv->sv_lock);
+	result = sfs_sync_inode(sv);
+	rwlock_release_write(sv->sv_lock);
+
+	return result;
 }
 
 /*
@@ -890,67 +1689,80 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. sfs_loadvnode only hands out
+	 * references with sfs_vnlock held, so the count can't go up
+	 * while we hold it.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
+		rwlock_release_write(sv->sv_lock);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
-	/* If there are no on-disk references to the file either, erase it. */
-	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+	/*
+	 * If the file still exists, put the inode back in the buffer
+	 * cache and keep the vnode on the inactive list, in case the
+	 * file is used again soon. Make room by freeing the vnodes that
+	 * have been inactive longest. Let go of the vnode's lock before
+	 * it goes on the list; once there it isn't ours any more.
+	 */
+	if (sv->sv_i.sfi_linkcount > 0) {
+		struct sfs_vnode *victims;
+
+		result = sfs_sync_inode(sv);
+		rwlock_release_write(sv->sv_lock);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_vnlock);
 			return result;
 		}
-	}
 
-	/* Sync the inode to disk */
-	result = sfs_sync_inode(sv);
-	if (result) {
-		vfs_biglock_release();
-		return result;
-	}
+		sfs_inactive_append(sfs, sv);
+		victims = sfs_inactive_trim(sfs, SFS_MAXINACTIVE);
+		lock_release(sfs->sfs_vnlock);
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
+		sfs_vnfree(victims);
+		return 0;
 	}
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
+	/*
+	 * Otherwise the file is gone. Remove the vnode structure from
+	 * the table; nobody can look the inode up any more.
+	 */
+	sfs_vntable_remove(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * Erase the file and discard the inode. This does I/O, so it
+	 * happens after letting go of the table.
+	 */
+	result = sfs_itrunc(sv, 0);
+	if (result) {
+		/* Too late to back out; the blocks are lost. */
+		kprintf("sfs: reclaim: inode %u: %s\n", sv->sv_ino,
+			strerror(result));
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_bfree(sfs, sv->sv_ino);
 
-	VOP_CLEANUP(&sv->sv_v);
+	rwlock_release_write(sv->sv_lock);
 
-	vfs_biglock_release();
+	VOP_CLEANUP(&sv->sv_v);
+	rwlock_destroy(sv->sv_lock);
 
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
@@ -960,7 +1772,82 @@ sfs_reclaim(struct vnode *v)
 }
 
 /*
- * Called for read(). sfs_io() does the work.
+ * Do I/O between a file and user memory. The copy to or from user
+ * space can fault, and the fault can come back into SFS: a page of a
+ * program's data segment is filled by reading the executable, which
+ * may be this very file. Doing that copy with sv_lock held could wait
+ * behind a writer queued on the lock we hold, or on a buffer we have
+ * pinned. So stage the data through a kernel buffer, a few blocks at
+ * a time, and take sv_lock only for the file side of each piece.
+ *
+ * A read or write that spans several pieces is therefore not atomic
+ * with respect to other I/O on the file.
+ */
+static
+int
+sfs_userio(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	size_t len, done;
+	off_t pos;
+	int result = 0;
+
+	buf = kmalloc(SFS_BOUNCESIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	while (uio->uio_resid > 0) {
+		/* Keep the pieces block-aligned so sfs_io can use sfs_blockio */
+		pos = uio->uio_offset;
+		len = SFS_BOUNCESIZE - pos % SFS_BLOCKSIZE;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+
+		if (uio->uio_rw == UIO_WRITE) {
+			result = uiomove(buf, len, uio);
+			if (result) {
+				break;
+			}
+			uio_kinit(&iov, &ku, buf, len, pos, UIO_WRITE);
+			rwlock_acquire_write(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			rwlock_release_write(sv->sv_lock);
+			if (result) {
+				break;
+			}
+			KASSERT(ku.uio_resid == 0);
+		}
+		else {
+			uio_kinit(&iov, &ku, buf, len, pos, UIO_READ);
+			rwlock_acquire_read(sv->sv_lock);
+			result = sfs_io(sv, &ku);
+			rwlock_release_read(sv->sv_lock);
+			if (result) {
+				break;
+			}
+			done = len - ku.uio_resid;
+			if (done == 0) {
+				/* EOF */
+				break;
+			}
+			result = uiomove(buf, done, uio);
+			if (result || done < len) {
+				break;
+			}
+		}
+	}
+
+	kfree(buf);
+	return result;
+}
+
+/*
+ * Called for read(). sfs_io() does the work; user buffers go through
+ * sfs_userio.
  */
 static
 int
@@ -971,15 +1858,20 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return sfs_userio(sv, uio);
+	}
+
+	rwlock_acquire_read(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_read(sv->sv_lock);
 
 	return result;
 }
 
 /*
- * Called for write(). sfs_io() does the work.
+ * Called for write(). sfs_io() does the work; user buffers go through
+ * sfs_userio.
  */
 static
 int
@@ -990,9 +1882,13 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return sfs_userio(sv, uio);
+	}
+
+	rwlock_acquire_write(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 
 	return result;
 }
@@ -1033,7 +1929,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	rwlock_acquire_read(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	rwlock_release_read(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +1951,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes once the vnode is loaded; no lock needed. */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1100,11 +1995,19 @@ int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
+	if (result == 0) {
+		/*
+		 * The cache doesn't track which buffers belong to which
+		 * file, so write back everything dirty on the volume.
+		 */
+		result = sfs_buf_flush(sfs);
+	}
 
 	return result;
 }
@@ -1121,107 +2024,20 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Called for ftruncate().
  */
 static
 int
 sfs_truncate(struct vnode *v, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_vnode *sv = v->vn_data;
-	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-
-	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
-
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
 	int result;
-	int hasnonzero, iddirty;
-
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
-
-	/*
-	 * Go through the direct blocks. Discard any that are
-	 * past the limit we're truncating to.
-	 */
-	for (i=0; i<SFS_NDIRECT; i++) {
-		block = sv->sv_i.sfi_direct[i];
-		if (i >= blocklen && block != 0) {
-			sfs_bfree(sfs, block);
-			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
-		}
-	}
-
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
-	}
-
-	/* Set the file size */
-	sv->sv_i.sfi_size = len;
 
-	/* Mark the inode dirty */
-	sv->sv_dirty = true;
+	rwlock_acquire_write(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	rwlock_release_write(sv->sv_lock);
 
-	vfs_biglock_release();
-	return 0;
+	return result;
 }
 
 /*
@@ -1259,18 +2075,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return EEXIST;
 	}
 
@@ -1278,18 +2094,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			rwlock_release_write(sv->sv_lock);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -1300,19 +2116,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	rwlock_acquire_write(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	rwlock_release_write(newguy->sv_lock);
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 	return 0;
 }
 
@@ -1331,20 +2149,30 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	/*
+	 * No hard links to directories. (Besides the usual reasons,
+	 * linking a directory into itself would need its lock twice.)
+	 */
+	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
+		return EPERM;
+	}
+
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	rwlock_acquire_write(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	rwlock_release_write(f->sv_lock);
 
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 	return 0;
 }
 
@@ -1360,12 +2188,12 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -1373,15 +2201,21 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		rwlock_acquire_write(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		rwlock_release_write(victim->sv_lock);
 	}
 
-	/* Discard the reference that sfs_lookonce got us */
+	/*
+	 * Discard the reference that sfs_lookonce got us. (This may
+	 * reclaim the victim, which takes its lock; hence not holding
+	 * it here.)
+	 */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 	return result;
 }
 
@@ -1401,15 +2235,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	rwlock_acquire_write(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -1430,8 +2264,19 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	rwlock_acquire_write(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	rwlock_release_write(g1->sv_lock);
+
+	/*
+	 * Adding the new name to a hashed directory may have rehashed
+	 * it, so find the old name's slot again.
+	 */
+	result = sfs_dir_findname(sv, n1, NULL, &slot1, NULL);
+	if (result) {
+		goto puke_harder;
+	}
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1443,14 +2288,16 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	rwlock_acquire_write(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	rwlock_release_write(g1->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 	return 0;
 
  puke_harder:
@@ -1464,11 +2311,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	rwlock_acquire_write(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	rwlock_release_write(g1->sv_lock);
  puke:
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 	return result;
 }
 
@@ -1486,15 +2335,12 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* Only looks at the type, which never changes; no lock needed. */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +2348,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +2365,19 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
-	
+
+	rwlock_acquire_read(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	rwlock_release_read(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1644,49 +2486,55 @@ static const struct vnode_ops sfs_dirops = {
 
 /*
  * Function to load a inode into memory as a vnode, or dig up one
- * that's already resident.
+ * that's already resident, active or on the inactive list.
+ *
+ * sfs_vnlock is held throughout, including while reading the inode,
+ * so two threads can't load the same inode twice and a reclaim can't
+ * slip in between finding a vnode and taking a reference to it. The
+ * read is normally a buffer cache hit.
  */
 static
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
+	struct sfs_buf *buf;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	lock_acquire(sfs->sfs_vnlock);
 
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	/* Look in the vnode table */
+	sv = sfs_vntable_find(sfs, ino);
+	if (sv != NULL) {
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: Found inode %u in unallocated block\n",
-			      sv->sv_ino);
+		if (sv->sv_inactive) {
+			/* Take over the inactive list's reference */
+			sfs_inactive_remove(sfs, sv);
 		}
-
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
+		else {
 			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
 		}
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sv->sv_lock = rwlock_create("sfs_vnode");
+	if (sv->sv_lock==NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1697,11 +2545,15 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_rblock(sfs, &sv->sv_i, ino);
+	result = sfs_buf_read(sfs, ino, &buf);
 	if (result) {
+		rwlock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
+	memcpy(&sv->sv_i, sfs_buf_data(buf), sizeof(sv->sv_i));
+	sfs_buf_release(buf);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
@@ -1736,20 +2588,21 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		rwlock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_inactive = false;
+	sv->sv_lrunext = sv->sv_lruprev = NULL;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
-	}
+	sfs_vntable_add(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -1767,14 +2620,64 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
+
+/*
+ * Copy the inode of every loaded vnode into the buffer cache, for
+ * sfs_sync. The table can't be held while taking vnode locks (that
+ * would be the wrong order), so take a reference to each vnode first
+ * and work from a copy of the list. Inactive vnodes are already clean
+ * and are skipped.
+ */
+int
+sfs_sync_vnodes(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **svs, *sv;
+	unsigned i, num, max;
+	int result, ret = 0;
+
+	lock_acquire(sfs->sfs_vnlock);
+	max = sfs->sfs_nvnodes - sfs->sfs_ninactive;
+	if (max == 0) {
+		lock_release(sfs->sfs_vnlock);
+		return 0;
+	}
+	svs = kmalloc(max * sizeof(struct sfs_vnode *));
+	if (svs == NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	num = 0;
+	for (i=0; i<=sfs->sfs_vnhashmask; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			if (sv->sv_inactive) {
+				continue;
+			}
+			KASSERT(num < max);
+			VOP_INCREF(&sv->sv_v);
+			svs[num++] = sv;
+		}
+	}
+	KASSERT(num == max);
+	lock_release(sfs->sfs_vnlock);
+
+	for (i=0; i<num; i++) {
+		rwlock_acquire_write(svs[i]->sv_lock);
+		result = sfs_sync_inode(svs[i]);
+		rwlock_release_write(svs[i]->sv_lock);
+		if (result && ret == 0) {
+			ret = result;
+		}
+		VOP_DECREF(&svs[i]->sv_v);
+	}
+
+	kfree(svs);
+	return ret;
+}
@@ -48,13 +48,41 @@ struct vnode;
  * You write this.
  */
 
-struct pagetable{
-	vaddr_t va;
-	paddr_t pa;
-	struct pagetable * next;
-	char swap_status;
-	unsigned int indx_swapfile;	
+/*
+ * Page table entries. While a page is in memory the PTE holds the
+ * frame address plus the TLBLO_DIRTY and TLBLO_VALID bits, so the
+ * fault handler can hand it to the TLB as is. Once the page has been
+ * swapped out, the frame bits hold the swap slot and PTE_SWAPPED is
+ * set instead. A PTE of 0 means the page has never been touched.
+ */
+typedef uint32_t pte_t;
+
+#define PTE_FRAME	0xfffff000	/* frame address or swap slot */
+#define PTE_DIRTY	0x00000400	/* same as TLBLO_DIRTY */
+#define PTE_VALID	0x00000200	/* same as TLBLO_VALID */
+#define PTE_SWAPPED	0x00000001	/* contents are in the swap file */
+
+#define PTE_SWAPSLOT(pte)	((pte) >> 12)
+#define PTE_MKSWAP(slot)	(((pte_t)(slot) << 12) | PTE_SWAPPED)
 
+/*
+ * Two-level page table. The top 10 bits of the virtual address index
+ * the directory and the next 10 bits index a second level table of
+ * 1024 PTEs (one page). Only the bottom half of the directory is used
+ * because user space ends at 0x80000000. Second level tables are
+ * allocated the first time something in their 4M is touched.
+ */
+#define PT_L1_SHIFT	22
+#define PT_L2_SHIFT	12
+#define PT_L1_SIZE	512
+#define PT_L2_SIZE	1024
+
+#define PT_L1_INDEX(va)	((va) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(va)	(((va) >> PT_L2_SHIFT) & (PT_L2_SIZE - 1))
+#define PT_VADDR(l1, l2) (((vaddr_t)(l1) << PT_L1_SHIFT) | ((vaddr_t)(l2) << PT_L2_SHIFT))
+
+struct pagetable {
+	pte_t *pt_dir[PT_L1_SIZE];
 };
 
 struct region
@@ -62,6 +90,12 @@ struct region
 	vaddr_t va;
 	//paddr_t pa;
 	size_t no_of_pages;
+	//executable the region's pages are read from on first touch - NULL for anonymous (zero-fill) regions
+	struct vnode * vn;
+	//file image of the segment: filesize bytes at file offset offset go to seg_va, everything past that is zero (BSS)
+	off_t offset;
+	vaddr_t seg_va;
+	size_t filesize;
 	struct region * next;
 };
 
@@ -75,6 +109,13 @@ struct addrspace {
         //size_t as_npages2;
 	struct region * regions;
 	struct pagetable * table;
+	//serializes faults on this address space
+	struct lock * as_lock;
+	//changes whenever a translation is taken away or write protected; tags the software TLB cache entries
+	uint32_t as_gen;
+	//ring of the address spaces this one may share copy-on-write frames with (its fork relatives), itself included; protected by the coremap lock
+	struct addrspace * as_sharenext;
+	struct addrspace * as_shareprev;
         vaddr_t as_stackvbase;
 	vaddr_t as_stackvtop;
 	vaddr_t heap_start;
@@ -108,6 +149,11 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_segment - record that the region at VADDR is backed by
+ *                FILESIZE bytes of vnode V starting at OFFSET. Pages
+ *                are read in the first time they are touched; the rest
+ *                of the region is zero-fill.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -129,11 +175,37 @@ int               as_define_region(struct addrspace *as,
                                    int readable, 
                                    int writeable,
                                    int executable);
+int               as_define_segment(struct addrspace *as, vaddr_t vaddr,
+                                    struct vnode *v, off_t offset,
+                                    size_t filesize);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 
+/*
+ * Functions in pagetable.c:
+ *
+ *    pt_bootstrap - set up the page table object cache. Called from
+ *                 vm_bootstrap.
+ *
+ *    pt_create  - make an empty page table.
+ *
+ *    pt_destroy - free a page table. Does not touch the frames or swap
+ *                 slots the entries refer to; the caller does that.
+ *
+ *    pt_lookup  - return a pointer to the PTE for a virtual address. If
+ *                 CREATE is set, a missing second level table is
+ *                 allocated; otherwise NULL is returned for it. NULL
+ *                 with CREATE set means out of memory.
+ */
+
+void              pt_bootstrap(void);
+struct pagetable *pt_create(void);
+void              pt_destroy(struct pagetable *pt);
+pte_t            *pt_lookup(struct pagetable *pt, vaddr_t va, bool create);
+
+
 /*
  * Functions in loadelf.c
  *    load_elf - load an ELF user program executable into the current
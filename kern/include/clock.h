@@ -38,6 +38,11 @@
  * hardclock() is called on every CPU HZ times a second, possibly only
  * when the CPU is not idle, for scheduling.
  *
+ * hardclock_enable() turns the current CPU's hardclock on or off. The
+ * scheduler turns it off when the CPU is idle or has nothing to
+ * preempt in favor of; it stays on regardless while any timeouts (see
+ * <timeout.h>) are armed. Call with interrupts off.
+ *
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
  *
@@ -59,6 +64,7 @@
 void hardclock_bootstrap(void);
 
 void hardclock(void);
+void hardclock_enable(bool on);
 void timerclock(void);
 
 void gettime(time_t *seconds, uint32_t *nanoseconds);
@@ -70,8 +76,10 @@ void getinterval(time_t secs1, uint32_t nsecs,
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ * clocksleep_ticks() does the same for a number of hardclock ticks.
  */
 void clocksleep(int seconds);
+void clocksleep_ticks(unsigned ticks);
 
 
 #endif /* _CLOCK_H_ */
@@ -46,6 +46,14 @@
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
  */
 
+/*
+ * Each cpu's run queue is split into priority levels, 0 highest. The
+ * MLFQ scheduler (used unless OPT_DEFAULTSCHEDULER is set) queues a
+ * thread at its t_priority; the default scheduler leaves everyone at
+ * level 0, which makes the run queue a plain FIFO.
+ */
+#define RUNQ_LEVELS 4
+
 struct cpu {
 	/*
 	 * Fixed after allocation.
@@ -63,10 +71,13 @@ struct cpu {
 
 	/*
 	 * Accessed by other cpus.
-	 * Protected by the runqueue lock.
+	 * Protected by the runqueue lock. (c_ticking is only changed by
+	 * this cpu, and may be turned on without the lock.)
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	bool c_ticking;			/* True if hardclock is running */
+	struct threadlist c_runqueue[RUNQ_LEVELS]; /* Run queue, by level */
+	unsigned c_runcount;		/* Threads on all levels */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -99,6 +110,8 @@ struct cpu {
  *
  * cpu_create calls cpu_machdep_init.
  *
+ * cpu_count returns the number of cpus found so far.
+ *
  * cpu_start_secondary is the platform-dependent assembly language
  * entry point for new CPUs; it can be found in start.S. It calls
  * cpu_hatch after having claimed the startup stack and thread created
@@ -106,6 +119,7 @@ struct cpu {
  */
 struct cpu *cpu_create(unsigned hardware_number);
 void cpu_machdep_init(struct cpu *);
+unsigned cpu_count(void);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
@@ -1,6 +1,9 @@
 /* File operations header
     - This file will be used to define file table data structure
 */
+#ifndef _FDESC_H_
+#define _FDESC_H_
+
 #define MAX_LENGTH 32
 
 #include <threadlist.h>
@@ -8,13 +11,74 @@
 #include <vnode.h>
 #include <types.h>
 
+/*
+ * An open file. One of these is made per successful open and is
+ * shared by every descriptor that refers to it: descriptors copied by
+ * fork and dup2 see the same offset. ref_count counts those
+ * descriptors and is protected by ref_lock; lk serializes the I/O that
+ * uses and advances offset.
+ */
 struct fdesc{
 	char name[MAX_LENGTH];
 	off_t offset;
 	int flag;
 	int ref_count;
+	struct spinlock ref_lock;
 	struct lock *lk;
 	struct vnode *vn;
 };
 
+/* fdescs are allocated from this object cache, set up in thread_bootstrap */
+extern struct kmem_cache *fdesc_cache;
+
+/*
+ * fdesc_create - make an open file for VN (which it takes over) with
+ *                one reference. Returns NULL if out of memory.
+ * fdesc_incref - add a reference.
+ * fdesc_decref - drop a reference; the last one closes the vnode.
+ */
+struct fdesc *fdesc_create(const char *name, struct vnode *vn, int flag);
+void fdesc_incref(struct fdesc *file);
+void fdesc_decref(struct fdesc *file);
+
+/*
+ * Per-process descriptor table. It starts small and doubles as needed
+ * up to OPEN_MAX. ft_used has a bit set for each open descriptor, so
+ * the lowest free one is found a word at a time; ft_nopen lets
+ * teardown stop as soon as it has seen every open descriptor.
+ *
+ * The table belongs to one thread and is only touched by it, so it
+ * has no lock of its own.
+ */
+struct filetable {
+	struct fdesc **ft_files;
+	struct bitmap *ft_used;
+	unsigned ft_size;
+	unsigned ft_nopen;
+};
+
+/*
+ * filetable_create  - make an empty table.
+ * filetable_destroy - drop every descriptor and free the table.
+ * filetable_copy    - make a table sharing all of SRC's open files, as
+ *                     fork does.
+ * filetable_get     - return the open file for FD, or NULL.
+ * filetable_add     - put FILE at the lowest free descriptor, growing
+ *                     the table if needed. Takes over the caller's
+ *                     reference. EMFILE if the table is full.
+ * filetable_place   - put FILE at descriptor FD (dup2), taking over the
+ *                     caller's reference; whatever was there before is
+ *                     returned in *OLD for the caller to drop.
+ * filetable_remove  - clear descriptor FD and return its open file,
+ *                     whose reference the caller now owns, or NULL.
+ */
+struct filetable *filetable_create(void);
+void filetable_destroy(struct filetable *ft);
+int filetable_copy(struct filetable *src, struct filetable **ret);
+struct fdesc *filetable_get(struct filetable *ft, int fd);
+int filetable_add(struct filetable *ft, struct fdesc *file, int *fd);
+int filetable_place(struct filetable *ft, int fd, struct fdesc *file,
+		    struct fdesc **old);
+struct fdesc *filetable_remove(struct filetable *ft, int fd);
 
+#endif /* _FDESC_H_ */
@@ -58,6 +58,10 @@
  * however, the filesystem object and all storage associated with the
  * filesystem should have been discarded/released.
  *
+ * fs_dcache is true if the VFS name cache may remember lookups in this
+ * filesystem (see vfsdcache.c). It should be false if names can
+ * change other than through the VFS layer, as they can in emufs.
+ *
  * fs_data is a pointer to filesystem-specific data.
  */
 
@@ -67,6 +71,7 @@ struct fs {
 	struct vnode *(*fs_getroot)(struct fs *);
 	int           (*fs_unmount)(struct fs *);
 
+	bool fs_dcache;
 	void *fs_data;
 };
 
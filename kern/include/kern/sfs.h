@@ -59,6 +59,10 @@
 /* Size of bitmap (in blocks) */
 #define SFS_BITBLOCKS(nblocks)  (SFS_BITMAPSIZE(nblocks)/SFS_BLOCKBITS)
 
+/* Feature flags for sp_features */
+#define SFS_FEATURE_DIRHASH  0x00000001  /* hashed directories (below) */
+#define SFS_FEATURES_KNOWN   (SFS_FEATURE_DIRHASH)
+
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
@@ -71,7 +75,8 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number, should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];
+	uint32_t sp_features;			/* SFS_FEATURE_* flags */
+	uint32_t reserved[117];
 };
 
 /*
@@ -94,5 +99,40 @@ struct sfs_dir {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/* Number of directory entries in a block */
+#define SFS_DIRPERBLOCK  (SFS_BLOCKSIZE / sizeof(struct sfs_dir))
+
+/*
+ * Hashed directories.
+ *
+ * On a volume with SFS_FEATURE_DIRHASH set, every directory is
+ * hashed. An empty directory has size 0. Otherwise block 0 of the
+ * directory starts with a struct sfs_dirhdr (the rest of the block is
+ * zero) and blocks 1 through sdh_nbuckets are buckets, each an array
+ * of SFS_DIRPERBLOCK entries.
+ *
+ * An entry whose name hashes to H belongs in bucket H % sdh_nbuckets.
+ * If that bucket was full when the entry was added, it went in the
+ * first bucket after it (wrapping around) that had room, and the
+ * overflow bit was set for each full bucket passed over. So a lookup
+ * reads the home bucket and moves on to the next bucket only while
+ * the overflow bit of the one it just read is set. Overflow bits are
+ * only cleared when the directory is rehashed.
+ *
+ * The hash is 32-bit FNV-1a over the bytes of the name: start with
+ * SFS_DIRHASH_INIT and apply SFS_DIRHASH_STEP for each character.
+ */
+#define SFS_DIRHASH_MAGIC       0x64697268   /* "dirh" */
+#define SFS_DIRHASH_MAXBUCKETS  128          /* fits in the max file size */
+#define SFS_DIRHASH_INIT        2166136261U
+#define SFS_DIRHASH_STEP(h, c)  (((h) ^ (unsigned char)(c)) * 16777619U)
+
+struct sfs_dirhdr {
+	uint32_t sdh_magic;			/* SFS_DIRHASH_MAGIC */
+	uint32_t sdh_nbuckets;			/* a power of 2 */
+	uint32_t sdh_nentries;			/* entries in use */
+	uint8_t sdh_overflow[SFS_DIRHASH_MAXBUCKETS/8]; /* bit per bucket */
+};
+
 
 #endif /* _KERN_SFS_H_ */
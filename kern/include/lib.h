@@ -126,6 +126,20 @@ void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
 
+/*
+ * Object caches for frequently allocated kernel structures (see
+ * kmalloc.c). CTOR, if not NULL, is run on each object once when the
+ * cache first gets memory for it; objects come out of kmem_cache_alloc
+ * in constructed state and must be given back to kmem_cache_free in
+ * the same state. kmem_cache_alloc returns NULL if out of memory.
+ */
+struct kmem_cache;
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
 /*
  * C string functions. 
  *
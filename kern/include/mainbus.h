@@ -52,6 +52,9 @@ void mainbus_interrupt(struct trapframe *);
 /* XXX this interface is not adequately MI */
 size_t mainbus_ramsize(void);
 
+/* Start or stop the current cpu's hardclock timer. (Low-level.) */
+void mainbus_settimer(bool on);
+
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
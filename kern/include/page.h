@@ -1,10 +1,26 @@
+#ifndef _PAGE_H_
+#define _PAGE_H_
+
 #include <thread.h>
 #include <types.h>
 #include <synch.h>
-#include <addrspace.h> 
+#include <addrspace.h>
 
+/*
+ * User frames are CLEAN while the swap slot recorded in swapslot still
+ * matches their contents (they were swapped in and not written since),
+ * and DIRTY otherwise. Kernel frames are FIXED.
+ */
 enum page_state {CLEAN,DIRTY,FREE,FIXED};
 
+/*
+ * Free frames are kept in per-order free lists (buddy system). A free
+ * block of 2^order frames is represented by its first frame, which is
+ * linked into free_area[order] and carries the order; the remaining
+ * frames of the block have order -1.
+ */
+#define COREMAP_NORDERS 11	/* blocks of up to 2^10 frames (4M) */
+
 struct page
 {
 	//Address space of the process who holds the page - for kernel pages should be null
@@ -13,9 +29,20 @@ struct page
 	vaddr_t va;
 	//State of the page - would be fixed for all kernel pages
 	enum page_state cur_state;
-	//timestamp - for swapping later on - no use for kernel pages as they will never be swapped out
-	uint64_t timestamp;
+	//reference bit for the clock - set when the page is loaded into the TLB, cleared as the clock hand passes
+	bool referenced;
 	//number of contineous allocations
 	int num_pages;
+	//number of PTEs mapping this frame - more than one after a copy-on-write fork
+	int refcount;
+	//swap slot that still holds an up to date copy of the page while it is CLEAN, -1 otherwise
+	int swapslot;
+	//buddy order of the free block this page heads, -1 otherwise
+	int order;
+	//free list links - only used while the page heads a free block
+	struct page * next;
+	struct page * prev;
 
 };
+
+#endif /* _PAGE_H_ */
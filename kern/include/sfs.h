@@ -48,11 +48,46 @@
  */
 #include <kern/sfs.h>
 
+struct lock;
+struct rwlock;
+
+/*
+ * Locking. SFS does not use vfs_biglock. The locks, in the order they
+ * must be taken:
+ *
+ *   sv_lock          one per vnode; covers sv_i, sv_dirty and the
+ *                    file or directory contents. Shared for reads and
+ *                    lookups, exclusive for anything that changes
+ *                    them. When two are needed the directory's comes
+ *                    first, then that of the file named in it.
+ *   sfs_vnlock       the table of loaded vnodes and the inactive
+ *                    list (see sfs_vnode.c); also
+ *                    serializes sfs_loadvnode against sfs_reclaim.
+ *   sfs_freemaplock  the free block bitmap and the superblock.
+ *   buf_lock         the buffer cache (private to sfs_buf.c).
+ *   vn_countlock     vnode reference and open counts (a spinlock).
+ *
+ * Device I/O is done holding at most sv_locks, sfs_vnlock (reading
+ * an inode in sfs_loadvnode) and buffer pins, except that sfs_sync
+ * writes the free map and superblock under sfs_freemaplock. Buffer
+ * pins are not locks in this order; buf_lock is never held while
+ * waiting for one.
+ *
+ * None of these is held across a copy to or from user space: the copy
+ * can fault, and the fault can read the executable through SFS (see
+ * sfs_userio in sfs_vnode.c).
+ */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct rwlock *sv_lock;         /* see above */
+	struct sfs_vnode *sv_hashnext;  /* vnode table chain */
+	bool sv_inactive;               /* on the inactive list */
+	struct sfs_vnode *sv_lrunext;   /* inactive list */
+	struct sfs_vnode *sv_lruprev;
 };
 
 struct sfs_fs {
@@ -60,9 +95,17 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode **sfs_vnhash;  /* vnodes loaded into memory */
+	unsigned sfs_vnhashmask;        /* buckets in sfs_vnhash, less 1 */
+	unsigned sfs_nvnodes;           /* vnodes in sfs_vnhash */
+	struct sfs_vnode *sfs_inactivehead; /* unreferenced vnodes, LRU */
+	struct sfs_vnode *sfs_inactivetail;
+	unsigned sfs_ninactive;         /* vnodes on the inactive list */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	unsigned sfs_ndirtybufs;        /* dirty cache buffers (buf_lock) */
+	struct lock *sfs_vnlock;        /* protects the vnode table */
+	struct lock *sfs_freemaplock;   /* protects freemap and superblock */
 };
 
 /*
@@ -84,8 +127,30 @@ int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+/* Buffer cache (sfs_buf.c); all block I/O on a mounted volume goes here */
+struct sfs_buf;
+int sfs_buf_bootstrap(void);
+int sfs_buf_read(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+int sfs_buf_get(struct sfs_fs *sfs, uint32_t block, struct sfs_buf **ret);
+void *sfs_buf_data(struct sfs_buf *buf);
+bool sfs_buf_valid(struct sfs_buf *buf);
+void sfs_buf_markdirty(struct sfs_buf *buf);
+void sfs_buf_release(struct sfs_buf *buf);
+void sfs_buf_drop(struct sfs_fs *sfs, uint32_t block);
+int sfs_buf_flush(struct sfs_fs *sfs);
+void sfs_buf_purge(struct sfs_fs *sfs);
+void sfs_buf_printstats(void);
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Table of loaded vnodes */
+int sfs_vntable_init(struct sfs_fs *sfs);
+void sfs_vntable_cleanup(struct sfs_fs *sfs);
+int sfs_vntable_drain(struct sfs_fs *sfs);
+
+/* Copy the inodes of all loaded vnodes into the buffer cache */
+int sfs_sync_vnodes(struct sfs_fs *sfs);
+
 
 #endif /* _SFS_H_ */
@@ -74,13 +74,16 @@ void V(struct semaphore *);
  */
 struct lock {
         char *lk_name;
-        // add what you need here
-       // added by Aditya Singla: 02/15/14
+        // added by Aditya Singla: 02/15/14
         struct thread *lk_thread; //name of current thread holding the lock. For locks only the thread that obtained it can release the lock
         struct wchan *lk_wchan; // wait channel for lock
-	    struct spinlock lk_lock;
-        //volatile int lk_count; // will only have value 0 and 1 as a lock can only be provided once
-        // (don't forget to mark things volatile as needed)
+        volatile spinlock_data_t lk_busy;	/* set while held */
+        volatile unsigned lk_waiters;	/* threads asleep or about to sleep */
+
+        /* Contention statistics, updated by the holder. */
+        unsigned lk_acquires;		/* total acquisitions */
+        unsigned lk_spun;		/* contended, got it by spinning */
+        unsigned lk_slept;		/* contended, had to sleep */
 };
 
 struct lock *lock_create(const char *name);
@@ -94,12 +97,17 @@ void lock_acquire(struct lock *);
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock; 
  *                   false otherwise.
+ *    lock_printstats - Print the lock's contention statistics.
  *
- * These operations must be atomic. You get to write them.
+ * Locks are adaptive: a thread that finds the lock held spins while
+ * the holder is running on another cpu, on the theory that it will
+ * let go soon, and only sleeps if the holder is itself asleep or
+ * waiting for a cpu.
  */
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
+void lock_printstats(struct lock *);
 
 
 /*
@@ -131,6 +139,9 @@ void cv_destroy(struct cv *);
  * Operations:
  *    cv_wait      - Release the supplied lock, go to sleep, and, after
  *                   waking up again, re-acquire the lock.
+ *    cv_timedwait - Like cv_wait, but wake up anyway after TICKS
+ *                   hardclock ticks. Returns ETIMEDOUT if that happened,
+ *                   0 if signalled.
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
  *
@@ -141,17 +152,38 @@ void cv_destroy(struct cv *);
  * These operations must be atomic. You get to write them.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
+int cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks);
 void cv_signal(struct cv *cv, struct lock *lock);
  void cv_broadcast(struct cv *cv, struct lock *lock);
 
 /*
  * 13 Feb 2012 : GWA : Reader-writer locks.
+ *
+ * Any number of readers, or one writer. Everything is protected by
+ * rw_lock, so an uncontended acquire or release is one spinlock
+ * round trip. Readers and writers wait on separate channels.
+ *
+ * Fairness: writers are preferred over newly arriving readers (a
+ * reader that finds a writer waiting waits too), so a stream of
+ * readers can't starve writers. When a writer releases, the readers
+ * that were waiting are let in as a batch ahead of the next writer
+ * (rw_readpass counts the admissions owed to them), so a stream of
+ * writers can't starve readers either. The last reader out wakes a
+ * writer.
+ *
+ * Locks are not recursive, and a reader can't upgrade to writing.
  */
 
 struct rwlock {
         char *rwlock_name;
-	struct lock *lk;
-	struct semaphore *sem;
+        struct spinlock rw_lock;
+        struct wchan *rw_rwchan;	/* readers wait here */
+        struct wchan *rw_wwchan;	/* writers wait here */
+        unsigned rw_readers;		/* readers holding the lock */
+        struct thread *rw_writer;	/* writer holding the lock */
+        unsigned rw_rwaiting;		/* readers waiting */
+        unsigned rw_wwaiting;		/* writers waiting */
+        unsigned rw_readpass;		/* readers to admit past waiting writers */
 };
 
 struct rwlock * rwlock_create(const char *);
@@ -161,5 +193,12 @@ void rwlock_acquire_read(struct rwlock *);
 void rwlock_release_read(struct rwlock *);
 void rwlock_acquire_write(struct rwlock *);
 void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+/*
+ * Set up the object caches locks and CVs are allocated from. Called
+ * once during boot, before anything creates a lock or CV.
+ */
+void synch_bootstrap(void);
 
 #endif /* _SYNCH_H_ */
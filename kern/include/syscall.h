@@ -32,6 +32,7 @@
 
 
 struct trapframe; /* from <machine/trapframe.h> */
+struct iovec; /* from <kern/iovec.h> */
 
 /*
  * The system call dispatcher.
@@ -56,6 +57,7 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,vaddr_t entryp
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(userptr_t user_req, userptr_t user_rem);
 
 int sys__open(char * ,int , mode_t , int* );
 
@@ -65,6 +67,14 @@ int sys__write(int,void *,size_t , int *);
 
 int sys__read(int,void *,size_t, int *);
 
+int sys__pwrite(int,void *,size_t, off_t, int *);
+
+int sys__pread(int,void *,size_t, off_t, int *);
+
+int sys__writev(int,const struct iovec *,int, int *);
+
+int sys__readv(int,const struct iovec *,int, int *);
+
 off_t sys__lseek(int, off_t , int, off_t *);
 
 int sys__chdir(char *, int *);
@@ -88,6 +88,7 @@ int threadtest2(int, char **);
 int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
+int lockconttest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
 int rwtest(int, char **);
@@ -103,6 +104,7 @@ int printfile(int, char **);
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int frametest(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
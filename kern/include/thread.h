@@ -75,9 +75,10 @@ struct thread {
 	 */
 	char *t_name;			/* Name of this thread */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
+	struct wchan *t_wchan;		/* Wait channel, if sleeping on one */
 	threadstate_t t_state;		/* State this thread is in */
-	//File Table Added Aditya Singla
-	struct fdesc * t_filetable[128];
+	//File Table Added Aditya Singla - NULL for kernel-only threads
+	struct filetable *t_filetable;
 	//Process Id Field Added Aditya Singla
 	pid_t processId;
 	/*
@@ -88,6 +89,9 @@ struct thread {
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
+	struct cpu *t_prevcpu;		/* CPU before that, affinity hint */
+	unsigned t_priority;		/* Run queue level, 0 highest */
+	unsigned t_ticks;		/* Hardclocks used at that level */
 
 	/*
 	 * Interrupt state fields.
@@ -167,9 +171,9 @@ void thread_yield(void);
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Account a clock tick to the current thread and preempt it if the
+ * scheduler says so. Called from the timer interrupt on every tick.
  */
-void thread_consider_migration(void);
+void thread_tick(void);
 
 #endif /* _THREAD_H_ */
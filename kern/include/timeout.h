@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _TIMEOUT_H_
+#define _TIMEOUT_H_
+
+/*
+ * Timeouts: call a function some number of hardclock ticks from now.
+ *
+ * Armed timeouts sit in a hierarchical timer wheel indexed by expiry
+ * tick, which is advanced from hardclock() on whatever cpus are
+ * ticking; a cpu does not stop its clock while any timeout is armed.
+ * The callback runs in interrupt context, so it must not sleep, and is
+ * called with no locks held. It may rearm its timeout but not free it.
+ *
+ * Time is measured in ticks of 1/HZ second since boot, taken from
+ * the real-time clock so that it keeps going while cpus are tickless.
+ *
+ * Functions:
+ *     timeout_init    - set up TO to call FUNC(DATA) when it fires.
+ *     timeout_add     - arm TO to fire TICKS ticks from now. TO must
+ *                       not already be armed. It fires no sooner than
+ *                       TICKS full ticks later, and within one more.
+ *     timeout_del     - disarm TO. Returns true if it was still armed,
+ *                       false if it has already fired. If it is firing
+ *                       on another cpu, waits for the callback to
+ *                       return, so afterwards TO is not in use and may
+ *                       be freed. Don't call it holding anything the
+ *                       callback needs.
+ *     timeout_pending - true if any timeout is armed. Unlocked; a hint.
+ *     timeout_now     - the current time in ticks.
+ *     timeout_run     - fire whatever has expired. Called by hardclock.
+ */
+
+struct timeout {
+	struct timeout *to_next;	/* wheel bucket links */
+	struct timeout **to_prevp;
+	struct timeout *to_firenext;	/* list of expired ones being run */
+	uint32_t to_expire;		/* tick to fire at */
+	bool to_armed;
+	volatile bool to_firing;	/* callback is running */
+	void (*to_func)(void *);
+	void *to_data;
+};
+
+void timeout_init(struct timeout *to, void (*func)(void *), void *data);
+void timeout_add(struct timeout *to, unsigned ticks);
+bool timeout_del(struct timeout *to);
+bool timeout_pending(void);
+uint32_t timeout_now(void);
+void timeout_run(void);
+
+#endif /* _TIMEOUT_H_ */
@@ -174,6 +174,31 @@ int vfs_mount(const char *devname, void *data,
 int vfs_unmount(const char *devname);
 int vfs_unmountall(void);
 
+/*
+ * Directory name lookup cache (vfsdcache.c), used by vfs_lookup and
+ * vfs_lookparent.
+ *
+ *    vfs_dcache_bootstrap  - Set up the cache; called by vfs_bootstrap.
+ *    vfs_dcache_lookup     - Look up one name in a directory. On a hit,
+ *                            returns true and the vnode (referenced),
+ *                            or NULL if the name is known not to exist.
+ *    vfs_dcache_enter      - Record what the filesystem's lookup found
+ *                            (NULL for ENOENT) after a miss.
+ *    vfs_dcache_invalidate - Forget a name; call after any operation
+ *                            that creates or removes it.
+ *    vfs_dcache_purgefs    - Forget everything about a filesystem, so
+ *                            it can be unmounted.
+ */
+
+void vfs_dcache_bootstrap(void);
+bool vfs_dcache_lookup(struct vnode *dir, const char *name,
+		       struct vnode **ret, unsigned *gen);
+void vfs_dcache_enter(struct vnode *dir, const char *name,
+		      struct vnode *vn, unsigned gen);
+void vfs_dcache_invalidate(struct vnode *dir, const char *name);
+void vfs_dcache_purgefs(struct fs *fs);
+void vfs_dcache_printstats(void);
+
 /*
  * Array of vnodes.
  */
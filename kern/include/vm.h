@@ -39,6 +39,8 @@
 
 #include <machine/vm.h>
 
+struct addrspace;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -55,20 +57,26 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
-paddr_t alloc_upages(int npages);
-void free_upages(paddr_t addr);
+/* Allocate/free one user page frame mapped at VA in address space AS; 0 if out of memory and swap */
+paddr_t alloc_upage(struct addrspace *as, vaddr_t va);
+void free_upage(paddr_t addr);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Number of physical page frames, for sizing caches */
+unsigned long vm_npages(void);
+
+/* Print fault/swap counters and free memory (the "vm" menu command) */
+void vm_printstats(void);
+
 void pageswap(void);
 
 paddr_t seek_victim(int);
-void write_page(unsigned int,paddr_t);
+void write_pages(unsigned int, paddr_t *, unsigned);
 void tlb_invalidate(paddr_t);
-void handle_pagefault(vaddr_t, struct addrspace *);
-void read_page(unsigned int, paddr_t);
+void read_pages(unsigned int, paddr_t *, unsigned);
 void tlb_invalidate_all(void);
 
 
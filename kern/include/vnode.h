@@ -30,6 +30,7 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
 
 struct uio;
 struct stat;
@@ -50,8 +51,15 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * Both counts are protected by vn_countlock. When the refcount is 1
+ * VOP_DECREF calls VOP_RECLAIM without decrementing it; the filesystem
+ * must recheck the count under vn_countlock, holding whatever lock
+ * guards its table of loaded vnodes, and if someone has picked the
+ * vnode up in the meantime drop the reference itself and return EBUSY.
  */
 struct vnode {
+	struct spinlock vn_countlock;   /* Protects the counts */
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
 
@@ -109,6 +109,7 @@ boot(void)
 	ram_bootstrap();
 
 	thread_bootstrap();
+	synch_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
 
@@ -36,6 +36,7 @@
 #include <uio.h>
 #include <clock.h>
 #include <thread.h>
+#include <vm.h>
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
@@ -397,6 +398,44 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_dcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_dcache_printstats();
+
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_buf_printstats();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -457,6 +496,7 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[fm1] Frame allocator scaling       ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -467,6 +507,7 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy5] CV test 2             (1)     ",
+	"[sy6] Lock contention test          ",
 	"[rwtest] RWTest             (1)     ",
 	"[sp1] Whalematching Driver  (1)     ",
 	"[sp2] Stoplight Driver      (1)     ",
@@ -499,6 +540,11 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+	"[vm] VM fault/swap stats            ",
+	"[dc] VFS name cache stats           ",
+#if OPT_SFS
+	"[bc] SFS buffer cache stats         ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -547,12 +593,18 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "vm",         cmd_vmstats },
+	{ "dc",         cmd_dcachestats },
+#if OPT_SFS
+	{ "bc",         cmd_bufstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "fm1",	frametest },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -565,6 +617,7 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy5",	cvtest2 },
+	{ "sy6",	lockconttest },
 	{"rwtest",rwtest},
 	
 #if OPT_SYNCHPROBS
@@ -16,6 +16,7 @@
 #include <synch.h>
 #include <kern/seek.h>
 #include <stat.h> 
+#include <limits.h>
 
 #define MAX_FILENAME_SIZE 32
 
@@ -24,7 +25,6 @@
 
 int sys__open(char * filename,int flags, mode_t mode, int* ret)
 {
-	int i;
 	char kfilename[MAX_FILENAME_SIZE];
 	size_t len;
 	int result;
@@ -51,187 +51,236 @@ int sys__open(char * filename,int flags, mode_t mode, int* ret)
 	}
 	
 	
-	//create fdesc structure
+	//open the vnode and wrap it in a new open file
 	struct fdesc * file;
-	//allocate memory - should be free if and error occurs
-	file = (struct fdesc *)kmalloc(sizeof(struct fdesc));
-	//call vfs_open to open a vnode
-	result = vfs_open(kfilename,flags,mode,&file->vn);
-	if(*ret != 0){ 
-
+	struct vnode * vn;
+	result = vfs_open(kfilename,flags,mode,&vn);
+	if(result != 0)
+	{
 		return result;
 	}
-	file->offset = 0;
-	file->ref_count++;
-	strcpy(file->name,kfilename);
-	file->lk = lock_create(kfilename);
-	//assign a file descriptor to the file - structure declared within the thread
-	for(i=3;i<128;i++)
+	file = fdesc_create(kfilename, vn, flags);
+	if(file == NULL)
 	{
-		if(curthread->t_filetable[i] == NULL)
-		{
-			curthread->t_filetable[i] = file;
-			*ret = i;
-			return 0;
-		}
+		vfs_close(vn);
+		return ENOMEM;
 	}
-	//means that place in the filetable - too many open files
-
-	return EMFILE;
-	
+	//lowest free descriptor; the table grows if it has to
+	result = filetable_add(curthread->t_filetable, file, ret);
+	if(result != 0)
+	{
+		fdesc_decref(file);
+		return result;
+	}
+	return 0;
 }
 
 int sys__close(int fd, int *ret)
 {
-	
-	if(fd>=127 || fd <0)
-	{
-
-		return EBADF;
-	}
+	struct fdesc * file;
 
-	if(curthread->t_filetable[fd] != NULL)
+	file = filetable_remove(curthread->t_filetable, fd);
+	if(file == NULL)
 	{
-		curthread->t_filetable[fd]->ref_count--;
-		if(curthread->t_filetable[fd]->ref_count == 0)
-		{
-			vfs_close(curthread->t_filetable[fd]->vn);
-			//lock_destroy(curthread->t_filetable[fd]->lk);
-			kfree(curthread->t_filetable[fd]);
-			
-		}
-		curthread->t_filetable[fd] = NULL;	
-		return 0;
-		
+		return EBADF;
 	}
+	fdesc_decref(file);
 	*ret = 0;
-	return EBADF;
-	
+	return 0;
 }
 
-int sys__write(int fd,void * buff,size_t nbytes, int *ret)
+/*
+ * All the read and write calls move the data straight between the
+ * caller's buffers and the vnode: the uio points at user memory
+ * (UIO_USERSPACE), so uiomove copies in or out of the process address
+ * space as the file system or device goes, and faults on a bad buffer
+ * come back as EFAULT. No kernel bounce buffer is needed, whatever
+ * the size.
+ *
+ * read/write/readv/writev use and advance the descriptor's offset and
+ * hold its lock for the duration. pread/pwrite take an explicit offset,
+ * leave fdesc->offset alone and so don't need the lock at all.
+ */
+
+/* largest total transfer; the byte count is returned in an int */
+#define FILE_IO_MAX	((size_t)0x7fffffff)
+
+static
+int
+file_get(int fd, struct fdesc **ret)
 {
-	
-	void *kbuff;
-	kbuff = kmalloc(nbytes);
-	int result;	
-	result = copyin((const_userptr_t)buff, kbuff, nbytes);
-	if(result !=0)
-	{
-		kfree(kbuff);
-
-		return EFAULT;
-	}
-	if(kbuff == NULL)
-	{
-		kfree(kbuff);
-
-		return EFAULT;
-	}
-	struct fdesc * file;
-	int err;
-	if(fd > 128 || fd < 0)
+	*ret = filetable_get(curthread->t_filetable, fd);
+	if(*ret == NULL)
 	{
-		kfree(kbuff);
-
 		return EBADF;
 	}
-	if(curthread->t_filetable[fd] == NULL)
-	{
-		kfree(kbuff);
+	return 0;
+}
 
-		return EBADF;
-	}
-	file = curthread->t_filetable[fd];
-	struct iovec iov;
+/*
+ * Do one VOP_READ or VOP_WRITE over IOVCNT user buffers totalling
+ * NBYTES. If OFFSET is NULL the descriptor's offset is used and
+ * updated; otherwise *OFFSET is used and nothing is updated.
+ */
+static
+int
+file_io(struct fdesc *file, struct iovec *iov, int iovcnt, size_t nbytes,
+	const off_t *offset, enum uio_rw rw, int *ret)
+{
 	struct uio u;
+	int err;
 
-	iov.iov_ubase = kbuff;
-	iov.iov_len = nbytes;
-	u.uio_iov =  &iov;
-	u.uio_iovcnt = 1;
-	u.uio_offset = file->offset;
+	u.uio_iov = iov;
+	u.uio_iovcnt = iovcnt;
 	u.uio_resid = nbytes;
-	u.uio_segflg = UIO_SYSSPACE;
-	u.uio_rw = UIO_WRITE;
-	u.uio_space = NULL;
-	lock_acquire(file->lk);
-	if((err = VOP_WRITE(file->vn,&u)) != 0)
+	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = rw;
+	u.uio_space = curthread->t_addrspace;
+
+	if(offset != NULL)
 	{
-		kfree(kbuff);
+		u.uio_offset = *offset;
+		err = (rw == UIO_READ) ? VOP_READ(file->vn,&u) : VOP_WRITE(file->vn,&u);
+		if(err != 0)
+		{
+			return err;
+		}
+	}
+	else
+	{
+		lock_acquire(file->lk);
+		u.uio_offset = file->offset;
+		err = (rw == UIO_READ) ? VOP_READ(file->vn,&u) : VOP_WRITE(file->vn,&u);
+		if(err != 0)
+		{
+			lock_release(file->lk);
+			return err;
+		}
+		file->offset = u.uio_offset;
 		lock_release(file->lk);
-		return EBADF;
 	}
-	kfree(kbuff);
-	file->offset = u.uio_offset;
 	*ret = nbytes - u.uio_resid;
-	lock_release(file->lk);
 	return 0;
 }
 
-int sys__read(int fd,void * buff,size_t nbytes, int *ret)
+static
+int
+file_rw(int fd, void *buff, size_t nbytes, const off_t *offset,
+	enum uio_rw rw, int *ret)
 {
-	
-	void * kbuff;
-	int result;
-	kbuff = kmalloc(nbytes);
-	int err;	
-
 	struct fdesc * file;
+	struct iovec iov;
+	int err;
+
+	err = file_get(fd, &file);
+	if(err != 0)
+	{
+		return err;
+	}
 	if(buff == NULL)
 	{
-		kfree(buff);
-
 		return EFAULT;
 	}
-	if(fd > 128 || fd < 0)
+	if(nbytes > FILE_IO_MAX)
 	{
-		kfree(kbuff);
-
-		return EBADF;
+		return EINVAL;
 	}
-	if(curthread->t_filetable[fd] == NULL)
+	if(offset != NULL)
 	{
-		kfree(kbuff);
-
-		return EBADF;
+		if(*offset < 0)
+		{
+			return EINVAL;
+		}
+		err = VOP_TRYSEEK(file->vn, *offset);
+		if(err != 0)
+		{
+			return err;
+		}
 	}
-	
-	file = curthread->t_filetable[fd];
-	struct iovec iov;
-	struct uio u;
 
-	iov.iov_ubase = kbuff;
+	iov.iov_ubase = (userptr_t)buff;
 	iov.iov_len = nbytes;
-	u.uio_iov =  &iov;
-	u.uio_iovcnt = 1;
-	u.uio_offset = file->offset;
-	u.uio_resid = nbytes;
-	u.uio_segflg = UIO_SYSSPACE;
-	u.uio_rw = UIO_READ;
-	u.uio_space = NULL;
-	
-	lock_acquire(file->lk);
+	return file_io(file, &iov, 1, nbytes, offset, rw, ret);
+}
 
-	if((err = VOP_READ(file->vn,&u)) != 0)
-	{
-		
-		kfree(kbuff);
+/*
+ * readv/writev: copy in the iovec array and hand the whole thing to
+ * the file system as one multi-segment uio.
+ */
+static
+int
+file_rwv(int fd, const struct iovec *uiov, int iovcnt, enum uio_rw rw,
+	 int *ret)
+{
+	struct fdesc * file;
+	struct iovec *iov;
+	size_t total = 0;
+	int i, err;
 
+	err = file_get(fd, &file);
+	if(err != 0)
+	{
 		return err;
 	}
-	result = copyout(kbuff,(userptr_t)buff,nbytes);
-	if(result != 0)
+	if(iovcnt <= 0 || iovcnt > IOV_MAX)
 	{
-		kfree(kbuff);
+		return EINVAL;
+	}
 
-		return result;
+	iov = kmalloc(iovcnt * sizeof(struct iovec));
+	if(iov == NULL)
+	{
+		return ENOMEM;
 	}
-	kfree(kbuff);
-	file->offset = u.uio_offset;
-	*ret = nbytes - u.uio_resid;
-	lock_release(file->lk);
-	return 0;
+	err = copyin((const_userptr_t)uiov, iov, iovcnt * sizeof(struct iovec));
+	if(err != 0)
+	{
+		kfree(iov);
+		return err;
+	}
+	for(i=0; i<iovcnt; i++)
+	{
+		if(iov[i].iov_len > FILE_IO_MAX - total)
+		{
+			kfree(iov);
+			return EINVAL;
+		}
+		total += iov[i].iov_len;
+	}
+
+	err = file_io(file, iov, iovcnt, total, NULL, rw, ret);
+	kfree(iov);
+	return err;
+}
+
+int sys__write(int fd,void * buff,size_t nbytes, int *ret)
+{
+	return file_rw(fd, buff, nbytes, NULL, UIO_WRITE, ret);
+}
+
+int sys__read(int fd,void * buff,size_t nbytes, int *ret)
+{
+	return file_rw(fd, buff, nbytes, NULL, UIO_READ, ret);
+}
+
+int sys__pwrite(int fd,void * buff,size_t nbytes, off_t offset, int *ret)
+{
+	return file_rw(fd, buff, nbytes, &offset, UIO_WRITE, ret);
+}
+
+int sys__pread(int fd,void * buff,size_t nbytes, off_t offset, int *ret)
+{
+	return file_rw(fd, buff, nbytes, &offset, UIO_READ, ret);
+}
+
+int sys__writev(int fd,const struct iovec *iov,int iovcnt, int *ret)
+{
+	return file_rwv(fd, iov, iovcnt, UIO_WRITE, ret);
+}
+
+int sys__readv(int fd,const struct iovec *iov,int iovcnt, int *ret)
+{
+	return file_rwv(fd, iov, iovcnt, UIO_READ, ret);
 }
 
 
@@ -240,39 +289,27 @@ off_t sys__lseek(int currfiledesc, off_t offsetPos, int whence, off_t *returnval
  
     off_t retoffset;
     int errcode;
- 
-    if(currfiledesc < 3 || currfiledesc > 128 || &currfiledesc == NULL){
-        
-        return EBADF;
+    struct fdesc* curFile;
+    struct stat chkfilend;
+
+    // the table knows its own size; anything outside it or not open is EBADF
+    errcode = file_get(currfiledesc, &curFile);
+    if(errcode){
+        return errcode;
     }
 
-    
     if(offsetPos < 0)
     {
 	return EINVAL;
     }
 
-    // current file desc for the current thread shouldnt be null
-    if( curthread->t_filetable[currfiledesc] == NULL){
-        
-        return EBADF;
-    }
- 
     if((whence  >> 2) != 0)
     {
 	return EINVAL;
     }
-    //check for illegal positions of the filehandle not be zero
-    // such a file cant exist..coz our FT has max 256;
     
  
- 
-    struct fdesc* curFile = curthread->t_filetable[currfiledesc];
- 
-    struct stat chkfilend;
-    
- 
-    lock_acquire(curthread->t_filetable[currfiledesc]->lk);
+    lock_acquire(curFile->lk);
  	
     switch(whence)  {
  
@@ -291,6 +328,7 @@ off_t sys__lseek(int currfiledesc, off_t offsetPos, int whence, off_t *returnval
             //call to VOP_STAT gives the status which is a structure having file info
             // check if info is not available then throw error
             if((errcode = VOP_STAT(curFile->vn,&chkfilend))){
+                lock_release(curFile->lk);
                 return errcode;
             }
             //accessing the file size in bytes and adding new pos to it
@@ -300,7 +338,7 @@ off_t sys__lseek(int currfiledesc, off_t offsetPos, int whence, off_t *returnval
         default:
             //invalid whence
             //took me 3 cups of coffee to figure this out!! release lock here.. stupid!
-            lock_release(curthread->t_filetable[currfiledesc]->lk);
+            lock_release(curFile->lk);
             *returnval = -1;
             return EINVAL;
             break;
@@ -308,7 +346,7 @@ off_t sys__lseek(int currfiledesc, off_t offsetPos, int whence, off_t *returnval
     }
 //now we have the final offset to be returned
     if(retoffset < 0){
-        lock_release(curthread->t_filetable[currfiledesc]->lk);
+        lock_release(curFile->lk);
         *returnval = -1;
         return EINVAL;
     }
@@ -316,15 +354,16 @@ off_t sys__lseek(int currfiledesc, off_t offsetPos, int whence, off_t *returnval
 // now checking for the offset obtained for returning...
     errcode = VOP_TRYSEEK(curFile->vn,retoffset);
  
-    //avoiding access to console like objects
-        if(errcode == ESPIPE){
+    //avoiding access to console like objects (ESPIPE), or anything else the vnode refuses
+        if(errcode){
+            lock_release(curFile->lk);
             *returnval = -1;
-            return ESPIPE;
+            return errcode;
         }
  
         curFile->offset = retoffset;
         *returnval =  curFile->offset;
-        lock_release(curthread->t_filetable[currfiledesc]->lk);
+        lock_release(curFile->lk);
  
     return 0;
 }
@@ -376,18 +415,14 @@ int sys___getcwd(char *buf, size_t buflen, int *returnval){
     return 0;
 } 
  
-//dup2
+//dup2 - both descriptors end up sharing one open file (and offset)
 int sys__dup2(int currfd, int dupfd, int* returnval){
+	struct fdesc * curFile;
+	struct fdesc * oldFile;
+	int result;
 
-
-
-    	if(currfd < 0 || dupfd < 0 || currfd >= 127 || dupfd >= 127){
-
-        	return EBADF;
-    	}
-
-	
-	if(curthread->t_filetable[currfd] == NULL)
+	curFile = filetable_get(curthread->t_filetable, currfd);
+	if(curFile == NULL || dupfd < 0 || dupfd >= OPEN_MAX)
 	{
 		return EBADF;
 	}
@@ -397,23 +432,19 @@ int sys__dup2(int currfd, int dupfd, int* returnval){
 		return 0;
 	}
 
-	struct fdesc * newDesc;
-    	lock_acquire(curthread->t_filetable[currfd]->lk);
-    	struct fdesc * curFile = curthread->t_filetable[currfd];
-   	struct fdesc * dupFile = curthread->t_filetable[dupfd];
-        if(dupFile != NULL){
-	     if(sys__close(dupfd,returnval))
-	     return EBADF;
+	fdesc_incref(curFile);
+	result = filetable_place(curthread->t_filetable, dupfd, curFile, &oldFile);
+	if(result != 0)
+	{
+		fdesc_decref(curFile);
+		return result;
+	}
+	if(oldFile != NULL)
+	{
+		fdesc_decref(oldFile);
 	}
-	newDesc = (struct fdesc *)kmalloc(sizeof(struct fdesc));
- 	newDesc->lk = lock_create("dupfile");
-        newDesc->flag = curFile->flag;
-        newDesc->offset = curFile->offset;
-        newDesc->vn = curFile->vn;
-	curthread->t_filetable[dupfd] = newDesc;
-        *returnval = dupfd;
-    	lock_release(curthread->t_filetable[currfd]->lk);
-    	return 0;
+	*returnval = dupfd;
+	return 0;
 }
  
 //chdir
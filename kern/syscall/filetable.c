@@ -0,0 +1,309 @@
+/*
+ * Open files and per-process descriptor tables.
+ *
+ * A descriptor is an index into the owning thread's filetable; the
+ * table entry points at a shared, refcounted struct fdesc. open makes
+ * a new fdesc; fork and dup2 only add references to existing ones, so
+ * parent and child (or both descriptors) share the offset as POSIX
+ * requires.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <limits.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <fdesc.h>
+
+/* descriptors in a new table; it doubles from here up to OPEN_MAX */
+#define FILETABLE_INITSIZE	16
+
+struct kmem_cache *fdesc_cache;
+
+struct fdesc *
+fdesc_create(const char *name, struct vnode *vn, int flag)
+{
+	struct fdesc *file;
+	size_t len;
+
+	file = kmem_cache_alloc(fdesc_cache);
+	if(file == NULL)
+	{
+		return NULL;
+	}
+	file->lk = lock_create(name);
+	if(file->lk == NULL)
+	{
+		kmem_cache_free(fdesc_cache, file);
+		return NULL;
+	}
+	len = strlen(name);
+	if(len >= MAX_LENGTH)
+	{
+		len = MAX_LENGTH - 1;
+	}
+	memcpy(file->name, name, len);
+	file->name[len] = 0;
+	file->offset = 0;
+	file->flag = flag;
+	file->ref_count = 1;
+	spinlock_init(&file->ref_lock);
+	file->vn = vn;
+	return file;
+}
+
+void
+fdesc_incref(struct fdesc *file)
+{
+	spinlock_acquire(&file->ref_lock);
+	KASSERT(file->ref_count > 0);
+	file->ref_count++;
+	spinlock_release(&file->ref_lock);
+}
+
+void
+fdesc_decref(struct fdesc *file)
+{
+	int refs;
+
+	spinlock_acquire(&file->ref_lock);
+	KASSERT(file->ref_count > 0);
+	refs = --file->ref_count;
+	spinlock_release(&file->ref_lock);
+
+	if(refs == 0)
+	{
+		vfs_close(file->vn);
+		lock_destroy(file->lk);
+		spinlock_cleanup(&file->ref_lock);
+		kmem_cache_free(fdesc_cache, file);
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+static
+struct filetable *
+filetable_alloc(unsigned size)
+{
+	struct filetable *ft;
+	unsigned i;
+
+	ft = kmalloc(sizeof(struct filetable));
+	if(ft == NULL)
+	{
+		return NULL;
+	}
+	ft->ft_files = kmalloc(size * sizeof(struct fdesc *));
+	if(ft->ft_files == NULL)
+	{
+		kfree(ft);
+		return NULL;
+	}
+	ft->ft_used = bitmap_create(size);
+	if(ft->ft_used == NULL)
+	{
+		kfree(ft->ft_files);
+		kfree(ft);
+		return NULL;
+	}
+	for(i=0; i<size; i++)
+	{
+		ft->ft_files[i] = NULL;
+	}
+	ft->ft_size = size;
+	ft->ft_nopen = 0;
+	return ft;
+}
+
+struct filetable *
+filetable_create(void)
+{
+	return filetable_alloc(FILETABLE_INITSIZE);
+}
+
+void
+filetable_destroy(struct filetable *ft)
+{
+	unsigned i;
+
+	/* stop once every open descriptor has been seen */
+	for(i=0; ft->ft_nopen > 0; i++)
+	{
+		KASSERT(i < ft->ft_size);
+		if(ft->ft_files[i] != NULL)
+		{
+			fdesc_decref(ft->ft_files[i]);
+			ft->ft_files[i] = NULL;
+			ft->ft_nopen--;
+		}
+	}
+	bitmap_destroy(ft->ft_used);
+	kfree(ft->ft_files);
+	kfree(ft);
+}
+
+int
+filetable_copy(struct filetable *src, struct filetable **ret)
+{
+	struct filetable *ft;
+	unsigned i, seen;
+
+	ft = filetable_alloc(src->ft_size);
+	if(ft == NULL)
+	{
+		return ENOMEM;
+	}
+	for(i=0, seen=0; seen < src->ft_nopen; i++)
+	{
+		KASSERT(i < src->ft_size);
+		if(src->ft_files[i] != NULL)
+		{
+			fdesc_incref(src->ft_files[i]);
+			ft->ft_files[i] = src->ft_files[i];
+			bitmap_mark(ft->ft_used, i);
+			seen++;
+		}
+	}
+	ft->ft_nopen = src->ft_nopen;
+	*ret = ft;
+	return 0;
+}
+
+/*
+ * Make the table big enough to hold descriptor FD.
+ */
+static
+int
+filetable_grow(struct filetable *ft, unsigned fd)
+{
+	struct fdesc **files;
+	struct bitmap *used;
+	unsigned size, i;
+
+	if(fd < ft->ft_size)
+	{
+		return 0;
+	}
+	if(fd >= OPEN_MAX)
+	{
+		return EMFILE;
+	}
+
+	size = ft->ft_size;
+	while(size <= fd)
+	{
+		size *= 2;
+	}
+	if(size > OPEN_MAX)
+	{
+		size = OPEN_MAX;
+	}
+
+	files = kmalloc(size * sizeof(struct fdesc *));
+	if(files == NULL)
+	{
+		return ENOMEM;
+	}
+	used = bitmap_create(size);
+	if(used == NULL)
+	{
+		kfree(files);
+		return ENOMEM;
+	}
+	for(i=0; i<size; i++)
+	{
+		files[i] = i < ft->ft_size ? ft->ft_files[i] : NULL;
+		if(files[i] != NULL)
+		{
+			bitmap_mark(used, i);
+		}
+	}
+
+	kfree(ft->ft_files);
+	bitmap_destroy(ft->ft_used);
+	ft->ft_files = files;
+	ft->ft_used = used;
+	ft->ft_size = size;
+	return 0;
+}
+
+struct fdesc *
+filetable_get(struct filetable *ft, int fd)
+{
+	if(ft == NULL || fd < 0 || (unsigned)fd >= ft->ft_size)
+	{
+		return NULL;
+	}
+	return ft->ft_files[fd];
+}
+
+int
+filetable_add(struct filetable *ft, struct fdesc *file, int *fd)
+{
+	unsigned index;
+	int result;
+
+	if(bitmap_alloc(ft->ft_used, &index) != 0)
+	{
+		/* full; the next free slot is the first one past the end */
+		index = ft->ft_size;
+		result = filetable_grow(ft, index);
+		if(result)
+		{
+			return result;
+		}
+		bitmap_mark(ft->ft_used, index);
+	}
+	KASSERT(ft->ft_files[index] == NULL);
+	ft->ft_files[index] = file;
+	ft->ft_nopen++;
+	*fd = index;
+	return 0;
+}
+
+int
+filetable_place(struct filetable *ft, int fd, struct fdesc *file,
+		struct fdesc **old)
+{
+	int result;
+
+	if(fd < 0 || fd >= OPEN_MAX)
+	{
+		return EBADF;
+	}
+	result = filetable_grow(ft, fd);
+	if(result)
+	{
+		return result;
+	}
+
+	*old = ft->ft_files[fd];
+	if(*old == NULL)
+	{
+		bitmap_mark(ft->ft_used, fd);
+		ft->ft_nopen++;
+	}
+	ft->ft_files[fd] = file;
+	return 0;
+}
+
+struct fdesc *
+filetable_remove(struct filetable *ft, int fd)
+{
+	struct fdesc *file;
+
+	file = filetable_get(ft, fd);
+	if(file == NULL)
+	{
+		return NULL;
+	}
+	ft->ft_files[fd] = NULL;
+	bitmap_unmark(ft->ft_used, fd);
+	ft->ft_nopen--;
+	return file;
+}
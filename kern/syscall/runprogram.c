@@ -194,74 +194,54 @@ runprogram(char *progname, char **args,long nargs)
 	
 }
 
+/*
+ * Give a thread started from the menu a descriptor table with the
+ * console on 0, 1 and 2. Processes made by fork inherit theirs.
+ */
 void initialize_file_table(struct thread * thread)
 {
-	int result;
-	char * console = NULL;
+	static const char *const names[3] = { "STDIN", "STDOUT", "STDERR" };
+	static const int modes[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
+	struct fdesc * file;
 	struct vnode * vn;
+	char * console;
+	int result;
+	int fd;
 	int i;
+
+	if(thread->t_filetable == NULL)
+	{
+		thread->t_filetable = filetable_create();
+		if(thread->t_filetable == NULL)
+		{
+			panic("initialize_file_table: out of memory\n");
+		}
+	}
+
 	// loop for 3 console file descriptors
 	for(i=0;i<3;i++)
 	{
-		switch(i)
-		{	//STDIN
-			case 0:
-				console = kstrdup("con:");
-				result = vfs_open(console,O_WRONLY,0664,&vn);
-				kfree(console);
-				if(result)
-				{
-			 		panic("Vfs_open:STDIN to filetable: %s\n",strerror(result));	
-				}
-	
-				thread->t_filetable[i] = (struct fdesc *)kmalloc(sizeof(struct fdesc));	
-				strcpy(thread->t_filetable[i]->name,"STDIN");
-				break;
-			//STDOUT
-			case 1:
-				console = kstrdup("con:");
-				result = vfs_open(console,O_RDONLY,0664,&vn);
-				kfree(console);
-				if(result)
-				{
-			 		panic("Vfs_open:STDIN to filetable: %s\n",strerror(result));	
-				}
-	
-				thread->t_filetable[i] = (struct fdesc *)kmalloc(sizeof(struct fdesc));	
-				strcpy(thread->t_filetable[i]->name,"STDOUT");
-				break;
-			//STDERR
-			case 2:
-				console = kstrdup("con:");
-				result = vfs_open(console,O_WRONLY,0664,&vn);
-				kfree(console);
-				if(result)
-				{
-			 		panic("Vfs_open:STDIN to filetable: %s\n",strerror(result));	
-				}
-	
-				thread->t_filetable[i] = (struct fdesc *)kmalloc(sizeof(struct fdesc));	
-				strcpy(thread->t_filetable[i]->name,"STDERR");
-				break;
-			default:
-				break;
-			
+		console = kstrdup("con:");
+		if(console == NULL)
+		{
+			panic("initialize_file_table: out of memory\n");
 		}
-		
-		if(i < 3)
+		result = vfs_open(console,modes[i],0664,&vn);
+		kfree(console);
+		if(result)
 		{
-			if (thread->t_filetable[i] != NULL)
-			{
-				thread->t_filetable[i]->offset = 0;
-				thread->t_filetable[i]->flag = 0;
-				thread->t_filetable[i]->ref_count = 1;
-				thread->t_filetable[i]->lk = lock_create(thread->t_filetable[i]->name);
-				thread->t_filetable[i]->vn = vn;
-			}
+			panic("Vfs_open: %s to filetable: %s\n",names[i],strerror(result));
 		}
-		
-	}	
-	
-
+		file = fdesc_create(names[i],vn,modes[i]);
+		if(file == NULL)
+		{
+			panic("initialize_file_table: out of memory\n");
+		}
+		result = filetable_add(thread->t_filetable,file,&fd);
+		if(result)
+		{
+			panic("initialize_file_table: %s\n",strerror(result));
+		}
+		KASSERT(fd == i);
+	}
 }
-
@@ -28,6 +28,9 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <lib.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -56,3 +59,46 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * nanosleep: sleep for the requested time, rounded up to whole
+ * hardclock ticks. There are no signals to cut the sleep short, so
+ * the remaining time, if asked for, is always zero.
+ */
+int
+sys_nanosleep(userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec req, rem;
+	unsigned ticks;
+	int result;
+
+	result = copyin(user_req, &req, sizeof(req));
+	if (result) {
+		return result;
+	}
+	if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	if (req.tv_sec >= (time_t)(0x7fffffff / HZ)) {
+		/* longer than the timeout code can count; near enough */
+		ticks = 0x7fffffff;
+	}
+	else {
+		ticks = req.tv_sec * HZ +
+			DIVROUNDUP((unsigned)req.tv_nsec, 1000000000 / HZ);
+	}
+	if (ticks > 0) {
+		clocksleep_ticks(ticks);
+	}
+
+	if (user_rem != NULL) {
+		rem.tv_sec = 0;
+		rem.tv_nsec = 0;
+		result = copyout(&rem, user_rem, sizeof(rem));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Frame allocator scaling test.
+ *
+ * Runs 1, 2, ... N threads (N defaults to the number of cpus) that
+ * each allocate and free kernel pages in small batches as fast as they
+ * can, and reports page allocations per second for each thread count.
+ * With per-cpu frame magazines the rate should grow with the number
+ * of cpus instead of flattening out on the coremap lock.
+ *
+ * Threads are forked on the current cpu and spread out by the
+ * scheduler's load balancing, so the first few ticks of each round
+ * run with fewer cpus busy than there are threads.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <synch.h>
+#include <vm.h>
+#include <test.h>
+
+#define FT_ROUNDS  2000
+#define FT_BATCH   8
+
+static struct semaphore *ft_start;
+static struct semaphore *ft_done;
+
+static
+void
+framethread(void *unused, unsigned long num)
+{
+	vaddr_t pages[FT_BATCH];
+	int i, j;
+
+	(void)unused;
+
+	P(ft_start);
+	for (i=0; i<FT_ROUNDS; i++) {
+		for (j=0; j<FT_BATCH; j++) {
+			pages[j] = alloc_kpages(1);
+			if (pages[j] == 0) {
+				panic("frametest: thread %lu: alloc_kpages "
+				      "failed\n", num);
+			}
+		}
+		for (j=0; j<FT_BATCH; j++) {
+			free_kpages(pages[j]);
+		}
+	}
+	V(ft_done);
+}
+
+int
+frametest(int nargs, char **args)
+{
+	unsigned maxthreads, nthreads, i;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	unsigned long allocs, msecs;
+	int result;
+
+	maxthreads = cpu_count();
+	if (nargs > 1) {
+		maxthreads = atoi(args[1]);
+		if (maxthreads == 0) {
+			kprintf("Usage: fm1 [maxthreads]\n");
+			return 0;
+		}
+	}
+
+	ft_start = sem_create("frametest start", 0);
+	ft_done = sem_create("frametest done", 0);
+	if (ft_start == NULL || ft_done == NULL) {
+		panic("frametest: sem_create failed\n");
+	}
+
+	kprintf("Starting frame allocator scaling test...\n");
+
+	for (nthreads=1; nthreads<=maxthreads; nthreads++) {
+		for (i=0; i<nthreads; i++) {
+			result = thread_fork("frametest", framethread,
+					     NULL, i, NULL);
+			if (result) {
+				panic("frametest: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+
+		gettime(&secs1, &nsecs1);
+		for (i=0; i<nthreads; i++) {
+			V(ft_start);
+		}
+		for (i=0; i<nthreads; i++) {
+			P(ft_done);
+		}
+		gettime(&secs2, &nsecs2);
+
+		getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+		msecs = secs * 1000 + nsecs / 1000000;
+		if (msecs == 0) {
+			msecs = 1;
+		}
+		allocs = (unsigned long)nthreads * FT_ROUNDS * FT_BATCH;
+		kprintf("%u thread%s: %lu allocs in %lu.%03lu s, "
+			"%lu allocs/sec\n",
+			nthreads, nthreads == 1 ? "" : "s", allocs,
+			msecs / 1000, msecs % 1000,
+			(unsigned long)((uint64_t)allocs * 1000 / msecs));
+	}
+
+	sem_destroy(ft_start);
+	sem_destroy(ft_done);
+	kprintf("Frame allocator scaling test done\n");
+
+	return 0;
+}
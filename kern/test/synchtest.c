@@ -34,7 +34,9 @@
 #include <types.h>
 #include <lib.h>
 #include <clock.h>
+#include <cpu.h>
 #include <thread.h>
+#include <spinlock.h>
 #include <synch.h>
 #include <test.h>
 
@@ -42,6 +44,8 @@
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
 #define NTHREADS      32
+#define NCONTLOOPS    2000
+#define NRWLOOPS      50
 
 static volatile unsigned long testval1;
 static volatile unsigned long testval2;
@@ -220,6 +224,104 @@ locktest(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Lock contention test: threads hammer one lock with a tiny critical
+ * section, the case the adaptive lock is meant for. Runs with 1 up to
+ * N threads (default twice the number of cpus, so some holders get
+ * preempted and waiters have to sleep) and reports the time taken and
+ * how the contended acquires were resolved.
+ */
+
+static struct lock *contlock;
+static struct semaphore *contstart;
+static volatile unsigned long contcount;
+
+static
+void
+lockconttestthread(void *junk, unsigned long num)
+{
+	int i;
+
+	(void)junk;
+	(void)num;
+
+	P(contstart);
+	for (i=0; i<NCONTLOOPS; i++) {
+		lock_acquire(contlock);
+		contcount++;
+		lock_release(contlock);
+	}
+	V(donesem);
+}
+
+int
+lockconttest(int nargs, char **args)
+{
+	unsigned maxthreads, nthreads, i;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	unsigned long msecs;
+	int result;
+
+	maxthreads = 2 * cpu_count();
+	if (nargs > 1) {
+		maxthreads = atoi(args[1]);
+		if (maxthreads == 0) {
+			kprintf("Usage: sy6 [maxthreads]\n");
+			return 0;
+		}
+	}
+
+	inititems();
+	contstart = sem_create("contstart", 0);
+	if (contstart == NULL) {
+		panic("lockconttest: sem_create failed\n");
+	}
+	kprintf("Starting lock contention test...\n");
+
+	for (nthreads=1; nthreads<=maxthreads; nthreads++) {
+		contlock = lock_create("contlock");
+		if (contlock == NULL) {
+			panic("lockconttest: lock_create failed\n");
+		}
+		contcount = 0;
+
+		for (i=0; i<nthreads; i++) {
+			result = thread_fork("synchtest", lockconttestthread,
+					     NULL, i, NULL);
+			if (result) {
+				panic("lockconttest: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+
+		gettime(&secs1, &nsecs1);
+		for (i=0; i<nthreads; i++) {
+			V(contstart);
+		}
+		for (i=0; i<nthreads; i++) {
+			P(donesem);
+		}
+		gettime(&secs2, &nsecs2);
+
+		getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+		msecs = secs * 1000 + nsecs / 1000000;
+		kprintf("%u thread%s: %lu.%03lu s; ", nthreads,
+			nthreads == 1 ? "" : "s", msecs / 1000, msecs % 1000);
+		lock_printstats(contlock);
+		if (contcount != (unsigned long)nthreads * NCONTLOOPS) {
+			kprintf("Test failed: count %lu, expected %lu\n",
+				contcount, (unsigned long)nthreads * NCONTLOOPS);
+		}
+		lock_destroy(contlock);
+	}
+
+	sem_destroy(contstart);
+	kprintf("Lock contention test done.\n");
+
+	return 0;
+}
+
 static
 void
 cvtestthread(void *junk, unsigned long num)
@@ -357,3 +459,93 @@ cvtest2(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock test. A quarter of the threads are writers; each
+ * writer sets testval1 and testval2 to its number, with a yield in
+ * between to widen the window, and readers check they always match.
+ * Also reports the most readers seen in the lock at once.
+ */
+
+static struct rwlock *testrwlock;
+static struct spinlock rwcountlock = SPINLOCK_INITIALIZER;
+static unsigned rwreaders, rwmaxreaders;
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	unsigned long v1, v2;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (num % 4 == 0) {
+			rwlock_acquire_write(testrwlock);
+			testval1 = num;
+			thread_yield();
+			testval2 = num;
+			rwlock_release_write(testrwlock);
+		}
+		else {
+			rwlock_acquire_read(testrwlock);
+			spinlock_acquire(&rwcountlock);
+			rwreaders++;
+			if (rwreaders > rwmaxreaders) {
+				rwmaxreaders = rwreaders;
+			}
+			spinlock_release(&rwcountlock);
+
+			v1 = testval1;
+			thread_yield();
+			v2 = testval2;
+			if (v1 != v2 || v1 != testval1) {
+				kprintf("thread %lu: saw %lu/%lu\n", num, v1, v2);
+				kprintf("Test failed\n");
+			}
+
+			spinlock_acquire(&rwcountlock);
+			rwreaders--;
+			spinlock_release(&rwcountlock);
+			rwlock_release_read(testrwlock);
+		}
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrwlock = rwlock_create("testrwlock");
+	if (testrwlock == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	testval1 = testval2 = 0;
+	rwreaders = rwmaxreaders = 0;
+	kprintf("Starting rwlock test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("synchtest", rwtestthread, NULL, i,
+				     NULL);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	rwlock_destroy(testrwlock);
+	kprintf("Up to %u concurrent readers.\n", rwmaxreaders);
+	kprintf("Rwlock test done.\n");
+
+	return 0;
+}
@@ -32,15 +32,16 @@
 #include <cpu.h>
 #include <wchan.h>
 #include <clock.h>
+#include <timeout.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * Callbacks at specific points in the future are handled by the
+ * timeout code in timeout.c, which runs off hardclock.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -51,13 +52,17 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
  */
 static struct wchan *lbolt;
 
+/*
+ * Threads in clocksleep wait here for their timeouts.
+ */
+static struct wchan *sleepchan;
+
 /*
  * Setup.
  */
@@ -68,6 +73,10 @@ hardclock_bootstrap(void)
 	if (lbolt == NULL) {
 		panic("Couldn't create lbolt\n");
 	}
+	sleepchan = wchan_create("clocksleep");
+	if (sleepchan == NULL) {
+		panic("Couldn't create clocksleep wchan\n");
+	}
 }
 
 /*
@@ -83,23 +92,55 @@ timerclock(void)
 
 /*
  * This is called HZ times a second (on each processor) by the timer
- * code.
+ * code, while the processor's clock is enabled.
  */
 void
 hardclock(void)
 {
-	/*
-	 * Collect statistics here as desired.
-	 */
+	if (!curcpu->c_ticking) {
+		/*
+		 * A stopped clock still fires once per wraparound of
+		 * the cycle counter; just stop it again.
+		 */
+		mainbus_settimer(false);
+		return;
+	}
 
 	curcpu->c_hardclocks++;
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
+	timeout_run();
+	thread_tick();
+}
+
+/*
+ * Start or stop the current cpu's clock. Whatever the caller wants,
+ * keep it going while there are timeouts to fire.
+ */
+void
+hardclock_enable(bool on)
+{
+	KASSERT(curthread->t_curspl > 0);
+
+	if (!on && timeout_pending()) {
+		on = true;
+	}
+	if (on != curcpu->c_ticking) {
+		curcpu->c_ticking = on;
+		mainbus_settimer(on);
 	}
-	thread_yield();
+}
+
+/*
+ * Suspend execution for n ticks. Nobody ever wakes up sleepchan, so
+ * we sleep until the timeout does.
+ */
+void
+clocksleep_ticks(unsigned ticks)
+{
+	wchan_lock(sleepchan);
+	wchan_sleep_timeout(sleepchan, ticks);
 }
 
 /*
@@ -108,9 +149,7 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	while (num_secs > 0) {
-		wchan_lock(lbolt);
-		wchan_sleep(lbolt);
-		num_secs--;
+	if (num_secs > 0) {
+		clocksleep_ticks(num_secs * HZ);
 	}
 }
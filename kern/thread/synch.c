@@ -39,7 +39,20 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
-#define MAX_THREADS 20
+
+/* Locks and CVs are created and destroyed all the time; keep them in caches. */
+static struct kmem_cache *lock_cache;
+static struct kmem_cache *cv_cache;
+
+void
+synch_bootstrap(void)
+{
+	lock_cache = kmem_cache_create("lock", sizeof(struct lock), NULL);
+	cv_cache = kmem_cache_create("cv", sizeof(struct cv), NULL);
+	if (lock_cache == NULL || cv_cache == NULL) {
+		panic("synch_bootstrap: out of memory\n");
+	}
+}
 
 ////////////////////////////////////////////////////////////
 //
@@ -147,100 +160,156 @@ V(struct semaphore *sem)
 ////////////////////////////////////////////////////////////
 //
 // Lock.
+//
+// lk_busy is the lock proper, taken with test-and-set, so an
+// uncontended acquire or release is a couple of memory operations and
+// never touches the wait channel. A thread that finds it set looks at
+// the holder: while the holder is running (on another cpu, since we
+// are running on this one), it is probably about to let go, so we spin;
+// otherwise waiting for it means a context switch at least, and we
+// sleep on lk_wchan instead. lk_waiters tells lock_release whether
+// anyone needs waking. A sleeper counts itself in lk_waiters before
+// its last try at lk_busy and the releaser clears lk_busy before it
+// looks at lk_waiters, so either the sleeper gets the lock or the
+// releaser sees it and wakes it up.
+//
+// The holder's thread structure is read without any locks while
+// spinning; it may exit and be freed under us, but thread structures
+// come from their own cache so the worst that can happen is a wrong
+// guess about whether to spin, and we recheck every time around.
 
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                kmem_cache_free(lock_cache, lock);
                 return NULL;
         }
-        
-        // add stuff here as needed
-        
-        lock->lk_wchan=wchan_create(lock->lk_name);
-	if(lock->lk_wchan == NULL)
-	{
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
-	}
-
-	spinlock_init(&lock->lk_lock);//useless
-	//lock->lk_count = 1;//useless
 
-	lock->lk_thread = NULL;
-	return lock;
+        lock->lk_wchan = wchan_create(lock->lk_name);
+        if (lock->lk_wchan == NULL) {
+                kfree(lock->lk_name);
+                kmem_cache_free(lock_cache, lock);
+                return NULL;
+        }
 
+        lock->lk_thread = NULL;
+        spinlock_data_set(&lock->lk_busy, 0);
+        lock->lk_waiters = 0;
+        lock->lk_acquires = 0;
+        lock->lk_spun = 0;
+        lock->lk_slept = 0;
+        return lock;
 }
 
 void
 lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
+        KASSERT(lock->lk_thread == NULL);
+        KASSERT(lock->lk_waiters == 0);
 
-        // add stuff here as needed
-	spinlock_cleanup(&lock->lk_lock);//u
-	wchan_destroy(lock->lk_wchan);
+        wchan_destroy(lock->lk_wchan);
+        kfree(lock->lk_name);
+        kmem_cache_free(lock_cache, lock);
+}
 
-    kfree(lock->lk_name);
-	lock->lk_thread = NULL;
-    kfree(lock);
+/*
+ * Try once to set lk_busy. The test-and-set can fail spuriously (if
+ * the SC loses its reservation), so only give up if the lock really
+ * is held.
+ */
+static
+bool
+lock_tryset(struct lock *lock)
+{
+        while (spinlock_data_testandset(&lock->lk_busy) != 0) {
+                if (spinlock_data_get(&lock->lk_busy) != 0) {
+                        return false;
+                }
+        }
+        return true;
 }
 
 void
 lock_acquire(struct lock *lock)
 {
-        // Write this
-	KASSERT(lock != NULL);
+        struct thread *holder;
+        bool contended = false, slept = false;
 
-	//KASSERT(curthread->t_in_interrupt == false);
-    spinlock_acquire(&lock->lk_lock);
-	// For deadlock
-    //KASSERT(lock->lk_thread != curthread);
-    if(!lock->lk_thread)
-	{
-		lock->lk_thread = curthread;
-		spinlock_release(&lock->lk_lock);
-		return;
-	}
-    while(lock->lk_thread != NULL)
-	{
-		wchan_lock(lock->lk_wchan); // obtain lock on wait channel; blocking function
-		spinlock_release(&lock->lk_lock); // release spin lock;
-        wchan_sleep(lock->lk_wchan); // sleep until the lock becomes available
-		spinlock_acquire(&lock->lk_lock);  // will only come to this line when the resource becomes available
-    }
-	lock->lk_thread = curthread; //what thread acquired the lock
-	spinlock_release(&lock->lk_lock);
+        KASSERT(lock != NULL);
+        KASSERT(lock->lk_thread != curthread);
+
+        while (!lock_tryset(lock)) {
+                contended = true;
+
+                /*
+                 * A null holder means it is just being taken or
+                 * dropped; that won't take long either.
+                 */
+                holder = lock->lk_thread;
+                if (holder == NULL || holder->t_state == S_RUN) {
+                        continue;
+                }
+
+                wchan_lock(lock->lk_wchan);
+                lock->lk_waiters++;
+                if (lock_tryset(lock)) {
+                        lock->lk_waiters--;
+                        wchan_unlock(lock->lk_wchan);
+                        break;
+                }
+                slept = true;
+                wchan_sleep(lock->lk_wchan);
+                wchan_lock(lock->lk_wchan);
+                lock->lk_waiters--;
+                wchan_unlock(lock->lk_wchan);
+        }
+
+        lock->lk_thread = curthread;
+        lock->lk_acquires++;
+        if (slept) {
+                lock->lk_slept++;
+        }
+        else if (contended) {
+                lock->lk_spun++;
+        }
 }
 
 void
 lock_release(struct lock *lock)
 {
-    KASSERT(lock != NULL);
+        KASSERT(lock != NULL);
+        KASSERT(lock->lk_thread == curthread);
 
-    KASSERT(lock->lk_thread == curthread);
-	lock->lk_thread = NULL;
-	wchan_wakeall(lock->lk_wchan);
-    //(void)lock;  // suppress warning until code gets written
+        lock->lk_thread = NULL;
+        spinlock_data_set(&lock->lk_busy, 0);
+        if (lock->lk_waiters > 0) {
+                wchan_wakeone(lock->lk_wchan);
+        }
 }
 
 bool
 lock_do_i_hold(struct lock *lock)
 {
-        // Write this
+        return (curthread == lock->lk_thread);
+}
 
-        //(void)lock;  // suppress warning until code gets written
-	return (curthread == lock->lk_thread);
+void
+lock_printstats(struct lock *lock)
+{
+        kprintf("lock %s: %u acquires, %u contended (%u spun, %u slept)\n",
+                lock->lk_name, lock->lk_acquires,
+                lock->lk_spun + lock->lk_slept, lock->lk_spun,
+                lock->lk_slept);
 }
 
 ////////////////////////////////////////////////////////////
@@ -253,14 +322,14 @@ cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(struct cv));
+        cv = kmem_cache_alloc(cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
-                kfree(cv);
+                kmem_cache_free(cv_cache, cv);
                 return NULL;
         }
         // add stuff here as needed
@@ -270,7 +339,7 @@ cv_create(const char *name)
 
         if(!cv->cv_wchan){  		//is NULL
         	kfree(cv->cv_wchan);
-        	kfree(cv);
+        	kmem_cache_free(cv_cache, cv);
         	return NULL;
         }
         
@@ -287,7 +356,7 @@ cv_destroy(struct cv *cv)
         // add stuff here as needed
         wchan_destroy(cv->cv_wchan);	//purge the wait q..
         kfree(cv->cv_name);
-        kfree(cv);
+        kmem_cache_free(cv_cache, cv);
 }
 
 void
@@ -310,6 +379,27 @@ cv_wait(struct cv *cv, struct lock *lock)
 		}
 }
 
+/*
+ * cv_wait with a time limit, for threads that want to wake up on a
+ * schedule (daemons, drivers polling hardware) whether or not they are
+ * signalled. Returns 0 if signalled, ETIMEDOUT if TICKS ran out; the
+ * lock is held again on return either way.
+ */
+int
+cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks)
+{
+	int result;
+
+	KASSERT(cv != NULL && lock != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	wchan_lock(cv->cv_wchan);
+	lock_release(lock);
+	result = wchan_sleep_timeout(cv->cv_wchan, ticks);
+	lock_acquire(lock);
+	return result;
+}
+
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
@@ -364,76 +454,126 @@ rwlock *rwlock_create(const char *name)
 		return NULL;
 	}
 
-	rw_lock->sem = sem_create(rw_lock->rwlock_name,MAX_THREADS);
-	if(rw_lock->sem == NULL)
+	rw_lock->rw_rwchan = wchan_create(rw_lock->rwlock_name);
+	if(rw_lock->rw_rwchan == NULL)
 	{
 		kfree(rw_lock->rwlock_name);
 		kfree(rw_lock);
 		return NULL;
 	}
 
-	rw_lock->lk = lock_create(rw_lock->rwlock_name);
-	if(rw_lock->lk == NULL)
+	rw_lock->rw_wwchan = wchan_create(rw_lock->rwlock_name);
+	if(rw_lock->rw_wwchan == NULL)
 	{
+		wchan_destroy(rw_lock->rw_rwchan);
 		kfree(rw_lock->rwlock_name);
 		kfree(rw_lock);
 		return NULL;
 	}
-	return rw_lock;
 
+	spinlock_init(&rw_lock->rw_lock);
+	rw_lock->rw_readers = 0;
+	rw_lock->rw_writer = NULL;
+	rw_lock->rw_rwaiting = 0;
+	rw_lock->rw_wwaiting = 0;
+	rw_lock->rw_readpass = 0;
+	return rw_lock;
 }
 
 void rwlock_destroy(struct rwlock * rw_lock)
 {
 	KASSERT(rw_lock != NULL);
+	KASSERT(rw_lock->rw_readers == 0 && rw_lock->rw_writer == NULL);
+	KASSERT(rw_lock->rw_rwaiting == 0 && rw_lock->rw_wwaiting == 0);
 
+	spinlock_cleanup(&rw_lock->rw_lock);
+	wchan_destroy(rw_lock->rw_rwchan);
+	wchan_destroy(rw_lock->rw_wwchan);
 	kfree(rw_lock->rwlock_name);
 	kfree(rw_lock);
 }
 
 void rwlock_acquire_read(struct rwlock *rw_lock)
 {
-	KASSERT(rw_lock  !=  NULL);
+	KASSERT(rw_lock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
 
-        KASSERT(curthread->t_in_interrupt == false);
-	lock_acquire(rw_lock->lk);
-        P(rw_lock->sem);
-	lock_release(rw_lock->lk);
+	spinlock_acquire(&rw_lock->rw_lock);
+	while(rw_lock->rw_writer != NULL ||
+	      (rw_lock->rw_wwaiting > 0 && rw_lock->rw_readpass == 0))
+	{
+		rw_lock->rw_rwaiting++;
+		wchan_lock(rw_lock->rw_rwchan);
+		spinlock_release(&rw_lock->rw_lock);
+		wchan_sleep(rw_lock->rw_rwchan);
+		spinlock_acquire(&rw_lock->rw_lock);
+		rw_lock->rw_rwaiting--;
+	}
+	if(rw_lock->rw_readpass > 0)
+	{
+		rw_lock->rw_readpass--;
+	}
+	rw_lock->rw_readers++;
+	spinlock_release(&rw_lock->rw_lock);
 }
 
 void rwlock_release_read(struct rwlock *rw_lock)
 {
 	KASSERT(rw_lock != NULL);
 
-	V(rw_lock->sem);
+	spinlock_acquire(&rw_lock->rw_lock);
+	KASSERT(rw_lock->rw_readers > 0);
+	rw_lock->rw_readers--;
+	if(rw_lock->rw_readers == 0 && rw_lock->rw_readpass == 0 &&
+	   rw_lock->rw_wwaiting > 0)
+	{
+		wchan_wakeone(rw_lock->rw_wwchan);
+	}
+	spinlock_release(&rw_lock->rw_lock);
 }
 
 void rwlock_acquire_write(struct rwlock *rw_lock)
 {
-	int max_tries;
-
-	KASSERT(rw_lock  !=  NULL);
-
-        KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw_lock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
 
-	lock_acquire(rw_lock->lk);
-	for(max_tries = 0; max_tries<MAX_THREADS;max_tries++)
+	spinlock_acquire(&rw_lock->rw_lock);
+	KASSERT(rw_lock->rw_writer != curthread);
+	while(rw_lock->rw_writer != NULL || rw_lock->rw_readers > 0 ||
+	      rw_lock->rw_readpass > 0)
 	{
-		P(rw_lock->sem);
+		rw_lock->rw_wwaiting++;
+		wchan_lock(rw_lock->rw_wwchan);
+		spinlock_release(&rw_lock->rw_lock);
+		wchan_sleep(rw_lock->rw_wwchan);
+		spinlock_acquire(&rw_lock->rw_lock);
+		rw_lock->rw_wwaiting--;
 	}
-	lock_release(rw_lock->lk);
+	rw_lock->rw_writer = curthread;
+	spinlock_release(&rw_lock->rw_lock);
 }
 
 void rwlock_release_write(struct rwlock *rw_lock)
 {
+	KASSERT(rw_lock != NULL);
 
-	int max_tries;
-
-	KASSERT(rw_lock  !=  NULL);
-
-	for(max_tries = 0; max_tries<MAX_THREADS;max_tries++)
+	spinlock_acquire(&rw_lock->rw_lock);
+	KASSERT(rw_lock->rw_writer == curthread);
+	rw_lock->rw_writer = NULL;
+	if(rw_lock->rw_rwaiting > 0)
 	{
-		V(rw_lock->sem);
+		/* let the waiting readers in before the next writer */
+		rw_lock->rw_readpass = rw_lock->rw_rwaiting;
+		wchan_wakeall(rw_lock->rw_rwchan);
 	}
+	else if(rw_lock->rw_wwaiting > 0)
+	{
+		wchan_wakeone(rw_lock->rw_wwchan);
+	}
+	spinlock_release(&rw_lock->rw_lock);
+}
 
+bool rwlock_do_i_hold_write(struct rwlock *rw_lock)
+{
+	return rw_lock->rw_writer == curthread;
 }
@@ -44,6 +44,8 @@
 #include <threadlist.h>
 #include <threadprivate.h>
 #include <current.h>
+#include <clock.h>
+#include <timeout.h>
 #include <synch.h>
 #include <addrspace.h>
 #include <vm.h>
@@ -72,10 +74,15 @@ DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
 static struct cpuarray allcpus;
 
+static struct thread *thread_steal(void);
+static void thread_kick_idle(struct cpu *busy);
 
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Where thread structures come from. */
+static struct kmem_cache *thread_cache;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -126,7 +133,6 @@ thread_create(const char *name)
 	//kprintf("here");
 	struct thread *thread;
 	//int result;
-	int i;
 	//int result;	// Result for vfs command
 	//char devname[16]; //Name for console device // 03-02-2014
 	//struct vnode *vn; // vnode for fdesc
@@ -135,25 +141,26 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	if(process_start(thread)!=0)
 	{
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		
 		return NULL;
 	}
 	
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
+	thread->t_wchan = NULL;
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
@@ -162,6 +169,9 @@ thread_create(const char *name)
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
+	thread->t_prevcpu = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -174,10 +184,7 @@ thread_create(const char *name)
 	/* VFS fields */
 	thread->t_cwd = NULL;
 
-	for(i=0;i<128;i++)
-	{
-		thread->t_filetable[i] = NULL;
-	}
+	thread->t_filetable = NULL;
 
 ////Aditya Singla: 03/08/2014
 	
@@ -189,6 +196,66 @@ thread_create(const char *name)
 
 ////Adding code for processes: Aditya Singla
 //////End
+/*
+ * Run queues. Each cpu has RUNQ_LEVELS lists; threads go on the tail
+ * of the list for their t_priority and come off the head of the
+ * highest (lowest numbered) non-empty one. The caller holds the cpu's
+ * c_runqueue_lock, except in runq_init.
+ */
+static
+void
+runq_init(struct cpu *c)
+{
+	unsigned i;
+
+	for (i=0; i<RUNQ_LEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
+}
+
+static
+void
+runq_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_priority < RUNQ_LEVELS);
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+	c->c_runcount++;
+}
+
+static
+struct thread *
+runq_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=0; i<RUNQ_LEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Tickless operation. The clock is only needed to preempt the running
+ * thread, so it is turned off while the cpu is idle or has nothing
+ * else to run (hardclock_enable keeps it on if timeouts are pending).
+ * It goes back on when a thread is queued behind the running one.
+ * Called on the cpu itself with its run queue locked, whenever that
+ * might have changed.
+ */
+static
+void
+thread_updatetick(void)
+{
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+	hardclock_enable(!curcpu->c_isidle && curcpu->c_runcount > 0);
+}
+
 /*
  * Create a CPU structure. This is used for the bootup CPU and
  * also for secondary CPUs.
@@ -217,7 +284,8 @@ cpu_create(unsigned hardware_number)
 	c->c_hardclocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	c->c_ticking = true;	/* the clock starts out running */
+	runq_init(c);
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -260,6 +328,15 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Number of cpus.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
 /*
  * Destroy a thread.
  *
@@ -272,7 +349,6 @@ static
 void
 thread_destroy(struct thread *thread)
 {
-	int i = 0;
 	KASSERT(thread != curthread);
 	KASSERT(thread->t_state != S_RUN);
 
@@ -291,15 +367,10 @@ thread_destroy(struct thread *thread)
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
-	if(curthread->t_filetable !=NULL)
-	{
-		for(i=0; i<128;i++)
-		{
-			if(curthread->t_filetable[i] != NULL && curthread->t_filetable[i]->ref_count == 1)
-			{
-				kfree(curthread->t_filetable[i]);
-			}
-		}
+	/* thread_exit normally got this already; not if thread_fork failed */
+	if (thread->t_filetable != NULL) {
+		filetable_destroy(thread->t_filetable);
+		thread->t_filetable = NULL;
 	}
 
 	/* Aditya Singla : Clear filetable */
@@ -311,7 +382,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -341,6 +412,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -355,9 +428,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<RUNQ_LEVELS; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -403,6 +479,16 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	/*
+	 * Object caches for threads and their open file entries. These
+	 * have to exist before the boot thread is made below.
+	 */
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread), NULL);
+	fdesc_cache = kmem_cache_create("fdesc", sizeof(struct fdesc), NULL);
+	if (thread_cache == NULL || fdesc_cache == NULL) {
+		panic("thread_bootstrap: out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -499,7 +585,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runq_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -507,6 +593,22 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else {
+		/*
+		 * The thread is queued behind a running one, so that
+		 * cpu needs its clock to preempt, and an idle cpu
+		 * could take the thread instead.
+		 */
+		if (!targetcpu->c_ticking) {
+			if (targetcpu == curcpu->c_self) {
+				thread_updatetick();
+			}
+			else {
+				ipi_send(targetcpu, IPI_UNIDLE);
+			}
+		}
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -531,7 +633,6 @@ thread_fork(const char *name,
 	    struct thread **ret)
 {
 	struct thread *newthread;
-		int i;
 
 	newthread = thread_create(name);
 	if (newthread == NULL) {
@@ -553,14 +654,12 @@ thread_fork(const char *name,
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
 
-	/* copy file table and process entries - Aditya Singla*/
-
-	for (i=0;i<128;i++)
-	{
-		if(curthread->t_filetable[i] != NULL)
-		{
-			curthread->t_filetable[i]->ref_count++;
-			newthread->t_filetable[i] = curthread->t_filetable[i];
+	/* share the open files and copy process entries - Aditya Singla*/
+	if (curthread->t_filetable != NULL) {
+		if (filetable_copy(curthread->t_filetable,
+				   &newthread->t_filetable)) {
+			thread_destroy(newthread);
+			return ENOMEM;
 		}
 	}
 	
@@ -649,7 +748,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runcount == 0) {
+		thread_updatetick();
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -679,6 +779,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		 * without racing. Exercise: what's the other?)
 		 */
 		threadlist_addtail(&wc->wc_threads, cur);
+		cur->t_wchan = wc;
 		wchan_unlock(wc);
 		break;
 	    case S_ZOMBIE:
@@ -708,14 +809,19 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runq_remhead(curcpu);
 		if (next == NULL) {
+			thread_updatetick();
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	thread_updatetick();
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -792,8 +898,6 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Clean up dead threads. */
 	exorcise();
 
-	tlb_invalidate_all();
-
 	/* Turn interrupts back on. */
 	splx(spl);
 }
@@ -865,22 +969,15 @@ thread_exit(void)
 	struct thread *cur;
 
 	cur = curthread;
-	int i = 0;
 	/* VFS fields */
 	if (cur->t_cwd) {
 		VOP_DECREF(cur->t_cwd);
 		cur->t_cwd = NULL;
 	}
 	
-	if(curthread->t_filetable !=NULL)
-	{
-		for(i=0; i<128;i++)
-		{
-			if(curthread->t_filetable[i] != NULL && curthread->t_filetable[i]->ref_count == 1)
-			{
-				kfree(curthread->t_filetable[i]);
-			}
-		}
+	if (cur->t_filetable != NULL) {
+		filetable_destroy(cur->t_filetable);
+		cur->t_filetable = NULL;
 	}
 	/* VM fields */
 	if (cur->t_addrspace) {
@@ -930,135 +1027,223 @@ schedule(void)
 {
   // 28 Feb 2012 : GWA : Leave the default scheduler alone!
 }
+
+/*
+ * Round robin: give up the cpu on every tick.
+ */
+void
+thread_tick(void)
+{
+	thread_yield();
+}
 #else
+
+/*
+ * Multi-level feedback queue.
+ *
+ * New threads start at level 0. A thread's quantum doubles with each
+ * level down (SCHED_QUANTUM). Ticks are charged to the level, not to
+ * one stretch of running, so a thread that keeps sleeping just before
+ * its quantum runs out still gets demoted once it has used that much
+ * cpu; threads that mostly sleep (the shell, anything waiting on the
+ * console or disk) never use it up and stay on top. A running thread
+ * is preempted when its quantum is spent or something at a higher
+ * level is waiting.
+ *
+ * So that demoted threads can't starve, every SCHED_BOOST_HARDCLOCKS
+ * schedule() moves everything queued on the cpu, and the thread
+ * running there, back to level 0.
+ */
+
+/* hardclocks a thread gets at LEVEL before it is demoted */
+#define SCHED_QUANTUM(level)	(1U << (level))
+
+/* once a second; a multiple of SCHEDULE_HARDCLOCKS, as schedule() needs */
+#define SCHED_BOOST_HARDCLOCKS	HZ
+
 void
 schedule(void)
 {
-  // 28 Feb 2012 : GWA : Implement your scheduler that prioritizes
-  // "interactive" threads here.
+	struct thread *t;
+	unsigned i;
+
+	if (curcpu->c_hardclocks % SCHED_BOOST_HARDCLOCKS != 0) {
+		return;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<RUNQ_LEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i])) != NULL) {
+			t->t_priority = 0;
+			t->t_ticks = 0;
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
+		}
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+void
+thread_tick(void)
+{
+	struct thread *cur = curthread;
+	bool preempt;
+	unsigned i;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_isidle) {
+		/* nobody is running to charge the tick to */
+		thread_updatetick();
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return;
+	}
+
+	cur->t_ticks++;
+	if (cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		if (cur->t_priority < RUNQ_LEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		preempt = true;
+	}
+	else {
+		preempt = false;
+		for (i=0; i<cur->t_priority; i++) {
+			if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+				preempt = true;
+				break;
+			}
+		}
+	}
+	if (!preempt) {
+		thread_updatetick();
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
 }
 #endif
 
 /*
- * Thread migration.
+ * Work stealing.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * Rather than busy cpus periodically pushing work around, a cpu that
+ * runs out of threads goes looking for some: it picks the peer with
+ * the most queued threads and takes one from it. Idle cpus have their
+ * clocks off, so when a thread gets queued behind a running one we
+ * prod an idle cpu (thread_kick_idle) to come and look; busy cpus
+ * never take anyone else's threads.
  *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * The peer's c_runcount is read without its lock to choose a victim;
+ * that is only a hint and is rechecked once the victim is locked. We
+ * never hold our own run queue lock while taking the victim's, so two
+ * cpus stealing from each other can't deadlock.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Migrating a thread costs it its cache footprint, so among the first
+ * STEAL_SCAN threads of the victim's lowest non-empty level we prefer
+ * one that was previously on the thief (t_prevcpu), whose working set
+ * may still be warm there. Failing that we take the head of that
+ * level, which has waited longest and is the coldest on the victim.
  */
+#define STEAL_SCAN 4
+
+/*
+ * BUSY has just had a thread queued behind the running one; wake up
+ * an idle cpu, if there is one, so it can steal. c_isidle is read
+ * unlocked as a hint; a false alarm just costs the other cpu a look.
+ */
+static
 void
-thread_consider_migration(void)
+thread_kick_idle(struct cpu *busy)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
 	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	unsigned i, numcpus;
 
-	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		if (c != busy && c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t, *pick;
+	unsigned i, numcpus, best, min, level, scanned;
+
+	victim = NULL;
+	best = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && c->c_runcount > best) {
+			victim = c;
+			best = c->c_runcount;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	spinlock_acquire(&victim->c_runqueue_lock);
+
+	/*
+	 * An idle cpu with one queued thread is about to run it; taking
+	 * it would just bounce it around.
+	 */
+	min = victim->c_isidle ? 2 : 1;
+	if (victim->c_runcount < min) {
+		spinlock_release(&victim->c_runqueue_lock);
+		return NULL;
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
+	pick = NULL;
+	for (level = RUNQ_LEVELS; level-- > 0 && pick == NULL; ) {
+		if (threadlist_isempty(&victim->c_runqueue[level])) {
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
+		scanned = 0;
+		THREADLIST_FORALL(t, victim->c_runqueue[level]) {
 			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
+			 * The victim's curthread can be on its run queue
+			 * if it went to sleep, the victim went idle, and
+			 * then it was woken up again; it is still running
+			 * there on its own stack and must not be taken.
 			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
+			if (t == victim->c_curthread) {
 				continue;
 			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
+			if (pick == NULL || t->t_prevcpu == curcpu->c_self) {
+				pick = t;
+			}
+			if (t->t_prevcpu == curcpu->c_self ||
+			    ++scanned >= STEAL_SCAN) {
+				break;
 			}
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+	if (pick != NULL) {
+		threadlist_remove(&victim->c_runqueue[pick->t_priority], pick);
+		victim->c_runcount--;
+		pick->t_prevcpu = victim;
+		pick->t_cpu = curcpu->c_self;
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      pick->t_name, victim->c_number, curcpu->c_number);
 	}
-
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	spinlock_release(&victim->c_runqueue_lock);
+	return pick;
 }
 
 ////////////////////////////////////////////////////////////
@@ -1132,6 +1317,65 @@ wchan_sleep(struct wchan *wc)
 	thread_switch(S_SLEEP, wc);
 }
 
+/*
+ * Sleeping with a timeout. The timeout's callback takes the thread
+ * off the channel itself, unless a wakeup got there first; t_wchan,
+ * which is only changed with the channel locked, says which.
+ */
+struct wchan_timeout {
+	struct thread *wt_thread;
+	struct wchan *wt_wchan;
+	bool wt_timedout;
+};
+
+static
+void
+wchan_timeout_fire(void *data)
+{
+	struct wchan_timeout *wt = data;
+	struct thread *t = wt->wt_thread;
+	bool found;
+
+	spinlock_acquire(&wt->wt_wchan->wc_lock);
+	found = (t->t_wchan == wt->wt_wchan);
+	if (found) {
+		threadlist_remove(&wt->wt_wchan->wc_threads, t);
+		t->t_wchan = NULL;
+		wt->wt_timedout = true;
+	}
+	spinlock_release(&wt->wt_wchan->wc_lock);
+
+	if (found) {
+		thread_make_runnable(t, false);
+	}
+}
+
+int
+wchan_sleep_timeout(struct wchan *wc, unsigned ticks)
+{
+	struct wchan_timeout wt;
+	struct timeout to;
+
+	/* may not sleep in an interrupt handler */
+	KASSERT(!curthread->t_in_interrupt);
+
+	wt.wt_thread = curthread;
+	wt.wt_wchan = wc;
+	wt.wt_timedout = false;
+	timeout_init(&to, wchan_timeout_fire, &wt);
+
+	/*
+	 * The channel is locked, so if the timeout goes off right away
+	 * the callback waits until we're on the list.
+	 */
+	timeout_add(&to, ticks);
+	thread_switch(S_SLEEP, wc);
+
+	/* Also waits out the callback if it's running right now. */
+	timeout_del(&to);
+	return wt.wt_timedout ? ETIMEDOUT : 0;
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1143,6 +1387,9 @@ wchan_wakeone(struct wchan *wc)
 	/* Lock the channel and grab a thread from it */
 	spinlock_acquire(&wc->wc_lock);
 	target = threadlist_remhead(&wc->wc_threads);
+	if (target != NULL) {
+		target->t_wchan = NULL;
+	}
 	/*
 	 * Nobody else can wake up this thread now, so we don't need
 	 * to hang onto the lock.
@@ -1174,6 +1421,7 @@ wchan_wakeall(struct wchan *wc)
 	 */
 	spinlock_acquire(&wc->wc_lock);
 	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+		target->t_wchan = NULL;
 		threadlist_addtail(&list, target);
 	}
 	/*
@@ -1290,12 +1538,6 @@ interprocessor_interrupt(void)
 		kprintf("cpu%d: offline.\n", curcpu->c_number);
 		cpu_halt();
 	}
-	if (bits & (1U << IPI_UNIDLE)) {
-		/*
-		 * The cpu has already unidled itself to take the
-		 * interrupt; don't need to do anything else.
-		 */
-	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
 		if (curcpu->c_numshootdown == TLBSHOOTDOWN_ALL) {
 			vm_tlbshootdown_all();
@@ -1310,4 +1552,19 @@ interprocessor_interrupt(void)
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	if (bits & (1U << IPI_UNIDLE)) {
+		/*
+		 * The cpu has already unidled itself to take the
+		 * interrupt. It may have been sent because a thread
+		 * was queued behind the running one, so see if the
+		 * clock needs to go back on. This is done after
+		 * dropping c_ipi_lock: thread_make_runnable sends
+		 * this IPI holding our run queue lock, so taking the
+		 * run queue lock under the IPI lock could deadlock.
+		 */
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		thread_updatetick();
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
 }
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Hierarchical timer wheel.
+ *
+ * There are TW_LEVELS wheels of TW_SIZE slots each. Level 0 has one
+ * slot per tick and holds timeouts due within TW_SIZE ticks of the
+ * wheel's current tick (timeout_wheelnow); level 1 has one slot per
+ * TW_SIZE ticks and holds those due within TW_SIZE^2; and so on. Each
+ * time level N wraps around, the next slot of level N+1 is emptied
+ * ("cascaded") back into the lower levels. Arming and disarming are
+ * constant time, and the work in timeout_run is proportional to the
+ * number of timeouts that fire, plus a cascade every TW_SIZE ticks.
+ * Timeouts further away than the top level covers sit in its last
+ * slot and get re-filed each time it comes round.
+ *
+ * timeout_run steps the wheel one tick at a time up to the current
+ * time. If every cpu has been tickless for a while that could be a
+ * long walk, but the wheel is empty then (a cpu keeps ticking while it
+ * isn't), so we just jump to now.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <timeout.h>
+
+#define TW_BITS		6
+#define TW_SIZE		(1U << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	4
+
+/* slot at LEVEL for tick T */
+#define TW_SLOT(t, level)	(((t) >> ((level) * TW_BITS)) & TW_MASK)
+
+/* nanoseconds per tick */
+#define TICK_NSECS	(1000000000 / HZ)
+
+/* true if tick A is at or before tick B (wraparound-safe) */
+#define TICK_BEFORE_EQ(a, b)	((int32_t)((a) - (b)) <= 0)
+
+static struct spinlock timeout_lock = SPINLOCK_INITIALIZER;
+static struct timeout *timeout_wheel[TW_LEVELS][TW_SIZE];
+static unsigned timeout_count;		/* number armed */
+static uint32_t timeout_wheelnow;	/* last tick processed */
+
+uint32_t
+timeout_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint32_t)secs * HZ + nsecs / TICK_NSECS;
+}
+
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *data)
+{
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+	to->to_firenext = NULL;
+	to->to_expire = 0;
+	to->to_armed = false;
+	to->to_firing = false;
+	to->to_func = func;
+	to->to_data = data;
+}
+
+/*
+ * File TO in the slot for its expiry time relative to the wheel's
+ * current tick. Call with timeout_lock held.
+ */
+static
+void
+timeout_insert(struct timeout *to)
+{
+	struct timeout **head;
+	uint32_t delta, expire;
+	unsigned level;
+
+	expire = to->to_expire;
+	delta = expire - timeout_wheelnow;
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < (1U << ((level + 1) * TW_BITS))) {
+			break;
+		}
+	}
+	if (level == TW_LEVELS - 1 && delta >= (1U << (TW_LEVELS * TW_BITS))) {
+		/* too far off; park it as far out as we can see */
+		expire = timeout_wheelnow + (1U << (TW_LEVELS * TW_BITS)) - 1;
+	}
+
+	head = &timeout_wheel[level][TW_SLOT(expire, level)];
+	to->to_next = *head;
+	to->to_prevp = head;
+	if (*head != NULL) {
+		(*head)->to_prevp = &to->to_next;
+	}
+	*head = to;
+}
+
+/* Unlink TO from its slot. Call with timeout_lock held. */
+static
+void
+timeout_unlink(struct timeout *to)
+{
+	*to->to_prevp = to->to_next;
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = to->to_prevp;
+	}
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+}
+
+void
+timeout_add(struct timeout *to, unsigned ticks)
+{
+	uint32_t now;
+
+	if (ticks == 0) {
+		ticks = 1;
+	}
+
+	spinlock_acquire(&timeout_lock);
+	KASSERT(!to->to_armed);
+	now = timeout_now();
+	if (timeout_count == 0) {
+		/* wheel was idle; don't make timeout_run walk the gap */
+		timeout_wheelnow = now;
+	}
+	/*
+	 * NOW is the tick boundary we last passed, which may have been
+	 * almost a whole tick ago, so count from the next one: that
+	 * way at least TICKS full ticks go by before it fires, and
+	 * sleeps are never short.
+	 */
+	to->to_expire = now + ticks + 1;
+	timeout_insert(to);
+	to->to_armed = true;
+	timeout_count++;
+
+	/* Make sure somebody is ticking to fire it. */
+	hardclock_enable(true);
+	spinlock_release(&timeout_lock);
+}
+
+bool
+timeout_del(struct timeout *to)
+{
+	bool wasarmed;
+
+	spinlock_acquire(&timeout_lock);
+	wasarmed = to->to_armed;
+	if (wasarmed) {
+		timeout_unlink(to);
+		to->to_armed = false;
+		timeout_count--;
+	}
+	spinlock_release(&timeout_lock);
+
+	/* If it's going off on another cpu right now, let it finish. */
+	while (to->to_firing) {
+		/* spin */
+	}
+	return wasarmed;
+}
+
+bool
+timeout_pending(void)
+{
+	return timeout_count > 0;
+}
+
+/*
+ * Empty slot SLOT of LEVEL and re-file everything in it against the
+ * current tick. Call with timeout_lock held.
+ */
+static
+void
+timeout_cascade(unsigned level, unsigned slot)
+{
+	struct timeout *to, *next;
+
+	to = timeout_wheel[level][slot];
+	timeout_wheel[level][slot] = NULL;
+	for (; to != NULL; to = next) {
+		next = to->to_next;
+		timeout_insert(to);
+	}
+}
+
+void
+timeout_run(void)
+{
+	struct timeout *to, *next, *fired;
+	uint32_t now, t;
+	unsigned level;
+
+	if (timeout_count == 0) {
+		return;
+	}
+
+	fired = NULL;
+	spinlock_acquire(&timeout_lock);
+	now = timeout_now();
+	while (timeout_count > 0 && !TICK_BEFORE_EQ(now, timeout_wheelnow)) {
+		t = ++timeout_wheelnow;
+
+		/* Crossed into a new turn of level 0 (and maybe beyond)? */
+		for (level = 1; level < TW_LEVELS; level++) {
+			if (TW_SLOT(t, level - 1) != 0) {
+				break;
+			}
+			timeout_cascade(level, TW_SLOT(t, level));
+		}
+
+		to = timeout_wheel[0][TW_SLOT(t, 0)];
+		timeout_wheel[0][TW_SLOT(t, 0)] = NULL;
+		for (; to != NULL; to = next) {
+			next = to->to_next;
+			if (!TICK_BEFORE_EQ(to->to_expire, t)) {
+				/* parked in the top level; not yet */
+				timeout_insert(to);
+				continue;
+			}
+			to->to_next = NULL;
+			to->to_prevp = NULL;
+			to->to_armed = false;
+			to->to_firing = true;
+			timeout_count--;
+			to->to_firenext = fired;
+			fired = to;
+		}
+	}
+	if (timeout_count == 0) {
+		timeout_wheelnow = now;
+	}
+	spinlock_release(&timeout_lock);
+
+	/*
+	 * Call the functions with the lock released; they typically
+	 * wake threads up. Clearing to_firing lets timeout_del return,
+	 * after which TO may be reused or gone.
+	 */
+	for (to = fired; to != NULL; to = next) {
+		next = to->to_firenext;
+		to->to_func(to->to_data);
+		to->to_firing = false;
+	}
+}
@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Directory name lookup cache.
+ *
+ * Remembers the result of looking up a single name in a directory:
+ * either the vnode it names, or (a negative entry) that nothing by
+ * that name exists. vfs_lookup and vfs_lookparent consult it for each
+ * path component before asking the filesystem, so a hot path resolves
+ * without the filesystem scanning its directories.
+ *
+ * Only filesystems that set fs_dcache take part; see fs.h. An entry
+ * holds a reference to its directory, and to the vnode it names if
+ * there is one, so neither can be reclaimed (and its address reused)
+ * while the entry exists. The cache is bounded and kept in LRU order;
+ * entries are also dropped when a filesystem is unmounted.
+ *
+ * Anything that adds or removes a name (create, mkdir, link, symlink,
+ * remove, rmdir, rename) calls vfs_dcache_invalidate for that name
+ * after the operation, whether or not it succeeded. To keep a lookup
+ * that was overtaken by such a change from entering a stale result,
+ * a miss hands back the current generation number, every invalidation
+ * bumps it, and vfs_dcache_enter only accepts the result if it hasn't
+ * changed in between.
+ *
+ * "." and ".." are always left to the filesystem, as are names longer
+ * than DCACHE_NAMELEN. (A ".." entry would hold references in a cycle.)
+ *
+ * dcache_lock covers everything here. It is never held while calling
+ * into a filesystem; references dropped by the cache are released
+ * after it has been let go.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <fs.h>
+#include <vnode.h>
+
+#define DCACHE_NAMELEN		31	/* longest name cached */
+#define DCACHE_HASHSIZE		256	/* buckets; a power of 2 */
+#define DCACHE_MAX		512	/* entries */
+
+struct dcentry {
+	struct vnode *dc_dir;		/* directory the name is in */
+	struct vnode *dc_vn;		/* what it names; NULL if nothing */
+	struct dcentry *dc_hashnext;	/* hash chain */
+	struct dcentry *dc_lrunext;	/* LRU list */
+	struct dcentry *dc_lruprev;
+	char dc_name[DCACHE_NAMELEN+1];
+};
+
+static struct lock *dcache_lock;
+static struct dcentry *dcache_hash[DCACHE_HASHSIZE];
+
+/* Least recently used at the head; eviction takes from there. */
+static struct dcentry *dcache_lruhead;
+static struct dcentry *dcache_lrutail;
+
+static unsigned dcache_count;
+static unsigned dcache_gen;
+
+static unsigned long dcstat_hits;
+static unsigned long dcstat_neghits;
+static unsigned long dcstat_misses;
+static unsigned long dcstat_enters;
+static unsigned long dcstat_invalidations;
+static unsigned long dcstat_evictions;
+
+/*
+ * Set up the cache. Called from vfs_bootstrap.
+ */
+void
+vfs_dcache_bootstrap(void)
+{
+	dcache_lock = lock_create("dcache");
+	if (dcache_lock == NULL) {
+		panic("vfs: Could not create name cache lock\n");
+	}
+}
+
+/* Whether NAME may go in the cache at all. */
+static
+bool
+dcache_cacheable(const char *name)
+{
+	if (strlen(name) > DCACHE_NAMELEN) {
+		return false;
+	}
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return false;
+	}
+	return true;
+}
+
+static
+unsigned
+dcache_hashfn(struct vnode *dir, const char *name)
+{
+	unsigned h = (uintptr_t)dir >> 4;
+
+	for (; *name; name++) {
+		h = h*33 + (unsigned char)*name;
+	}
+	return h & (DCACHE_HASHSIZE-1);
+}
+
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc;
+
+	for (dc = dcache_hash[dcache_hashfn(dir, name)]; dc != NULL;
+	     dc = dc->dc_hashnext) {
+		if (dc->dc_dir == dir && !strcmp(dc->dc_name, name)) {
+			return dc;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+dcache_lruremove(struct dcentry *dc)
+{
+	if (dc->dc_lruprev != NULL) {
+		dc->dc_lruprev->dc_lrunext = dc->dc_lrunext;
+	}
+	else {
+		dcache_lruhead = dc->dc_lrunext;
+	}
+	if (dc->dc_lrunext != NULL) {
+		dc->dc_lrunext->dc_lruprev = dc->dc_lruprev;
+	}
+	else {
+		dcache_lrutail = dc->dc_lruprev;
+	}
+	dc->dc_lrunext = dc->dc_lruprev = NULL;
+}
+
+static
+void
+dcache_lruappend(struct dcentry *dc)
+{
+	dc->dc_lrunext = NULL;
+	dc->dc_lruprev = dcache_lrutail;
+	if (dcache_lrutail != NULL) {
+		dcache_lrutail->dc_lrunext = dc;
+	}
+	else {
+		dcache_lruhead = dc;
+	}
+	dcache_lrutail = dc;
+}
+
+/*
+ * Take DC out of the cache and put it on *LIST (chained through
+ * dc_lrunext) for dcache_freelist.
+ */
+static
+void
+dcache_unlink(struct dcentry *dc, struct dcentry **list)
+{
+	struct dcentry **dcp;
+
+	for (dcp = &dcache_hash[dcache_hashfn(dc->dc_dir, dc->dc_name)];
+	     *dcp != dc; dcp = &(*dcp)->dc_hashnext) {
+		KASSERT(*dcp != NULL);
+	}
+	*dcp = dc->dc_hashnext;
+	dc->dc_hashnext = NULL;
+
+	dcache_lruremove(dc);
+	KASSERT(dcache_count > 0);
+	dcache_count--;
+
+	dc->dc_lrunext = *list;
+	*list = dc;
+}
+
+/*
+ * Drop the references held by, and free, entries unlinked with
+ * dcache_unlink. Must be called without dcache_lock, since dropping
+ * a reference may reclaim the vnode.
+ */
+static
+void
+dcache_freelist(struct dcentry *list)
+{
+	struct dcentry *dc;
+
+	KASSERT(!lock_do_i_hold(dcache_lock));
+
+	while ((dc = list) != NULL) {
+		list = dc->dc_lrunext;
+		if (dc->dc_vn != NULL) {
+			VOP_DECREF(dc->dc_vn);
+		}
+		VOP_DECREF(dc->dc_dir);
+		kfree(dc);
+	}
+}
+
+/*
+ * Look up NAME in directory DIR. Returns true on a hit, with the vnode
+ * (referenced) in *RET, or NULL in *RET if the cache knows the name
+ * doesn't exist. On a miss, returns false and puts the generation to
+ * pass to vfs_dcache_enter in *GEN.
+ */
+bool
+vfs_dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret,
+		  unsigned *gen)
+{
+	struct dcentry *dc;
+
+	KASSERT(dir->vn_fs != NULL && dir->vn_fs->fs_dcache);
+
+	lock_acquire(dcache_lock);
+	*gen = dcache_gen;
+	if (!dcache_cacheable(name)) {
+		lock_release(dcache_lock);
+		return false;
+	}
+
+	dc = dcache_find(dir, name);
+	if (dc == NULL) {
+		dcstat_misses++;
+		lock_release(dcache_lock);
+		return false;
+	}
+
+	dcache_lruremove(dc);
+	dcache_lruappend(dc);
+	if (dc->dc_vn != NULL) {
+		VOP_INCREF(dc->dc_vn);
+		dcstat_hits++;
+	}
+	else {
+		dcstat_neghits++;
+	}
+	*ret = dc->dc_vn;
+	lock_release(dcache_lock);
+	return true;
+}
+
+/*
+ * Record the result of asking the filesystem to look up NAME in DIR:
+ * VN, or NULL if the lookup failed with ENOENT. GEN is what
+ * vfs_dcache_lookup handed back when it missed. Doesn't fail; if
+ * memory is short, or the result may be stale, nothing is cached.
+ */
+void
+vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		 unsigned gen)
+{
+	struct dcentry *dc, *victims = NULL;
+	unsigned h;
+
+	KASSERT(dir->vn_fs != NULL && dir->vn_fs->fs_dcache);
+
+	if (!dcache_cacheable(name)) {
+		return;
+	}
+
+	dc = kmalloc(sizeof(struct dcentry));
+	if (dc == NULL) {
+		return;
+	}
+
+	lock_acquire(dcache_lock);
+	if (gen != dcache_gen || dcache_find(dir, name) != NULL) {
+		lock_release(dcache_lock);
+		kfree(dc);
+		return;
+	}
+
+	VOP_INCREF(dir);
+	dc->dc_dir = dir;
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	dc->dc_vn = vn;
+	strcpy(dc->dc_name, name);
+
+	h = dcache_hashfn(dir, name);
+	dc->dc_hashnext = dcache_hash[h];
+	dcache_hash[h] = dc;
+	dcache_lruappend(dc);
+	dcache_count++;
+	dcstat_enters++;
+
+	while (dcache_count > DCACHE_MAX) {
+		dcache_unlink(dcache_lruhead, &victims);
+		dcstat_evictions++;
+	}
+	lock_release(dcache_lock);
+
+	dcache_freelist(victims);
+}
+
+/*
+ * Forget whatever is known about NAME in DIR. If it named a vnode,
+ * also forget the names cached in that vnode, in case it was a
+ * directory that has just been removed.
+ */
+void
+vfs_dcache_invalidate(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc, *next, *list = NULL;
+	struct vnode *vn;
+
+	if (dir->vn_fs == NULL || !dir->vn_fs->fs_dcache) {
+		return;
+	}
+
+	lock_acquire(dcache_lock);
+	dcache_gen++;
+	dcstat_invalidations++;
+
+	dc = dcache_cacheable(name) ? dcache_find(dir, name) : NULL;
+	if (dc != NULL) {
+		vn = dc->dc_vn;
+		dcache_unlink(dc, &list);
+		if (vn != NULL) {
+			for (dc = dcache_lruhead; dc != NULL; dc = next) {
+				next = dc->dc_lrunext;
+				if (dc->dc_dir == vn) {
+					dcache_unlink(dc, &list);
+				}
+			}
+		}
+	}
+	lock_release(dcache_lock);
+
+	dcache_freelist(list);
+}
+
+/*
+ * Drop every entry for filesystem FS, so that it can be unmounted.
+ */
+void
+vfs_dcache_purgefs(struct fs *fs)
+{
+	struct dcentry *dc, *next, *list = NULL;
+
+	lock_acquire(dcache_lock);
+	dcache_gen++;
+	for (dc = dcache_lruhead; dc != NULL; dc = next) {
+		next = dc->dc_lrunext;
+		if (dc->dc_dir->vn_fs == fs) {
+			dcache_unlink(dc, &list);
+		}
+	}
+	lock_release(dcache_lock);
+
+	dcache_freelist(list);
+}
+
+/*
+ * Print the cache statistics.
+ */
+void
+vfs_dcache_printstats(void)
+{
+	unsigned long lookups;
+
+	lock_acquire(dcache_lock);
+	lookups = dcstat_hits + dcstat_neghits + dcstat_misses;
+	kprintf("dcache: %u/%u entries\n", dcache_count, DCACHE_MAX);
+	kprintf("dcache: %lu lookups, %lu hits, %lu negative hits, "
+		"%lu misses\n", lookups, dcstat_hits, dcstat_neghits,
+		dcstat_misses);
+	kprintf("dcache: %lu entered, %lu invalidations, %lu evictions\n",
+		dcstat_enters, dcstat_invalidations, dcstat_evictions);
+	lock_release(dcache_lock);
+}
@@ -35,12 +35,13 @@
 #include <kern/errno.h>
 #include <limits.h>
 #include <lib.h>
-#include <synch.h>
+#include <spinlock.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
 
 static struct vnode *bootfs_vnode = NULL;
+static struct spinlock bootfs_lock = SPINLOCK_INITIALIZER;
 
 /*
  * Helper function for actually changing bootfs_vnode.
@@ -51,8 +52,10 @@ change_bootfs(struct vnode *newvn)
 {
 	struct vnode *oldvn;
 
+	spinlock_acquire(&bootfs_lock);
 	oldvn = bootfs_vnode;
 	bootfs_vnode = newvn;
+	spinlock_release(&bootfs_lock);
 
 	if (oldvn != NULL) {
 		VOP_DECREF(oldvn);
@@ -75,14 +78,11 @@ vfs_setbootfs(const char *fsname)
 	int result;
 	struct vnode *newguy;
 
-	vfs_biglock_acquire();
-
 	snprintf(tmp, sizeof(tmp)-1, "%s", fsname);
 	s = strchr(tmp, ':');
 	if (s) {
 		/* If there's a colon, it must be at the end */
 		if (strlen(s)>0) {
-			vfs_biglock_release();
 			return EINVAL;
 		}
 	}
@@ -92,19 +92,16 @@ vfs_setbootfs(const char *fsname)
 
 	result = vfs_chdir(tmp);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	result = vfs_getcurdir(&newguy);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	change_bootfs(newguy);
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -114,9 +111,7 @@ vfs_setbootfs(const char *fsname)
 void
 vfs_clearbootfs(void)
 {
-	vfs_biglock_acquire();
 	change_bootfs(NULL);
-	vfs_biglock_release();
 }
 
 
@@ -133,8 +128,6 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	struct vnode *vn;
 	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/*
 	 * Locate the first colon or slash.
 	 */
@@ -188,11 +181,14 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	KASSERT(colon==0 || slash==0);
 
 	if (path[0]=='/') {
+		spinlock_acquire(&bootfs_lock);
 		if (bootfs_vnode==NULL) {
+			spinlock_release(&bootfs_lock);
 			return ENOENT;
 		}
 		VOP_INCREF(bootfs_vnode);
 		*startvn = bootfs_vnode;
+		spinlock_release(&bootfs_lock);
 	}
 	else {
 		KASSERT(path[0]==':');
@@ -223,6 +219,105 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+/*
+ * Whether lookups in directory DIR go through the name cache.
+ * Devices have no filesystem, and some filesystems opt out.
+ */
+static
+bool
+usedcache(struct vnode *dir)
+{
+	return dir->vn_fs != NULL && dir->vn_fs->fs_dcache;
+}
+
+/*
+ * Look up the single name NAME in directory DIR, trying the name
+ * cache first and telling it what the filesystem said on a miss.
+ */
+static
+int
+lookup_component(struct vnode *dir, char *name, struct vnode **ret)
+{
+	struct vnode *vn;
+	unsigned gen;
+	int result;
+
+	if (vfs_dcache_lookup(dir, name, &vn, &gen)) {
+		if (vn == NULL) {
+			return ENOENT;
+		}
+		*ret = vn;
+		return 0;
+	}
+
+	result = VOP_LOOKUP(dir, name, &vn);
+	if (result == 0) {
+		vfs_dcache_enter(dir, name, vn, gen);
+		*ret = vn;
+	}
+	else if (result == ENOENT) {
+		vfs_dcache_enter(dir, name, NULL, gen);
+	}
+	return result;
+}
+
+/*
+ * Look up PATH relative to directory STARTVN (which the caller keeps
+ * its reference to), a component at a time through the name cache.
+ * If we reach a directory that doesn't use the cache, the rest of the
+ * path is handed to its filesystem in one go, as before.
+ */
+static
+int
+lookup_walk(struct vnode *startvn, char *path, struct vnode **ret)
+{
+	struct vnode *dir, *vn;
+	char *next;
+	int result;
+
+	VOP_INCREF(startvn);
+	dir = startvn;
+
+	while (1) {
+		if (!usedcache(dir)) {
+			result = VOP_LOOKUP(dir, path, &vn);
+			VOP_DECREF(dir);
+			if (result) {
+				return result;
+			}
+			*ret = vn;
+			return 0;
+		}
+
+		/* Skip repeated (or trailing) slashes. */
+		while (*path=='/') {
+			path++;
+		}
+		if (*path==0) {
+			*ret = dir;
+			return 0;
+		}
+
+		next = strchr(path, '/');
+		if (next != NULL) {
+			*next++ = 0;
+		}
+
+		result = lookup_component(dir, path, &vn);
+		VOP_DECREF(dir);
+		if (result) {
+			return result;
+		}
+		dir = vn;
+
+		if (next == NULL) {
+			*ret = dir;
+			return 0;
+		}
+		path = next;
+	}
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
@@ -232,14 +327,12 @@ int
 vfs_lookparent(char *path, struct vnode **retval,
 	       char *buf, size_t buflen)
 {
-	struct vnode *startvn;
+	struct vnode *startvn, *dir;
+	char *s;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -249,15 +342,30 @@ vfs_lookparent(char *path, struct vnode **retval,
 		 * a context where "lookparent" is the desired
 		 * operation.
 		 */
-		result = EINVAL;
+		VOP_DECREF(startvn);
+		return EINVAL;
 	}
-	else {
-		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
+
+	/*
+	 * If the filesystem uses the name cache, find the directory
+	 * ourselves and leave just the last component for it.
+	 */
+	s = strrchr(path, '/');
+	if (usedcache(startvn) && s != NULL && s[1] != 0) {
+		*s = 0;
+		result = lookup_walk(startvn, path, &dir);
+		VOP_DECREF(startvn);
+		if (result) {
+			return result;
+		}
+		startvn = dir;
+		path = s+1;
 	}
 
+	result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
+
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -267,23 +375,18 @@ vfs_lookup(char *path, struct vnode **retval)
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
+	result = lookup_walk(startvn, path, retval);
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
@@ -29,6 +29,9 @@
 
 /*
  * High-level VFS operations on pathnames.
+ *
+ * Anything that adds or removes a name tells the name cache about it
+ * afterwards (see vfsdcache.c).
  */
 
 #include <types.h>
@@ -74,6 +77,7 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		vfs_dcache_invalidate(dir, name);
 
 		VOP_DECREF(dir);
 	}
@@ -150,6 +154,7 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	vfs_dcache_invalidate(dir, name);
 	VOP_DECREF(dir);
 
 	return result;
@@ -183,6 +188,8 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	vfs_dcache_invalidate(olddir, oldname);
+	vfs_dcache_invalidate(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -217,6 +224,7 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	vfs_dcache_invalidate(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -244,6 +252,7 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	vfs_dcache_invalidate(newdir, newname);
 	VOP_DECREF(newdir);
 
 	return result;
@@ -290,6 +299,7 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	vfs_dcache_invalidate(parent, name);
 
 	VOP_DECREF(parent);
 
@@ -312,6 +322,7 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	vfs_dcache_invalidate(parent, name);
 
 	VOP_DECREF(parent);
 
@@ -30,7 +30,11 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -330,6 +334,8 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+static void kmem_cache_printstats(void);
+
 void
 kheap_printstats(void)
 {
@@ -345,6 +351,8 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kmem_cache_printstats();
 }
 
 ////////////////////////////////////////
@@ -632,3 +640,485 @@ kfree(void *ptr)
 	}
 }
 
+
+////////////////////////////////////////////////////////////
+//
+// Object caches.
+//
+// This is a slab allocator in the style of Bonwick's, for kernel
+// structures that are allocated and freed all the time. Each cache
+// hands out objects of one size. It gets slabs of one or more whole
+// pages from alloc_kpages and carves them into buffers, so it is not
+// limited by the subpage allocator's size classes or its one page of
+// pagerefs.
+//
+// Each buffer is the object followed by a tag word. While the object
+// is allocated the tag points to its slab, so kmem_cache_free finds
+// the slab without searching; while it is free the tag links it into
+// the slab's freelist. The object itself is never touched by the
+// allocator, which is what lets a constructor run once per buffer
+// instead of once per allocation: objects come out of the cache in
+// constructed state and must go back into it the same way.
+//
+// The slab header sits at the end of the slab. Slabs are kept on
+// three lists (full, partial, empty); one empty slab is kept around
+// to absorb alloc/free ping-pong and further ones are given back.
+//
+// In front of the slabs each cpu has a small magazine of free objects,
+// handled with interrupts off and no lock, like the frame magazines in
+// the VM system. Only refilling or draining half a magazine takes the
+// cache's spinlock.
+//
+
+#define KMEM_MAGSIZE		8	/* objects per cpu magazine */
+#define KMEM_MAXSLABPAGES	8	/* largest slab we'll ask for */
+#define KMEM_MAXEMPTY		1	/* empty slabs kept per cache */
+
+struct kmem_magazine {
+	void *km_objs[KMEM_MAGSIZE];
+	unsigned km_count;
+	unsigned km_hits;
+	unsigned km_misses;
+};
+
+struct kmem_slab {
+	struct kmem_cache *sl_cache;
+	struct kmem_slab *sl_next;
+	struct kmem_slab *sl_prev;
+	vaddr_t sl_base;
+	void *sl_free;			/* first free buffer */
+	unsigned sl_inuse;		/* buffers not on sl_free */
+};
+
+struct kmem_cache {
+	char *kc_name;
+	size_t kc_objsize;		/* size asked for */
+	size_t kc_bufsize;		/* object plus tag, rounded up */
+	unsigned kc_slabpages;
+	unsigned kc_perslab;
+	void (*kc_ctor)(void *);
+
+	struct spinlock kc_lock;	/* protects the slab lists and counts */
+	struct kmem_slab *kc_full;
+	struct kmem_slab *kc_partial;
+	struct kmem_slab *kc_empty;
+	unsigned kc_nslabs;
+	unsigned kc_nempty;
+	unsigned long kc_inuse;		/* buffers out of slabs, incl. magazines */
+
+	struct kmem_cache *kc_next;	/* on kmem_caches */
+	struct kmem_magazine kc_mag[MAXCPUS];
+};
+
+#define KMEM_TAG(kc, obj) \
+	((void **)((char *)(obj) + (kc)->kc_bufsize - sizeof(void *)))
+
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+
+static
+void
+kmem_slab_link(struct kmem_slab **head, struct kmem_slab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = *head;
+	if (*head != NULL) {
+		(*head)->sl_prev = sl;
+	}
+	*head = sl;
+}
+
+static
+void
+kmem_slab_unlink(struct kmem_slab **head, struct kmem_slab *sl)
+{
+	if (sl->sl_prev != NULL) {
+		sl->sl_prev->sl_next = sl->sl_next;
+	}
+	else {
+		KASSERT(*head == sl);
+		*head = sl->sl_next;
+	}
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl->sl_prev;
+	}
+	sl->sl_next = sl->sl_prev = NULL;
+}
+
+/*
+ * Get a fresh slab and construct all its buffers. Called without the
+ * cache's lock, since alloc_kpages can sleep.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *sl;
+	vaddr_t base;
+	void *obj;
+	unsigned i;
+
+	base = alloc_kpages(kc->kc_slabpages);
+	if (base == 0) {
+		return NULL;
+	}
+
+	sl = (struct kmem_slab *)
+		(base + kc->kc_slabpages * PAGE_SIZE - sizeof(struct kmem_slab));
+	sl->sl_cache = kc;
+	sl->sl_next = sl->sl_prev = NULL;
+	sl->sl_base = base;
+	sl->sl_free = NULL;
+	sl->sl_inuse = 0;
+
+	/* build the freelist backwards so it hands out low addresses first */
+	for (i = kc->kc_perslab; i-- > 0; ) {
+		obj = (void *)(base + i * kc->kc_bufsize);
+		if (kc->kc_ctor != NULL) {
+			kc->kc_ctor(obj);
+		}
+		*KMEM_TAG(kc, obj) = sl->sl_free;
+		sl->sl_free = obj;
+	}
+	return sl;
+}
+
+/*
+ * Take up to MAX objects out of the slabs. Returns how many we got;
+ * 0 means out of memory.
+ */
+static
+unsigned
+kmem_slab_get(struct kmem_cache *kc, void **objs, unsigned max)
+{
+	struct kmem_slab *sl;
+	void *obj;
+	unsigned n = 0;
+
+	spinlock_acquire(&kc->kc_lock);
+	while (n < max) {
+		sl = kc->kc_partial;
+		if (sl == NULL && kc->kc_empty != NULL) {
+			sl = kc->kc_empty;
+			kmem_slab_unlink(&kc->kc_empty, sl);
+			kmem_slab_link(&kc->kc_partial, sl);
+			kc->kc_nempty--;
+		}
+		if (sl == NULL) {
+			if (n > 0) {
+				break;
+			}
+			/* Drop the lock to get a page; recheck afterwards. */
+			spinlock_release(&kc->kc_lock);
+			sl = kmem_slab_create(kc);
+			if (sl == NULL) {
+				return 0;
+			}
+			spinlock_acquire(&kc->kc_lock);
+			kmem_slab_link(&kc->kc_empty, sl);
+			kc->kc_nslabs++;
+			kc->kc_nempty++;
+			continue;
+		}
+
+		KASSERT(sl->sl_free != NULL);
+		obj = sl->sl_free;
+		sl->sl_free = *KMEM_TAG(kc, obj);
+		*KMEM_TAG(kc, obj) = sl;
+		sl->sl_inuse++;
+		if (sl->sl_free == NULL) {
+			KASSERT(sl->sl_inuse == kc->kc_perslab);
+			kmem_slab_unlink(&kc->kc_partial, sl);
+			kmem_slab_link(&kc->kc_full, sl);
+		}
+		objs[n++] = obj;
+	}
+	kc->kc_inuse += n;
+	spinlock_release(&kc->kc_lock);
+	return n;
+}
+
+/*
+ * Put N objects back into their slabs, and give back slabs that
+ * become empty beyond the ones we keep.
+ */
+static
+void
+kmem_slab_put(struct kmem_cache *kc, void **objs, unsigned n)
+{
+	struct kmem_slab *sl, *release = NULL;
+	void *obj;
+	unsigned i;
+
+	spinlock_acquire(&kc->kc_lock);
+	for (i=0; i<n; i++) {
+		obj = objs[i];
+		sl = *KMEM_TAG(kc, obj);
+		KASSERT(sl->sl_cache == kc);
+		KASSERT(sl->sl_inuse > 0);
+
+		if (sl->sl_free == NULL) {
+			kmem_slab_unlink(&kc->kc_full, sl);
+			kmem_slab_link(&kc->kc_partial, sl);
+		}
+		*KMEM_TAG(kc, obj) = sl->sl_free;
+		sl->sl_free = obj;
+		sl->sl_inuse--;
+
+		if (sl->sl_inuse == 0) {
+			kmem_slab_unlink(&kc->kc_partial, sl);
+			if (kc->kc_nempty < KMEM_MAXEMPTY) {
+				kmem_slab_link(&kc->kc_empty, sl);
+				kc->kc_nempty++;
+			}
+			else {
+				kc->kc_nslabs--;
+				sl->sl_next = release;
+				release = sl;
+			}
+		}
+	}
+	kc->kc_inuse -= n;
+	spinlock_release(&kc->kc_lock);
+
+	/* Call free_kpages without the spinlock. */
+	while (release != NULL) {
+		sl = release;
+		release = sl->sl_next;
+		free_kpages(sl->sl_base);
+	}
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *))
+{
+	struct kmem_cache *kc;
+	size_t slabbytes;
+	unsigned i;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = kstrdup(name);
+	if (kc->kc_name == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+
+	kc->kc_objsize = size;
+	kc->kc_bufsize = (size + sizeof(void *) + 7) & ~(size_t)7;
+	kc->kc_ctor = ctor;
+
+	/*
+	 * Use the smallest slab that wastes no more than 1/8 of itself,
+	 * or failing that the biggest one we allow.
+	 */
+	kc->kc_slabpages = 1;
+	while (1) {
+		slabbytes = kc->kc_slabpages * PAGE_SIZE;
+		kc->kc_perslab = (slabbytes - sizeof(struct kmem_slab)) /
+			kc->kc_bufsize;
+		if (kc->kc_slabpages == KMEM_MAXSLABPAGES ||
+		    (kc->kc_perslab > 0 &&
+		     (slabbytes - kc->kc_perslab * kc->kc_bufsize) * 8
+		     <= slabbytes)) {
+			break;
+		}
+		kc->kc_slabpages *= 2;
+	}
+	if (kc->kc_perslab == 0) {
+		panic("kmem_cache_create: %s: objects of size %lu too big\n",
+		      name, (unsigned long)size);
+	}
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_full = kc->kc_partial = kc->kc_empty = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_nempty = 0;
+	kc->kc_inuse = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		kc->kc_mag[i].km_count = 0;
+		kc->kc_mag[i].km_hits = 0;
+		kc->kc_mag[i].km_misses = 0;
+	}
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
+
+/*
+ * Destroy a cache. All its objects must have been freed, and nobody
+ * may be using it any more.
+ */
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **kcp;
+	struct kmem_slab *sl;
+	unsigned i;
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kcp = &kmem_caches; *kcp != kc; kcp = &(*kcp)->kc_next) {
+		KASSERT(*kcp != NULL);
+	}
+	*kcp = kc->kc_next;
+	spinlock_release(&kmem_caches_lock);
+
+	for (i=0; i<MAXCPUS; i++) {
+		if (kc->kc_mag[i].km_count > 0) {
+			kmem_slab_put(kc, kc->kc_mag[i].km_objs,
+				      kc->kc_mag[i].km_count);
+			kc->kc_mag[i].km_count = 0;
+		}
+	}
+
+	if (kc->kc_full != NULL || kc->kc_partial != NULL) {
+		panic("kmem_cache_destroy: %s: objects still allocated\n",
+		      kc->kc_name);
+	}
+	while (kc->kc_empty != NULL) {
+		sl = kc->kc_empty;
+		kmem_slab_unlink(&kc->kc_empty, sl);
+		free_kpages(sl->sl_base);
+	}
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc->kc_name);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_magazine *km;
+	void *batch[KMEM_MAGSIZE / 2];
+	unsigned n;
+	void *obj;
+	int spl;
+
+	KASSERT(kc != NULL);
+
+	/* Before curcpu exists (early boot) go straight to the slabs. */
+	if (!CURCPU_EXISTS()) {
+		return kmem_slab_get(kc, batch, 1) ? batch[0] : NULL;
+	}
+
+	spl = splhigh();
+	km = &kc->kc_mag[curcpu->c_number];
+	if (km->km_count > 0) {
+		obj = km->km_objs[--km->km_count];
+		km->km_hits++;
+		splx(spl);
+		return obj;
+	}
+	km->km_misses++;
+	splx(spl);
+
+	n = kmem_slab_get(kc, batch, KMEM_MAGSIZE / 2);
+	if (n == 0) {
+		return NULL;
+	}
+	obj = batch[--n];
+
+	/* We may be on another cpu by now; that's fine, it's just a cache. */
+	spl = splhigh();
+	km = &kc->kc_mag[curcpu->c_number];
+	while (n > 0 && km->km_count < KMEM_MAGSIZE) {
+		km->km_objs[km->km_count++] = batch[--n];
+	}
+	splx(spl);
+
+	if (n > 0) {
+		kmem_slab_put(kc, batch, n);
+	}
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_magazine *km;
+	void *batch[KMEM_MAGSIZE / 2];
+	struct kmem_slab *sl;
+	unsigned n = 0;
+	int spl;
+
+	KASSERT(kc != NULL);
+	KASSERT(obj != NULL);
+
+	sl = *KMEM_TAG(kc, obj);
+	if (sl == NULL || sl->sl_cache != kc) {
+		panic("kmem_cache_free: %s: bad or already free object %p\n",
+		      kc->kc_name, obj);
+	}
+
+	if (!CURCPU_EXISTS()) {
+		kmem_slab_put(kc, &obj, 1);
+		return;
+	}
+
+	spl = splhigh();
+	km = &kc->kc_mag[curcpu->c_number];
+	if (km->km_count == KMEM_MAGSIZE) {
+		while (n < KMEM_MAGSIZE / 2) {
+			batch[n++] = km->km_objs[--km->km_count];
+		}
+	}
+	km->km_objs[km->km_count++] = obj;
+	splx(spl);
+
+	if (n > 0) {
+		kmem_slab_put(kc, batch, n);
+	}
+}
+
+/*
+ * Per-cache utilization, for kheap_printstats. "used" counts objects
+ * actually handed out, not ones sitting in magazines; "util" is the
+ * fraction of the cache's slab memory those objects occupy.
+ */
+static
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+	unsigned long used, total, hits, misses, slabbytes;
+	unsigned i, inmags;
+
+	kprintf("Object caches:\n");
+	kprintf("  %-12s %5s %5s %6s %6s %6s %5s %8s %8s\n",
+		"name", "size", "pages", "slabs", "used", "total", "util",
+		"maghits", "magmiss");
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		inmags = 0;
+		hits = misses = 0;
+		for (i=0; i<MAXCPUS; i++) {
+			inmags += kc->kc_mag[i].km_count;
+			hits += kc->kc_mag[i].km_hits;
+			misses += kc->kc_mag[i].km_misses;
+		}
+
+		spinlock_acquire(&kc->kc_lock);
+		/* magazine counts were read unlocked; don't underflow */
+		used = kc->kc_inuse > inmags ? kc->kc_inuse - inmags : 0;
+		total = (unsigned long)kc->kc_nslabs * kc->kc_perslab;
+		slabbytes = (unsigned long)kc->kc_nslabs *
+			kc->kc_slabpages * PAGE_SIZE;
+		kprintf("  %-12s %5lu %5u %6u %6lu %6lu %4lu%% %8lu %8lu\n",
+			kc->kc_name, (unsigned long)kc->kc_objsize,
+			kc->kc_slabpages, kc->kc_nslabs, used, total,
+			slabbytes ? used * kc->kc_objsize * 100 / slabbytes : 0,
+			hits, misses);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
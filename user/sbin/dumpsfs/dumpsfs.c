@@ -56,11 +56,16 @@
 
 #include "disk.h"
 
+/* Set if the volume has hashed directories */
+static int dirhash;
+
 static
 uint32_t
 dumpsb(void)
 {
 	struct sfs_super sp;
+	uint32_t features;
+
 	diskread(&sp, SFS_SB_LOCATION);
 	if (SWAPL(sp.sp_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
@@ -69,29 +74,104 @@ dumpsb(void)
 	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname, 
 	       SWAPL(sp.sp_nblocks));
 
+	features = SWAPL(sp.sp_features);
+	printf("Features: 0x%x%s\n", features,
+	       (features & SFS_FEATURE_DIRHASH) ? " (hashed directories)" : "");
+	if (features & ~SFS_FEATURES_KNOWN) {
+		warnx("Warning: unknown feature flags 0x%x",
+		      features & ~SFS_FEATURES_KNOWN);
+	}
+	dirhash = (features & SFS_FEATURE_DIRHASH) != 0;
+
 	return SWAPL(sp.sp_nblocks);
 }
 
+static
+uint32_t
+dirhashname(const char *name)
+{
+	uint32_t h = SFS_DIRHASH_INIT;
+
+	for (; *name; name++) {
+		h = SFS_DIRHASH_STEP(h, *name);
+	}
+	return h;
+}
+
+/* Buckets in the hashed directory being dumped; 0 if none yet */
+static uint32_t nbuckets;
+
+static
+void
+dodirhdr(uint32_t block)
+{
+	union {
+		struct sfs_dirhdr hdr;
+		char buf[SFS_BLOCKSIZE];
+	} u;
+	uint32_t i;
+
+	diskread(&u, block);
+
+	printf("    [block %u: hash header]\n", block);
+	if (SWAPL(u.hdr.sdh_magic) != SFS_DIRHASH_MAGIC) {
+		printf("        bad magic number 0x%x\n",
+		       SWAPL(u.hdr.sdh_magic));
+		nbuckets = 0;
+		return;
+	}
+	nbuckets = SWAPL(u.hdr.sdh_nbuckets);
+	printf("        %u buckets, %u entries\n", nbuckets,
+	       SWAPL(u.hdr.sdh_nentries));
+	printf("        overflowed:");
+	for (i=0; i<nbuckets && i<SFS_DIRHASH_MAXBUCKETS; i++) {
+		if (u.hdr.sdh_overflow[i/8] & (1 << (i%8))) {
+			printf(" %u", i);
+		}
+	}
+	printf("\n");
+}
+
+/*
+ * Dump directory block BLOCK, which is block LBLOCK of the directory.
+ */
 static
 void
-dodirblock(uint32_t block)
+dodirblock(uint32_t lblock, uint32_t block)
 {
 	struct sfs_dir sds[SFS_BLOCKSIZE/sizeof(struct sfs_dir)];
 	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	uint32_t home;
 	int i;
 
+	if (dirhash && lblock == 0) {
+		dodirhdr(block);
+		return;
+	}
+
 	diskread(&sds, block);
 
-	printf("    [block %u]\n", block);
+	if (dirhash) {
+		printf("    [block %u: bucket %u]\n", block, lblock-1);
+	}
+	else {
+		printf("    [block %u]\n", block);
+	}
 	for (i=0; i<nsds; i++) {
 		uint32_t ino = SWAPL(sds[i].sfd_ino);
 		if (ino==SFS_NOINO) {
 			printf("        [free entry]\n");
+			continue;
 		}
-		else {
-			sds[i].sfd_name[SFS_NAMELEN-1] = 0; /* just in case */
-			printf("        %u %s\n", ino, sds[i].sfd_name);
+		sds[i].sfd_name[SFS_NAMELEN-1] = 0; /* just in case */
+		printf("        %u %s", ino, sds[i].sfd_name);
+		if (dirhash && nbuckets > 0) {
+			home = dirhashname(sds[i].sfd_name) & (nbuckets-1);
+			if (home != lblock-1) {
+				printf(" (home bucket %u)", home);
+			}
 		}
+		printf("\n");
 	}
 }
 
@@ -110,12 +190,14 @@ dumpdir(uint32_t ino)
 	if (SWAPL(sfi.sfi_size) % sizeof(struct sfs_dir) != 0) {
 		warnx("Warning: dir size is not a multiple of dir entry size");
 	}
-	printf("Directory %u: %d entries\n", ino, nentries);
+	printf("Directory %u: %d %s\n", ino, nentries,
+	       dirhash ? "slots" : "entries");
+	nbuckets = 0;
 
 	for (i=0; i<SFS_NDIRECT; i++) {
 		block = SWAPL(sfi.sfi_direct[i]);
 		if (block) {
-			dodirblock(block);
+			dodirblock(i, block);
 			nblocks++;
 		}
 	}
@@ -124,7 +206,7 @@ dumpdir(uint32_t ino)
 		for (i=0; i<SFS_DBPERIDB; i++) {
 			block = SWAPL(ib[i]);
 			if (block) {
-				dodirblock(block);
+				dodirblock(SFS_NDIRECT+i, block);
 				nblocks++;
 			}
 		}
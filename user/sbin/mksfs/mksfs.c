@@ -64,11 +64,13 @@ check(void)
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	assert(sizeof(struct sfs_dirhdr) <= SFS_BLOCKSIZE);
+	assert((SFS_DIRHASH_MAXBUCKETS+1) <= SFS_NDIRECT + SFS_DBPERIDB);
 }
 
 static
 void
-writesuper(const char *volname, uint32_t nblocks)
+writesuper(const char *volname, uint32_t nblocks, uint32_t features)
 {
 	struct sfs_super sp;
 
@@ -81,10 +83,15 @@ writesuper(const char *volname, uint32_t nblocks)
 	sp.sp_magic = SWAPL(SFS_MAGIC);
 	sp.sp_nblocks = SWAPL(nblocks);
 	strcpy(sp.sp_volname, volname);
+	sp.sp_features = SWAPL(features);
 
 	diskwrite(&sp, SFS_SB_LOCATION);
 }
 
+/*
+ * The root directory starts out empty (size 0), which is also how an
+ * empty hashed directory looks, so it's the same either way.
+ */
 static
 void
 writerootdir(void)
@@ -146,15 +153,22 @@ writebitmap(uint32_t fsblocks)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, blocksize, features = 0;
 	char *volname, *s;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	/* -H: use hashed directories (see kern/sfs.h) */
+	if (argc==4 && !strcmp(argv[1], "-H")) {
+		features |= SFS_FEATURE_DIRHASH;
+		argc--;
+		argv++;
+	}
+
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-H] device/diskfile volume-name");
 	}
 
 	check();
@@ -185,7 +199,7 @@ main(int argc, char **argv)
 	}
 	size = diskblocks();
 
-	writesuper(volname, size);
+	writesuper(volname, size, features);
 	writerootdir();
 	writebitmap(size);
 
@@ -83,6 +83,7 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_features = SWAPL(sp->sp_features);
 }
 
 static
@@ -181,6 +182,7 @@ typedef enum {
 } blockusage_t;
 
 static uint32_t nblocks, bitblocks;
+static int dirhash;	/* volume has hashed directories */
 static uint32_t uniquecounter = 1;
 
 static unsigned long count_blocks=0, count_dirs=0, count_files=0;
@@ -522,6 +524,12 @@ check_sb(void)
 		errx(EXIT_UNRECOV, "Not an sfs filesystem");
 	}
 
+	if (sp.sp_features & ~SFS_FEATURES_KNOWN) {
+		errx(EXIT_UNRECOV, "Unsupported feature flags 0x%lx",
+		     (unsigned long) (sp.sp_features & ~SFS_FEATURES_KNOWN));
+	}
+	dirhash = (sp.sp_features & SFS_FEATURE_DIRHASH) != 0;
+
 	assert(nblocks==0);
 	assert(bitblocks==0);
 	nblocks = sp.sp_nblocks;
@@ -860,6 +868,182 @@ dirwrite(const struct sfs_inode *sfi, struct sfs_dir *d, int nd)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Hashed directories (see kern/sfs.h). In the entry array of such a
+ * directory the first SFS_DIRPERBLOCK slots are the header block, and
+ * bucket B is the SFS_DIRPERBLOCK slots after that for each B.
+ */
+
+static
+uint32_t
+dirhashname(const char *name)
+{
+	uint32_t h = SFS_DIRHASH_INIT;
+
+	for (; *name; name++) {
+		h = SFS_DIRHASH_STEP(h, *name);
+	}
+	return h;
+}
+
+static
+int
+dirhash_isoverflow(const struct sfs_dirhdr *hdr, uint32_t b)
+{
+	return (hdr->sdh_overflow[b/8] & (1 << (b%8))) != 0;
+}
+
+/* Read the header of hashed directory SFI; returns 0 if it's sane. */
+static
+int
+dirhash_readhdr(const struct sfs_inode *sfi, struct sfs_dirhdr *hdr)
+{
+	union {
+		struct sfs_dirhdr hdr;
+		char buf[SFS_BLOCKSIZE];
+	} u;
+	uint32_t block, nb;
+
+	block = dobmap(sfi, 0);
+	if (block == 0) {
+		return -1;
+	}
+	diskread(&u, block);
+
+	hdr->sdh_magic = SWAPL(u.hdr.sdh_magic);
+	hdr->sdh_nbuckets = nb = SWAPL(u.hdr.sdh_nbuckets);
+	hdr->sdh_nentries = SWAPL(u.hdr.sdh_nentries);
+	memcpy(hdr->sdh_overflow, u.hdr.sdh_overflow,
+	       sizeof(hdr->sdh_overflow));
+
+	if (hdr->sdh_magic != SFS_DIRHASH_MAGIC || nb == 0 ||
+	    nb > SFS_DIRHASH_MAXBUCKETS || (nb & (nb-1)) != 0 ||
+	    sfi->sfi_size != (nb+1) * SFS_BLOCKSIZE) {
+		return -1;
+	}
+	return 0;
+}
+
+static
+void
+dirhash_writehdr(const struct sfs_inode *sfi, const struct sfs_dirhdr *hdr)
+{
+	union {
+		struct sfs_dirhdr hdr;
+		char buf[SFS_BLOCKSIZE];
+	} u;
+	uint32_t block;
+
+	block = dobmap(sfi, 0);
+	assert(block != 0);
+
+	bzero(&u, sizeof(u));
+	u.hdr.sdh_magic = SWAPL(hdr->sdh_magic);
+	u.hdr.sdh_nbuckets = SWAPL(hdr->sdh_nbuckets);
+	u.hdr.sdh_nentries = SWAPL(hdr->sdh_nentries);
+	memcpy(u.hdr.sdh_overflow, hdr->sdh_overflow,
+	       sizeof(u.hdr.sdh_overflow));
+	diskwrite(&u, block);
+}
+
+/*
+ * Check that each entry of hashed directory D (ND slots) would be
+ * found by a lookup, and that the header's count is right. Returns
+ * nonzero if the index needs to be rebuilt.
+ */
+static
+int
+dirhash_checkindex(const char *pathsofar, struct sfs_dir *d, uint32_t nd,
+		   const struct sfs_dirhdr *hdr)
+{
+	uint32_t i, b, probe, mask, count = 0;
+	int bad = 0;
+
+	mask = hdr->sdh_nbuckets - 1;
+	for (i=SFS_DIRPERBLOCK; i<nd; i++) {
+		if (d[i].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		count++;
+		b = i/SFS_DIRPERBLOCK - 1;
+		for (probe = dirhashname(d[i].sfd_name) & mask; probe != b;
+		     probe = (probe+1) & mask) {
+			if (!dirhash_isoverflow(hdr, probe)) {
+				warnx("Directory /%s: Entry %s cannot be "
+				      "found from its hash bucket",
+				      pathsofar, d[i].sfd_name);
+				bad = 1;
+				break;
+			}
+		}
+	}
+	if (count != hdr->sdh_nentries) {
+		warnx("Directory /%s: Hash header says %lu entries, "
+		      "found %lu", pathsofar,
+		      (unsigned long) hdr->sdh_nentries,
+		      (unsigned long) count);
+		bad = 1;
+	}
+	return bad;
+}
+
+/*
+ * Lay out the entries of hashed directory D (ND slots) again from
+ * scratch, keeping the number of buckets, and update HDR to match.
+ * Returns nonzero if they don't fit.
+ */
+static
+int
+dirhash_rebuild(struct sfs_dir *d, uint32_t nd, struct sfs_dirhdr *hdr)
+{
+	struct sfs_dir *ents;
+	uint32_t i, j, n, nents, b, probes, mask;
+	int placed;
+
+	ents = domalloc(nd * sizeof(struct sfs_dir));
+	nents = 0;
+	for (i=SFS_DIRPERBLOCK; i<nd; i++) {
+		if (d[i].sfd_ino != SFS_NOINO) {
+			ents[nents++] = d[i];
+		}
+		d[i].sfd_ino = SFS_NOINO;
+		bzero(d[i].sfd_name, sizeof(d[i].sfd_name));
+	}
+
+	bzero(hdr->sdh_overflow, sizeof(hdr->sdh_overflow));
+	hdr->sdh_nentries = 0;
+	mask = hdr->sdh_nbuckets - 1;
+
+	for (n=0; n<nents; n++) {
+		b = dirhashname(ents[n].sfd_name) & mask;
+		placed = 0;
+		for (probes=0; probes<hdr->sdh_nbuckets && !placed; probes++) {
+			for (j=0; j<SFS_DIRPERBLOCK; j++) {
+				i = (b+1)*SFS_DIRPERBLOCK + j;
+				if (d[i].sfd_ino == SFS_NOINO) {
+					d[i] = ents[n];
+					hdr->sdh_nentries++;
+					placed = 1;
+					break;
+				}
+			}
+			if (!placed) {
+				hdr->sdh_overflow[b/8] |= 1 << (b%8);
+				b = (b+1) & mask;
+			}
+		}
+		if (!placed) {
+			free(ents);
+			return -1;
+		}
+	}
+
+	free(ents);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
 static struct sfs_dir *global_sortdirs;
 static
 int
@@ -972,9 +1156,12 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 {
 	struct sfs_inode sfi;
 	struct sfs_dir *direntries;
+	struct sfs_dirhdr hdr;
 	int *sortvector;
 	uint32_t dirsize, ndirentries, maxdirentries, subdircount, i;
+	uint32_t first, nents;
 	int ichanged=0, dchanged=0, dotseen=0, dotdotseen=0;
+	int hashed, reindex=0;
 
 	diskread(&sfi, ino);
 	swapinode(&sfi);
@@ -1013,17 +1200,28 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		bzero(direntries[i].sfd_name, sizeof(direntries[i].sfd_name));
 	}
 
-	for (i=0; i<ndirentries; i++) {
+	/*
+	 * In a hashed directory the first block is the header, not
+	 * entries; skip it everywhere below.
+	 */
+	hashed = dirhash && ndirentries > 0;
+	first = hashed ? SFS_DIRPERBLOCK : 0;
+	if (first > ndirentries) {
+		first = ndirentries;
+	}
+	nents = ndirentries - first;
+
+	for (i=first; i<ndirentries; i++) {
 		if (check_dir_entry(pathsofar, i, &direntries[i])) {
 			dchanged = 1;
 		}
-		sortvector[i] = i;
+		sortvector[i-first] = i;
 	}
 
-	sortdir(sortvector, direntries, ndirentries);
+	sortdir(sortvector, direntries, nents);
 
-	/* don't use ndirentries-1 here in case ndirentries == 0 */
-	for (i=0; i+1<ndirentries; i++) {
+	/* don't use nents-1 here in case nents == 0 */
+	for (i=0; i+1<nents; i++) {
 		struct sfs_dir *d1 = &direntries[sortvector[i]];
 		struct sfs_dir *d2 = &direntries[sortvector[i+1]];
 		assert(d1 != d2);
@@ -1055,7 +1253,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		}
 	}
 
-	for (i=0; i<ndirentries; i++) {
+	for (i=first; i<ndirentries; i++) {
 		if (!strcmp(direntries[i].sfd_name, ".")) {
 			if (direntries[i].sfd_ino != ino) {
 				setbadness(EXIT_RECOV);
@@ -1081,13 +1279,14 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	}
 
 	if (!dotseen) {
-		if (dir_tryadd(direntries, ndirentries, ".", ino)==0) {
+		if (dir_tryadd(direntries+first, nents, ".", ino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory /%s: No `.' entry (added)",
 			      pathsofar);
 			dchanged = 1;
 		}
-		else if (dir_tryadd(direntries, maxdirentries, ".", ino)==0) {
+		else if (!hashed &&
+			 dir_tryadd(direntries, maxdirentries, ".", ino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory /%s: No `.' entry (added)",
 			      pathsofar);
@@ -1104,14 +1303,14 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	}
 
 	if (!dotdotseen) {
-		if (dir_tryadd(direntries, ndirentries, "..", parentino)==0) {
+		if (dir_tryadd(direntries+first, nents, "..", parentino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory /%s: No `..' entry (added)",
 			      pathsofar);
 			dchanged = 1;
 		}
-		else if (dir_tryadd(direntries, maxdirentries, "..", 
-				    parentino)==0) {
+		else if (!hashed && dir_tryadd(direntries, maxdirentries, "..",
+					       parentino)==0) {
 			setbadness(EXIT_RECOV);
 			warnx("Directory /%s: No `..' entry (added)",
 			      pathsofar);
@@ -1128,7 +1327,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	}
 
 	subdircount=0;
-	for (i=0; i<ndirentries; i++) {
+	for (i=first; i<ndirentries; i++) {
 		if (!strcmp(direntries[i].sfd_name, ".")) {
 			/* nothing */
 		}
@@ -1194,8 +1393,47 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
+	if (hashed) {
+		if (dirhash_readhdr(&sfi, &hdr)) {
+			setbadness(EXIT_UNRECOV);
+			warnx("Directory /%s: Bad hash header (NOT FIXED)",
+			      pathsofar);
+			hashed = 0;
+		}
+		else {
+			reindex = dirhash_checkindex(pathsofar, direntries,
+						     ndirentries, &hdr);
+		}
+	}
+
+	if (hashed && (dchanged || reindex)) {
+		/*
+		 * Anything fixed above may have changed a name or added
+		 * an entry in the wrong bucket, so always lay the
+		 * entries out again.
+		 */
+		if (dirhash_rebuild(direntries, ndirentries, &hdr)) {
+			setbadness(EXIT_UNRECOV);
+			warnx("Directory /%s: Entries do not fit in hash "
+			      "buckets (NOT FIXED)", pathsofar);
+			hashed = 0;
+			dchanged = 0;
+		}
+		else {
+			if (reindex) {
+				setbadness(EXIT_RECOV);
+				warnx("Directory /%s: Hash index damaged "
+				      "(index rebuilt)", pathsofar);
+			}
+			dchanged = 1;
+		}
+	}
+
 	if (dchanged) {
 		dirwrite(&sfi, direntries, ndirentries);
+		if (hashed) {
+			dirhash_writehdr(&sfi, &hdr);
+		}
 	}
 
 	if (ichanged) {
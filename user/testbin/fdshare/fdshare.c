@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * fdshare - check descriptor table semantics.
+ *
+ * Descriptors are handed out lowest-free-first, the table grows past
+ * its initial size, dup2 shares the open file (and its offset), and a
+ * child made by fork shares its parent's offset too.
+ */
+
+#include <sys/wait.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define NFILES	60
+
+static int fds[NFILES];
+
+int
+main(int argc, char *argv[])
+{
+	const char *filename = "fdshare.dat";
+	int fd, fd2, i, status;
+	pid_t pid;
+
+	if (argc > 1) {
+		filename = argv[1];
+	}
+
+	fd = open(filename, O_RDWR|O_CREAT|O_TRUNC);
+	if (fd < 0) {
+		err(1, "%s: create", filename);
+	}
+
+	/* fill the table well past its initial size */
+	for (i=0; i<NFILES; i++) {
+		fds[i] = open(filename, O_RDONLY);
+		if (fds[i] < 0) {
+			err(1, "%s: open #%d", filename, i);
+		}
+	}
+	/* the lowest hole gets reused */
+	close(fds[10]);
+	fd2 = open(filename, O_RDONLY);
+	if (fd2 != fds[10]) {
+		errx(1, "open returned %d, expected lowest free %d",
+		     fd2, fds[10]);
+	}
+	for (i=0; i<NFILES; i++) {
+		close(fds[i]);
+	}
+
+	/* dup2 shares the offset */
+	if (dup2(fd, 40) != 40) {
+		err(1, "dup2");
+	}
+	if (write(40, "abcd", 4) != 4) {
+		err(1, "write");
+	}
+	if (lseek(fd, 0, SEEK_CUR) != 4) {
+		errx(1, "dup2'd descriptor has its own offset");
+	}
+	close(40);
+
+	/* so does fork */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		if (write(fd, "efgh", 4) != 4) {
+			err(1, "child write");
+		}
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (lseek(fd, 0, SEEK_CUR) != 8) {
+		errx(1, "child's write did not move the parent's offset");
+	}
+
+	close(fd);
+	printf("fdshare: passed\n");
+	return 0;
+}
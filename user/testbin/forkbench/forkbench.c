@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * forkbench - measure fork latency.
+ *
+ * The parent dirties a buffer of BUFPAGES pages so it has a sizeable
+ * address space, then times ITERATIONS rounds of fork/_exit/waitpid.
+ * Each child writes to the given number of pages of the buffer before
+ * exiting (0 by default), so the cost of copy-on-write can be compared
+ * against a fork that touches nothing.
+ *
+ * usage: forkbench [pages-written-by-child]
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define PAGESIZE	4096
+#define BUFPAGES	256
+#define ITERATIONS	64
+
+static char buf[BUFPAGES * PAGESIZE];
+
+static
+void
+dirty(int npages)
+{
+	int i;
+
+	for (i=0; i<npages; i++) {
+		buf[i * PAGESIZE] = (char)i;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	time_t s0, s1;
+	unsigned long ns0, ns1;
+	unsigned long usecs;
+	int touch = 0;
+	int i, pid, status;
+
+	if (argc == 2) {
+		touch = atoi(argv[1]);
+	}
+	else if (argc != 1 && argc != 0) {
+		errx(1, "usage: forkbench [pages-written-by-child]");
+	}
+	if (touch < 0 || touch > BUFPAGES) {
+		errx(1, "pages written must be between 0 and %d", BUFPAGES);
+	}
+
+	dirty(BUFPAGES);
+
+	__time(&s0, &ns0);
+	for (i=0; i<ITERATIONS; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			dirty(touch);
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+	}
+	__time(&s1, &ns1);
+
+	if (ns1 < ns0) {
+		ns1 += 1000000000;
+		s1--;
+	}
+	usecs = (s1 - s0) * 1000000 + (ns1 - ns0) / 1000;
+
+	printf("forkbench: %d forks of a %d-page process, child writes %d "
+	       "pages\n", ITERATIONS, BUFPAGES, touch);
+	printf("forkbench: %lu us total, %lu us per fork\n",
+	       usecs, usecs / ITERATIONS);
+	return 0;
+}
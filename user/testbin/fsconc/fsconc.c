@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * fsconc - concurrent file I/O throughput.
+ *
+ * Usage: fsconc [nprocs] [kbytes]
+ *
+ * Forks NPROCS children. Each writes its own KBYTES file, reads it
+ * back several times and removes it, so the processes touch unrelated
+ * files and only contend inside the filesystem. The parent prints the
+ * elapsed time and the aggregate read rate. Run it with 1 and then
+ * with several processes on a multiprocessor to see how well file
+ * I/O scales; dirconc covers concurrent directory operations.
+ */
+
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define MAXPROCS	16
+#define NPASSES		4
+#define BUFSIZE		4096
+
+static char buf[BUFSIZE];
+
+/* microseconds since an arbitrary start */
+static
+unsigned long
+now_usec(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long)secs * 1000000 + nsecs / 1000;
+}
+
+static
+void
+worker(int n, unsigned kbytes)
+{
+	char name[32];
+	unsigned i, pass;
+	int fd, r;
+
+	snprintf(name, sizeof(name), "fsconc.%d", n);
+	memset(buf, 'a' + n, sizeof(buf));
+
+	fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", name);
+	}
+	for (i=0; i<kbytes; i += BUFSIZE/1024) {
+		r = write(fd, buf, BUFSIZE);
+		if (r != BUFSIZE) {
+			err(1, "%s: write", name);
+		}
+	}
+	close(fd);
+
+	for (pass=0; pass<NPASSES; pass++) {
+		fd = open(name, O_RDONLY);
+		if (fd < 0) {
+			err(1, "%s: open", name);
+		}
+		while ((r = read(fd, buf, BUFSIZE)) > 0) {
+			if (buf[0] != 'a' + n || buf[r-1] != 'a' + n) {
+				errx(1, "%s: bad data", name);
+			}
+		}
+		if (r < 0) {
+			err(1, "%s: read", name);
+		}
+		close(fd);
+	}
+
+	if (remove(name) < 0) {
+		err(1, "%s: remove", name);
+	}
+	_exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	pid_t pids[MAXPROCS];
+	unsigned long t0, elapsed;
+	unsigned kbytes = 256;
+	int nprocs = 4, i, status, failed = 0;
+
+	if (argc > 1) {
+		nprocs = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		kbytes = atoi(argv[2]);
+	}
+	if (nprocs < 1 || nprocs > MAXPROCS || kbytes < BUFSIZE/1024) {
+		errx(1, "Usage: fsconc [nprocs] [kbytes], nprocs <= %d",
+		     MAXPROCS);
+	}
+
+	t0 = now_usec();
+	for (i=0; i<nprocs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			worker(i, kbytes);
+		}
+	}
+	for (i=0; i<nprocs; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed++;
+		}
+	}
+	elapsed = now_usec() - t0;
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+
+	printf("fsconc: %d processes x %u KB x %d reads in %lu ms, "
+	       "%lu KB/s read\n", nprocs, kbytes, NPASSES, elapsed / 1000,
+	       (unsigned long)((unsigned long long)nprocs * kbytes * NPASSES
+			       * 1000000 / elapsed));
+	if (failed) {
+		errx(1, "%d workers failed", failed);
+	}
+	return 0;
+}
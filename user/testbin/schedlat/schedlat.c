@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * schedlat - interactive latency under cpu load.
+ *
+ * Usage: schedlat [nhogs]
+ *
+ * Forks NHOGS children that spin, counting loops, for a few seconds.
+ * Meanwhile the parent plays the interactive process: it writes one
+ * character at a time to the console, which sleeps waiting for the
+ * device, and times each write. At the end it prints the median, 99th
+ * percentile and worst write latency, and each hog prints how many
+ * loops it got through, for batch throughput.
+ *
+ * Run it with and without the defaultscheduler option to compare.
+ */
+
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define MAXHOGS		8
+#define NSAMPLES	200
+#define HOGSECS		5
+
+static unsigned long samples[NSAMPLES];
+
+/* microseconds since an arbitrary start */
+static
+unsigned long
+now_usec(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long)secs * 1000000 + nsecs / 1000;
+}
+
+static
+void
+hog(int n)
+{
+	unsigned long start, loops = 0;
+	volatile int i;
+
+	start = now_usec();
+	while (now_usec() - start < HOGSECS * 1000000UL) {
+		for (i=0; i<1000; i++)
+			;
+		loops++;
+	}
+	printf("hog %d: %lu loops\n", n, loops);
+	_exit(0);
+}
+
+static
+void
+sort(unsigned long *v, int n)
+{
+	unsigned long x;
+	int i, j;
+
+	for (i=1; i<n; i++) {
+		x = v[i];
+		for (j=i; j>0 && v[j-1] > x; j--) {
+			v[j] = v[j-1];
+		}
+		v[j] = x;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	pid_t pids[MAXHOGS];
+	unsigned long t0;
+	int nhogs = 4, i, status;
+
+	if (argc > 1) {
+		nhogs = atoi(argv[1]);
+	}
+	if (nhogs < 0 || nhogs > MAXHOGS) {
+		errx(1, "Usage: schedlat [nhogs], nhogs <= %d", MAXHOGS);
+	}
+
+	for (i=0; i<nhogs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			hog(i);
+		}
+	}
+
+	for (i=0; i<NSAMPLES; i++) {
+		t0 = now_usec();
+		if (write(STDOUT_FILENO, ".", 1) != 1) {
+			err(1, "write");
+		}
+		samples[i] = now_usec() - t0;
+	}
+	printf("\n");
+
+	sort(samples, NSAMPLES);
+	printf("console write latency with %d hogs: "
+	       "median %lu us, p99 %lu us, max %lu us\n", nhogs,
+	       samples[NSAMPLES / 2], samples[NSAMPLES * 99 / 100],
+	       samples[NSAMPLES - 1]);
+
+	for (i=0; i<nhogs; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+	}
+	return 0;
+}
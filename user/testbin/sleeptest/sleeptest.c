@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * sleeptest - check nanosleep.
+ *
+ * Sleeps for a range of intervals, from well under a clock tick up to
+ * a second, and reports how long each actually took. A sleep must
+ * never be shorter than asked for; it may be longer by up to a tick
+ * or so. Also checks that bad arguments are refused.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+static const long intervals[] = {	/* nanoseconds */
+	100000,		/* 0.1 ms */
+	1000000,	/* 1 ms */
+	10000000,	/* 10 ms */
+	25000000,	/* 25 ms */
+	100000000,	/* 100 ms */
+	999999999,	/* just under 1 s */
+};
+
+#define NINTERVALS (sizeof(intervals) / sizeof(intervals[0]))
+
+/* nanoseconds from (s0,n0) to (s1,n1); fine for short intervals */
+static
+long
+elapsed(time_t s0, unsigned long n0, time_t s1, unsigned long n1)
+{
+	return (long)(s1 - s0) * 1000000000 + (long)n1 - (long)n0;
+}
+
+int
+main(void)
+{
+	struct timespec ts, rem;
+	time_t s0, s1;
+	unsigned long n0, n1;
+	long took;
+	unsigned i;
+	int bad = 0;
+
+	for (i=0; i<NINTERVALS; i++) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = intervals[i];
+		__time(&s0, &n0);
+		if (nanosleep(&ts, &rem) < 0) {
+			err(1, "nanosleep %ld ns", intervals[i]);
+		}
+		__time(&s1, &n1);
+		took = elapsed(s0, n0, s1, n1);
+		printf("asked %9ld ns, slept %9ld ns%s\n", intervals[i], took,
+		       took < intervals[i] ? "  ** TOO SHORT **" : "");
+		if (took < intervals[i]) {
+			bad = 1;
+		}
+	}
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000000;
+	if (nanosleep(&ts, NULL) == 0 || errno != EINVAL) {
+		warnx("nanosleep with tv_nsec of 1e9 was not refused");
+		bad = 1;
+	}
+	ts.tv_sec = -1;
+	ts.tv_nsec = 0;
+	if (nanosleep(&ts, NULL) == 0 || errno != EINVAL) {
+		warnx("nanosleep with negative tv_sec was not refused");
+		bad = 1;
+	}
+
+	printf("sleeptest %s\n", bad ? "FAILED" : "passed");
+	return bad;
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * vectorio - exercise readv/writev and pread/pwrite.
+ *
+ * Writes NRECS records, each a fixed header and a payload gathered
+ * from two buffers by one writev, reads them back with readv, then
+ * patches and checks a record with pwrite/pread and makes sure the
+ * file offset didn't move.
+ */
+
+#include <sys/uio.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define NRECS		64
+#define HDRSIZE		16
+#define PAYSIZE		240
+#define RECSIZE		(HDRSIZE + PAYSIZE)
+
+static char hdr[HDRSIZE];
+static char payload[PAYSIZE];
+static char buf[RECSIZE];
+
+static
+void
+fillrec(int n)
+{
+	int i;
+
+	memset(hdr, 0, sizeof(hdr));
+	snprintf(hdr, sizeof(hdr), "rec %d", n);
+	for (i=0; i<PAYSIZE; i++) {
+		payload[i] = 'a' + (n + i) % 26;
+	}
+}
+
+static
+void
+checkrec(int n, const char *what)
+{
+	fillrec(n);
+	if (memcmp(buf, hdr, HDRSIZE) || memcmp(buf+HDRSIZE, payload, PAYSIZE)) {
+		errx(1, "%s: record %d is wrong", what, n);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *filename = "vectorio.dat";
+	struct iovec iov[2];
+	off_t pos;
+	int fd, i, r;
+
+	if (argc > 1) {
+		filename = argv[1];
+	}
+
+	fd = open(filename, O_RDWR|O_CREAT|O_TRUNC);
+	if (fd < 0) {
+		err(1, "%s: create", filename);
+	}
+
+	/* gather header and payload into one write per record */
+	for (i=0; i<NRECS; i++) {
+		fillrec(i);
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = HDRSIZE;
+		iov[1].iov_base = payload;
+		iov[1].iov_len = PAYSIZE;
+		r = writev(fd, iov, 2);
+		if (r < 0) {
+			err(1, "%s: writev", filename);
+		}
+		if (r != RECSIZE) {
+			errx(1, "%s: writev: short count %d", filename, r);
+		}
+	}
+
+	/* scatter them back into one buffer in two pieces */
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", filename);
+	}
+	for (i=0; i<NRECS; i++) {
+		iov[0].iov_base = buf;
+		iov[0].iov_len = HDRSIZE;
+		iov[1].iov_base = buf + HDRSIZE;
+		iov[1].iov_len = PAYSIZE;
+		r = readv(fd, iov, 2);
+		if (r < 0) {
+			err(1, "%s: readv", filename);
+		}
+		if (r != RECSIZE) {
+			errx(1, "%s: readv: short count %d", filename, r);
+		}
+		checkrec(i, "readv");
+	}
+
+	/* positioned I/O: rewrite record 5 as record 7, read it back */
+	pos = lseek(fd, 0, SEEK_CUR);
+	fillrec(7);
+	memcpy(buf, hdr, HDRSIZE);
+	memcpy(buf+HDRSIZE, payload, PAYSIZE);
+	if (pwrite(fd, buf, RECSIZE, 5*RECSIZE) != RECSIZE) {
+		err(1, "%s: pwrite", filename);
+	}
+	memset(buf, 0, sizeof(buf));
+	if (pread(fd, buf, RECSIZE, 5*RECSIZE) != RECSIZE) {
+		err(1, "%s: pread", filename);
+	}
+	checkrec(7, "pread");
+	if (lseek(fd, 0, SEEK_CUR) != pos) {
+		errx(1, "%s: pread/pwrite moved the file offset", filename);
+	}
+
+	close(fd);
+	printf("vectorio: passed\n");
+	return 0;
+}